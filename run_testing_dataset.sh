@@ -56,7 +56,7 @@ echo -e "Command line: $CMD${BG}"
 $CMD
 if [ $? != 0 ]
 then
-	echo -e "${RED}ERROR: Generate makefile failed! Please check whether you have correctly installed 'bowtie2' and 'samtools'!${BG}"
+	echo -e "${RED}ERROR: Generate makefile failed! Please check whether you have correctly installed 'bowtie2'!${BG}"
 	exit 1
 fi
 ## run analysis
@@ -82,7 +82,7 @@ echo -e "Command line: $CMD${BG}"
 $CMD
 if [ $? != 0 ]
 then
-	echo -e "${RED}ERROR: Generate makefile failed! Please check whether you have correctly installed 'bowtie2' and 'samtools'!${BG}"
+	echo -e "${RED}ERROR: Generate makefile failed! Please check whether you have correctly installed 'bowtie2'!${BG}"
 	exit 1
 fi
 ## run analysis
@@ -0,0 +1,617 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <omp.h>
+#include "bam.h"
+
+using namespace std;
+
+/*
+ * Author: Kun Sun (sunkun@szbl.ac.cn)
+ * This program is part of the Msuite package
+ * Date: Oct 2026
+ *
+ * Implementation of the BAM writer, see bam.h for the design.
+ * Numbers are in native (little-endian) byte order, the same as the BAM specification.
+**/
+
+const char BGZF_EOF_BLOCK[ 28 ] = { 0x1f, (char)0x8b, 8, 4, 0, 0, 0, 0, 0, (char)0xff, 6, 0, 0x42, 0x43, 2, 0,
+									0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+// 4-bit encoding of the bases: "=ACMGRSVTWYHKDBN"
+static unsigned char base_code[ 256 ];
+
+static void init_base_code() {
+	const char *bases = "=ACMGRSVTWYHKDBN";
+	memset( base_code, 15, 256 );
+	for( unsigned int i=0; i!=16; ++i ) {
+		base_code[ (unsigned char)bases[i] ] = i;
+		base_code[ (unsigned char)tolower(bases[i]) ] = i;
+	}
+}
+
+// CIGAR operations: "MIDNSHP=X"
+static int cigar_code( char c ) {
+	switch( c ) {
+		case 'M': return 0;
+		case 'I': return 1;
+		case 'D': return 2;
+		case 'N': return 3;
+		case 'S': return 4;
+		case 'H': return 5;
+		case 'P': return 6;
+		case '=': return 7;
+		case 'X': return 8;
+		default : return 0;
+	}
+}
+
+int reg2bin( int beg, int end ) {
+	-- end;
+	if( beg>>14 == end>>14 ) return ((1<<15)-1)/7 + (beg>>14);
+	if( beg>>17 == end>>17 ) return ((1<<12)-1)/7 + (beg>>17);
+	if( beg>>20 == end>>20 ) return ((1<<9)-1)/7  + (beg>>20);
+	if( beg>>23 == end>>23 ) return ((1<<6)-1)/7  + (beg>>23);
+	if( beg>>26 == end>>26 ) return ((1<<3)-1)/7  + (beg>>26);
+	return 0;
+}
+
+static inline char * put_i32( char *o, int32_t v ) {
+	memcpy( o, &v, 4 );
+	return o + 4;
+}
+
+static inline char * put_u16( char *o, uint16_t v ) {
+	memcpy( o, &v, 2 );
+	return o + 2;
+}
+
+// B-type array "subtype,v1,v2,..." => subtype, int32 count and the packed values;
+// returns NULL if the subtype is invalid
+static char * put_array( char *o, const char *v, unsigned int vl ) {
+	char sub = v[0];
+	if( sub=='\0' || strchr("cCsSiIf", sub)==NULL )
+		return NULL;
+	char *cnt = o + 1;
+	*o = sub;
+	o += 5;
+	int32_t n = 0;
+	const char *e = v + vl;
+	char *next;
+	for( const char *x=v+1; x!=e && *x==','; x=next, ++n ) {
+		++ x;
+		switch( sub ) {
+			case 'c': { int8_t   y=strtol(x, &next, 10);  memcpy(o, &y, 1); o+=1; break; }
+			case 'C': { uint8_t  y=strtoul(x, &next, 10); memcpy(o, &y, 1); o+=1; break; }
+			case 's': { int16_t  y=strtol(x, &next, 10);  memcpy(o, &y, 2); o+=2; break; }
+			case 'S': { uint16_t y=strtoul(x, &next, 10); memcpy(o, &y, 2); o+=2; break; }
+			case 'i': { int32_t  y=strtol(x, &next, 10);  memcpy(o, &y, 4); o+=4; break; }
+			case 'I': { uint32_t y=strtoul(x, &next, 10); memcpy(o, &y, 4); o+=4; break; }
+			default : { float    y=strtof(x, &next);      memcpy(o, &y, 4); o+=4; break; }	// 'f'
+		}
+	}
+	put_i32( cnt, n );
+	return o;
+}
+
+static inline int get_ref_id( const char *p, unsigned int len, const bam_refs & refs ) {
+	if( len==1 && p[0]=='*' )
+		return -1;
+	unordered_map<string, int>::const_iterator it = refs.id.find( string(p, len) );
+	return ( it == refs.id.end() ) ? -1 : it->second;
+}
+
+// the references MUST be loaded before encoding any record
+bool load_bam_refs( const char *chrinfo, bam_refs & refs ) {
+	init_base_code();
+	ifstream fin( chrinfo );
+	if( fin.fail() ) {
+		cerr << "Error: could not open file '" << chrinfo << "'!\n";
+		return false;
+	}
+	string line, chr;
+	unsigned int len;
+	stringstream ss;
+	while( true ) {
+		getline( fin, line );
+		if( fin.eof() )break;
+		if( line.empty() || line[0] == '#' )continue;
+
+		ss.str( line );
+		ss.clear();
+		ss >> chr >> len;
+		refs.id[ chr ] = refs.name.size();
+		refs.name.push_back( chr );
+		refs.len.push_back( len );
+	}
+	fin.close();
+	return true;
+}
+
+void make_sam_header( const bam_refs & refs, string & text ) {
+	stringstream ss;
+	ss << "@HD\tVN:1.0\tSO:unsorted\n";
+	for( unsigned int i=0; i!=refs.name.size(); ++i )
+		ss << "@SQ\tSN:" << refs.name[i] << "\tLN:" << refs.len[i] << '\n';
+	text = ss.str();
+}
+
+unsigned int sam_to_bam( const char *line, unsigned int len, const bam_refs & refs, char *out ) {
+	// locate the 11 mandatory fields
+	const char *f[ 11 ];
+	unsigned int fl[ 11 ];
+	const char *p = line, *end = line + len;
+	for( unsigned int k=0; k!=11; ++k ) {
+		f[k] = p;
+		while( p!=end && *p!='\t' ) ++ p;
+		fl[k] = p - f[k];
+		if( p != end ) ++ p;
+	}
+	const char *tags = p;
+
+	int refID = get_ref_id( f[2], fl[2], refs );
+	int pos   = atoi( f[3] ) - 1;
+	int mapq  = ( f[4][0]=='*' ) ? 255 : atoi( f[4] );
+	int nextRefID = ( fl[6]==1 && f[6][0]=='=' ) ? refID : get_ref_id( f[6], fl[6], refs );
+	int nextPos = atoi( f[7] ) - 1;
+	int tlen  = atoi( f[8] );
+	unsigned int flag = atoi( f[1] );
+	unsigned int lseq = ( fl[9]==1 && f[9][0]=='*' ) ? 0 : fl[9];
+
+	// variable-length data first, the fixed-length part is filled afterwards
+	char *o = out + 36;
+	memcpy( o, f[0], fl[0] );
+	o += fl[0];
+	*o++ = 0;
+
+	// CIGAR
+	unsigned int ncigar = 0;
+	int refLen = 0;
+	if( !(fl[5]==1 && f[5][0]=='*') ) {
+		unsigned int n = 0;
+		for( const char *c=f[5]; c!=f[5]+fl[5]; ++c ) {
+			if( *c>='0' && *c<='9' ) {
+				n = n*10 + (*c - '0');
+			} else {
+				int op = cigar_code( *c );
+				uint32_t v = (n << 4) | op;
+				memcpy( o, &v, 4 );
+				o += 4;
+				++ ncigar;
+				if( op==0 || op==2 || op==3 || op==7 || op==8 )
+					refLen += n;
+				n = 0;
+			}
+		}
+	}
+
+	// sequence and quality
+	const unsigned char *s = (const unsigned char *)f[9];
+	for( unsigned int i=0; i+1<lseq; i+=2 )
+		*o++ = (base_code[s[i]] << 4) | base_code[s[i+1]];
+	if( lseq & 1 )
+		*o++ = base_code[ s[lseq-1] ] << 4;
+	if( fl[10]==1 && f[10][0]=='*' ) {
+		memset( o, 0xff, lseq );
+	} else {
+		for( unsigned int i=0; i!=lseq; ++i )
+			o[i] = f[10][i] - 33;
+	}
+	o += lseq;
+
+	// optional fields: TAG:TYPE:VALUE
+	while( tags+5 <= end ) {
+		const char *t = tags;
+		while( tags!=end && *tags!='\t' ) ++ tags;
+		unsigned int tl = tags - t;
+		if( tags != end ) ++ tags;
+		if( tl < 5 ) continue;
+
+		o[0] = t[0];
+		o[1] = t[1];
+		const char *v = t + 5;
+		unsigned int vl = tl - 5;
+		if( t[3] == 'i' ) {	// the smallest type that holds the value, as samtools does
+			long x = strtol( v, NULL, 10 );
+			if( x < 0 ) {
+				if( x >= -128 )			{ o[2]='c'; int8_t  y=x; memcpy(o+3, &y, 1); o+=4; }
+				else if( x >= -32768 )	{ o[2]='s'; int16_t y=x; memcpy(o+3, &y, 2); o+=5; }
+				else					{ o[2]='i'; int32_t y=x; memcpy(o+3, &y, 4); o+=7; }
+			} else {
+				if( x <= 255 )			{ o[2]='C'; uint8_t  y=x; memcpy(o+3, &y, 1); o+=4; }
+				else if( x <= 65535 )	{ o[2]='S'; uint16_t y=x; memcpy(o+3, &y, 2); o+=5; }
+				else					{ o[2]='I'; uint32_t y=x; memcpy(o+3, &y, 4); o+=7; }
+			}
+		} else if( t[3] == 'A' ) {
+			o[2] = 'A';
+			o[3] = v[0];
+			o += 4;
+		} else if( t[3] == 'f' ) {
+			float y = strtof( v, NULL );
+			o[2] = 'f';
+			memcpy( o+3, &y, 4 );
+			o += 7;
+		} else if( t[3] == 'B' ) {
+			o[2] = 'B';
+			char *a = ( vl != 0 ) ? put_array( o+3, v, vl ) : NULL;
+			if( a == NULL ) {
+				cerr << "Warning: invalid array tag '" << string(t, tl) << "' is not written to BAM!\n";
+				continue;
+			}
+			o = a;
+		} else {	// Z and H are kept as strings
+			o[2] = ( t[3]=='H' ) ? 'H' : 'Z';
+			memcpy( o+3, v, vl );
+			o[ 3+vl ] = 0;
+			o += 4 + vl;
+		}
+	}
+
+	// the fixed-length part
+	int bin = reg2bin( pos, refLen ? pos+refLen : pos+1 );
+	char *q = out;
+	q = put_i32( q, o-out-4 );	// block_size
+	q = put_i32( q, refID );
+	q = put_i32( q, pos );
+	*q++ = fl[0] + 1;	// l_read_name
+	*q++ = mapq;
+	q = put_u16( q, bin );
+	q = put_u16( q, ncigar );
+	q = put_u16( q, flag );
+	q = put_i32( q, lseq );
+	q = put_i32( q, nextRefID );
+	q = put_i32( q, nextPos );
+	put_i32( q, tlen );
+
+	return o - out;
+}
+
+size_t sam_block_to_bam( const char *text, size_t len, const bam_refs & refs, char *& out, size_t & capacity ) {
+	size_t size = 0;
+	const char *p = text, *end = text + len;
+	while( p != end ) {
+		const char *e = (const char *) memchr( p, '\n', end-p );
+		if( e == NULL )
+			e = end;
+		unsigned int l = e - p;
+		if( l ) {
+			// a BAM record is at most twice the size of its SAM line (e.g., "1M" => 4 bytes)
+			if( size + 2*l + BAM_RECORD_EXTRA > capacity ) {
+				capacity = ( size + 2*l + BAM_RECORD_EXTRA ) << 1;
+				out = (char *) realloc( out, capacity );
+			}
+			size += sam_to_bam( p, l, refs, out+size );
+		}
+		p = ( e==end ) ? end : e+1;
+	}
+	return size;
+}
+
+size_t bgzf_bound( size_t len ) {
+	return ( len/BAM_BLOCK_DATA + 1 ) * BAM_BLOCK_MAX;
+}
+
+size_t bgzf_compress( const char *src, size_t len, char *dst, int level ) {
+	z_stream strm;
+	memset( &strm, 0, sizeof(z_stream) );
+	deflateInit2( &strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY );	// raw deflate
+
+	size_t size = 0;
+	while( len ) {
+		unsigned int n = ( len > BAM_BLOCK_DATA ) ? BAM_BLOCK_DATA : len;
+		unsigned char *b = (unsigned char *)dst + size;
+		// gzip header with the BC extra field
+		const unsigned char head[ 16 ] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 0x42, 0x43, 2, 0 };
+		memcpy( b, head, 16 );
+
+		deflateReset( &strm );
+		strm.next_in   = (Bytef *)src;
+		strm.avail_in  = n;
+		strm.next_out  = b + 18;
+		strm.avail_out = BAM_BLOCK_MAX - 26;
+		deflate( &strm, Z_FINISH );
+		unsigned int clen = BAM_BLOCK_MAX - 26 - strm.avail_out;
+
+		unsigned int bsize = clen + 26;
+		put_u16( (char *)b+16, bsize-1 );
+		uint32_t crc = crc32( crc32(0L, Z_NULL, 0), (const Bytef *)src, n );
+		memcpy( b+18+clen, &crc, 4 );
+		uint32_t isize = n;
+		memcpy( b+22+clen, &isize, 4 );
+
+		size += bsize;
+		src  += n;
+		len  -= n;
+	}
+	deflateEnd( &strm );
+	return size;
+}
+
+void bam_header_blocks( const string & text, const bam_refs & refs, string & out ) {
+	string raw = "BAM\1";
+	char buf[ 4 ];
+	put_i32( buf, text.size() );
+	raw.append( buf, 4 );
+	raw += text;
+	put_i32( buf, refs.name.size() );
+	raw.append( buf, 4 );
+	for( unsigned int i=0; i!=refs.name.size(); ++i ) {
+		put_i32( buf, refs.name[i].size()+1 );
+		raw.append( buf, 4 );
+		raw.append( refs.name[i].c_str(), refs.name[i].size()+1 );
+		put_i32( buf, refs.len[i] );
+		raw.append( buf, 4 );
+	}
+
+	char *dst = new char[ bgzf_bound(raw.size()) ];
+	size_t size = bgzf_compress( raw.data(), raw.size(), dst, BAM_COMPRESS_LEVEL );
+	out.assign( dst, size );
+	delete [] dst;
+}
+
+bool write_all( int fd, const char *p, size_t size ) {
+	while( size ) {
+		ssize_t w = write( fd, p, size );
+		if( w <= 0 )
+			return false;
+		p += w;
+		size -= w;
+	}
+	return true;
+}
+
+bool open_bam_writer( bam_writer & bw, const char *file, const char *chrinfo, const char *header, unsigned int thread ) {
+	bw.thread = thread ? thread : 1;
+	bw.error = false;
+	if( ! load_bam_refs(chrinfo, bw.refs) )
+		return false;
+
+	string text;
+	if( header!=NULL && strcmp(header, "null")!=0 ) {	// use the header lines in the given SAM file
+		ifstream fin( header );
+		if( fin.fail() ) {
+			cerr << "Error: could not open file '" << header << "'!\n";
+			return false;
+		}
+		string line;
+		while( getline(fin, line) ) {
+			if( line[0] != '@' )
+				break;
+			text += line;
+			text += '\n';
+		}
+		fin.close();
+	} else {
+		make_sam_header( bw.refs, text );
+	}
+
+	bw.fd = open( file, O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+	if( bw.fd < 0 ) {
+		cerr << "Error: could not write file '" << file << "'!\n";
+		return false;
+	}
+	string blocks;
+	bam_header_blocks( text, bw.refs, blocks );
+	if( ! write_all(bw.fd, blocks.data(), blocks.size()) )
+		bw.error = true;
+
+	bw.bam.assign( bw.thread, NULL );
+	bw.bgzf.assign( bw.thread, NULL );
+	bw.bamSize.assign( bw.thread, 0 );
+	bw.bgzfSize.assign( bw.thread, 0 );
+	bw.text.reserve( BAM_WRITER_BUFFER * bw.thread );
+	return true;
+}
+
+// convert and compress the collected lines; each thread works on a slice cut at line boundaries
+static void flush_bam_writer( bam_writer & bw ) {
+	if( bw.text.empty() )
+		return;
+	unsigned int thread = bw.thread;
+	const char *text = bw.text.data();
+	size_t len = bw.text.size();
+	vector<size_t> cut( thread+1 );
+	cut[0] = 0;
+	for( unsigned int i=1; i!=thread; ++i ) {
+		size_t c = len * i / thread;
+		if( c < cut[i-1] )
+			c = cut[i-1];
+		while( c!=len && c!=0 && text[c-1]!='\n' ) ++ c;
+		cut[i] = c;
+	}
+	cut[thread] = len;
+	vector<size_t> outSize( thread );
+
+	#pragma omp parallel for num_threads( thread ) schedule( static, 1 )
+	for( unsigned int i=0; i<thread; ++i ) {
+		size_t bamCap = bw.bamSize[i];
+		size_t bamLen = sam_block_to_bam( text+cut[i], cut[i+1]-cut[i], bw.refs, bw.bam[i], bamCap );
+		bw.bamSize[i] = bamCap;
+		size_t need = bgzf_bound( bamLen );
+		if( need > bw.bgzfSize[i] ) {
+			bw.bgzf[i] = (char *) realloc( bw.bgzf[i], need );
+			bw.bgzfSize[i] = need;
+		}
+		outSize[i] = bgzf_compress( bw.bam[i], bamLen, bw.bgzf[i], BAM_COMPRESS_LEVEL );
+	}
+	for( unsigned int i=0; i!=thread; ++i ) {
+		if( ! write_all(bw.fd, bw.bgzf[i], outSize[i]) )
+			bw.error = true;
+	}
+	bw.text.clear();
+}
+
+void bam_write_line( bam_writer & bw, const string & line ) {
+	bw.text += line;
+	bw.text += '\n';
+	if( bw.text.size() >= BAM_WRITER_BUFFER * bw.thread )
+		flush_bam_writer( bw );
+}
+
+void bam_write_text( bam_writer & bw, const char *text, size_t len ) {
+	bw.text.append( text, len );
+	if( bw.text.size() >= BAM_WRITER_BUFFER * bw.thread )
+		flush_bam_writer( bw );
+}
+
+bool close_bam_writer( bam_writer & bw ) {
+	flush_bam_writer( bw );
+	if( ! write_all(bw.fd, BGZF_EOF_BLOCK, 28) )
+		bw.error = true;
+	close( bw.fd );
+	for( unsigned int i=0; i!=bw.thread; ++i ) {
+		free( bw.bam[i] );
+		free( bw.bgzf[i] );
+	}
+	if( bw.error )
+		cerr << "Error: write BAM file failed!\n";
+	return ! bw.error;
+}
+
+// read as much as possible (up to size), returns the number of bytes read
+static size_t read_all( int fd, char *p, size_t size ) {
+	size_t got = 0;
+	while( got != size ) {
+		ssize_t r = read( fd, p+got, size-got );
+		if( r <= 0 )
+			break;
+		got += r;
+	}
+	return got;
+}
+
+bool open_bgzf_reader( bgzf_reader & br, const char *file, unsigned int thread ) {
+	br.fd = open( file, O_RDONLY );
+	if( br.fd < 0 ) {
+		cerr << "Error: could not open file '" << file << "'!\n";
+		return false;
+	}
+	br.thread = thread ? thread : 1;
+	br.error = false;
+	br.pos = 0;
+	br.size = 0;
+	return true;
+}
+
+// load and inflate the next batch of blocks, the unread data is kept; returns false if no more data
+static bool load_bgzf_batch( bgzf_reader & br ) {
+	vector<size_t> coff, uoff;
+	size_t left = br.size - br.pos;
+	if( left )
+		memmove( &br.data[0], &br.data[br.pos], left );
+	size_t usize = left;
+
+	br.raw.clear();
+	unsigned int n = BAM_READER_BLOCKS * br.thread;
+	for( unsigned int i=0; i!=n; ++i ) {
+		unsigned char head[ 18 ];
+		size_t r = read_all( br.fd, (char *)head, 18 );
+		if( r == 0 )	// end of file
+			break;
+		// only BGZF blocks with the BC extra field only (i.e., written by htslib or Msuite) are supported
+		if( r!=18 || head[0]!=0x1f || head[1]!=0x8b || head[3]!=4 || head[10]!=6 || head[11]!=0
+				|| head[12]!='B' || head[13]!='C' ) {
+			cerr << "Error: invalid BGZF block!\n";
+			br.error = true;
+			break;
+		}
+		unsigned int bsize = ( head[16] | (head[17]<<8) ) + 1;
+		size_t off = br.raw.size();
+		br.raw.append( (char *)head, 18 );
+		br.raw.resize( off + bsize );
+		if( bsize < 26 || read_all(br.fd, &br.raw[off+18], bsize-18) != bsize-18 ) {
+			cerr << "Error: truncated BGZF block!\n";
+			br.error = true;
+			break;
+		}
+		uint32_t isize;
+		memcpy( &isize, &br.raw[off+bsize-4], 4 );
+		coff.push_back( off );
+		uoff.push_back( usize );
+		usize += isize;
+	}
+	coff.push_back( br.raw.size() );
+	if( br.data.size() < usize )
+		br.data.resize( usize );
+
+	int nb = uoff.size();
+	bool fail = false;
+	#pragma omp parallel for num_threads( br.thread ) schedule( dynamic, 1 )
+	for( int b=0; b<nb; ++b ) {
+		size_t clen = coff[b+1] - coff[b];
+		size_t ulen = ( (b+1<nb) ? uoff[b+1] : usize ) - uoff[b];
+		if( ulen == 0 )	// empty block (e.g., the EOF marker)
+			continue;
+		z_stream strm;
+		memset( &strm, 0, sizeof(z_stream) );
+		inflateInit2( &strm, -15 );	// raw inflate
+		strm.next_in   = (Bytef *)&br.raw[ coff[b]+18 ];
+		strm.avail_in  = clen - 26;
+		strm.next_out  = (Bytef *)&br.data[ uoff[b] ];
+		strm.avail_out = ulen;
+		if( inflate(&strm, Z_FINISH) != Z_STREAM_END || strm.avail_out != 0 )
+			fail = true;
+		inflateEnd( &strm );
+	}
+	if( fail ) {
+		cerr << "Error: corrupted BGZF block!\n";
+		br.error = true;
+	}
+	br.pos = 0;
+	br.size = usize;
+	return !br.error && usize > left;
+}
+
+bool bgzf_read( bgzf_reader & br, char *dst, size_t size ) {
+	while( br.size - br.pos < size ) {
+		if( br.error || ! load_bgzf_batch(br) )
+			return false;
+	}
+	memcpy( dst, &br.data[br.pos], size );
+	br.pos += size;
+	return true;
+}
+
+void close_bgzf_reader( bgzf_reader & br ) {
+	close( br.fd );
+	br.raw.clear();
+	vector<char>().swap( br.data );
+}
+
+bool read_bam_header( bgzf_reader & br, string & text, bam_refs & refs ) {
+	char magic[ 4 ];
+	int32_t n;
+	if( ! bgzf_read(br, magic, 4) || memcmp(magic, "BAM\1", 4)!=0 || ! bgzf_read(br, (char *)&n, 4) || n<0 ) {
+		cerr << "Error: invalid BAM header!\n";
+		return false;
+	}
+	text.resize( n );
+	if( n && ! bgzf_read(br, &text[0], n) )
+		return false;
+	text.resize( strlen(text.c_str()) );	// the text could be NUL-padded
+
+	if( ! bgzf_read(br, (char *)&n, 4) || n<0 )
+		return false;
+	refs.name.clear();
+	refs.len.clear();
+	refs.id.clear();
+	for( int32_t i=0; i!=n; ++i ) {
+		int32_t l;
+		if( ! bgzf_read(br, (char *)&l, 4) || l<=0 )
+			return false;
+		string name( l, 0 );
+		if( ! bgzf_read(br, &name[0], l) || ! bgzf_read(br, (char *)&l, 4) )
+			return false;
+		name.resize( name.size()-1 );
+		refs.id[ name ] = refs.name.size();
+		refs.name.push_back( name );
+		refs.len.push_back( l );
+	}
+	return true;
+}
@@ -0,0 +1,106 @@
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include <tr1/unordered_map>
+
+using namespace std;
+using namespace std::tr1;
+
+/*
+ * Author: Kun Sun (sunkun@szbl.ac.cn)
+ * This program is part of the Msuite package
+ * Date: Oct 2026
+ *
+ * BAM output for bowtie2.processer and rmdup, so that no samtools process is needed to convert
+ * the SAM text. The SAM records generated by Msuite are encoded into the native binary records
+ * and packed into BGZF blocks (deflate, at most BAM_BLOCK_DATA bytes of input per block).
+ * A BGZF stream could be cut into blocks anywhere, so each thread compresses its own slice of the
+ * output into a series of complete blocks, and the blocks are written in thread order.
+ * The reference sequences (and their IDs) are loaded from chr.info.
+**/
+
+#ifndef _MSUITE_BAM_
+#define _MSUITE_BAM_
+
+const unsigned int BAM_BLOCK_DATA	= 0xff00;	// uncompressed bytes per BGZF block (same as htslib)
+const unsigned int BAM_BLOCK_MAX	= 0x10000;	// maximum size of a compressed block
+const unsigned int BAM_RECORD_EXTRA	= 64;		// a BAM record is at most this longer than its SAM line
+const int BAM_COMPRESS_LEVEL		= 6;
+const size_t BAM_WRITER_BUFFER		= 1 << 22;	// SAM text per thread before compressing (bam_writer)
+
+// reference sequences loaded from chr.info
+typedef struct {
+	vector<string> name;
+	vector<unsigned int> len;
+	unordered_map<string, int> id;
+} bam_refs;
+
+bool load_bam_refs( const char *chrinfo, bam_refs & refs );
+// bin of an alignment [beg, end) in the BAI index (UCSC binning scheme)
+int reg2bin( int beg, int end );
+// @HD and @SQ lines for the references
+void make_sam_header( const bam_refs & refs, string & text );
+
+// encode one SAM line (without '\n') into a BAM record, returns its size (including block_size)
+// out MUST have 2*len+BAM_RECORD_EXTRA bytes
+unsigned int sam_to_bam( const char *line, unsigned int len, const bam_refs & refs, char *out );
+// encode all the SAM lines in text into out (malloc-ed, grows if needed), returns the size
+size_t sam_block_to_bam( const char *text, size_t len, const bam_refs & refs, char *& out, size_t & capacity );
+
+// space needed to compress len bytes into BGZF blocks
+size_t bgzf_bound( size_t len );
+// compress src into complete BGZF blocks, returns the compressed size
+size_t bgzf_compress( const char *src, size_t len, char *dst, int level );
+// BAM magic, header text and references as BGZF blocks
+void bam_header_blocks( const string & text, const bam_refs & refs, string & out );
+// the empty block marking the end of a BGZF file
+extern const char BGZF_EOF_BLOCK[ 28 ];
+
+// write all data to fd, returns false on error
+bool write_all( int fd, const char *p, size_t size );
+
+/*
+ * BAM writer for single-threaded producers (e.g., rmdup): the SAM lines are collected, then
+ * converted and compressed by multiple threads, and written in the original order
+*/
+typedef struct {
+	int fd;
+	bam_refs refs;
+	unsigned int thread;
+	bool error;
+	string text;	// SAM lines to be converted
+	vector<char *> bam, bgzf;	// per-thread buffers
+	vector<size_t> bamSize, bgzfSize;
+} bam_writer;
+
+bool open_bam_writer( bam_writer & bw, const char *file, const char *chrinfo, const char *header, unsigned int thread );
+void bam_write_line( bam_writer & bw, const string & line );
+// write SAM text of complete lines (each ends with '\n')
+void bam_write_text( bam_writer & bw, const char *text, size_t len );
+bool close_bam_writer( bam_writer & bw );
+
+/*
+ * BGZF reader: the blocks are loaded in batches (BAM_READER_BLOCKS blocks per thread) and the
+ * blocks in a batch are inflated by multiple threads
+*/
+const unsigned int BAM_READER_BLOCKS = 64;
+
+typedef struct {
+	int fd;
+	unsigned int thread;
+	bool error;
+	string raw;				// compressed blocks of the current batch
+	vector<char> data;		// inflated data, data[pos, size) is not read yet
+	size_t pos, size;
+} bgzf_reader;
+
+bool open_bgzf_reader( bgzf_reader & br, const char *file, unsigned int thread );
+// read size bytes into dst, returns false if there are not enough data (or on error)
+bool bgzf_read( bgzf_reader & br, char *dst, size_t size );
+void close_bgzf_reader( bgzf_reader & br );
+// load the header text and the references of a BAM file
+bool read_bam_header( bgzf_reader & br, string & text, bam_refs & refs );
+
+#endif
+
@@ -0,0 +1,542 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <queue>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <omp.h>
+#include "bam.h"
+
+using namespace std;
+
+/*
+ * Author: Kun Sun (sunkun@szbl.ac.cn)
+ * This program is part of the Msuite package
+ * Date: Oct 2026
+ *
+ * Coordinate sorter for the BAM files written by Msuite (replaces samtools sort and index).
+ * The records are loaded into a buffer limited by the memory budget, and sorted by
+ * (reference, position, strand) with a counting sort on the references followed by a radix sort
+ * on the positions (the references are sorted in parallel). If the input does not fit into the
+ * buffer, the sorted runs are spilled to temporary files and merged afterwards.
+ * The output is compressed by multiple threads, and the BAI index is built in the same pass.
+ * The order is the same as samtools sort, i.e., ties are kept in the input order.
+**/
+
+const size_t SORTER_OUT_SLICE = BAM_BLOCK_DATA * 64;	// uncompressed bytes per thread per output batch
+const unsigned int BAI_LINEAR_SHIFT = 14;	// 16 kb windows of the linear index
+const uint32_t BAI_PSEUDO_BIN = 37450;		// bin for the statistics of a reference
+const uint64_t NO_COOR_REF = 0x7fffffff;	// reference in the sorting key for records without coordinate
+const unsigned int RADIX_BITS = 11;
+const unsigned int POS_KEY_BITS = 33;		// position (32 bits) and strand (1 bit)
+
+// a record in the sorting buffer
+typedef struct {
+	uint64_t key;		// reference (31 bits), position+1 (32 bits), strand (1 bit)
+	uint64_t offset;	// offset of the record in the buffer
+} sort_item;
+
+// BAI index of a reference
+typedef struct {
+	map<uint32_t, vector< pair<uint64_t, uint64_t> > > bins;	// chunks (virtual offsets) of each bin
+	vector<uint64_t> linear;
+	uint64_t beg, end, mapped, unmapped;	// for the pseudo bin
+	bool used;
+} bai_ref;
+
+// a record waiting for its virtual offsets in the output buffer
+typedef struct {
+	size_t offset;
+	uint32_t len;
+	int32_t tid, beg, end;
+	bool unmapped;
+} out_record;
+
+// BGZF writer that keeps the virtual offsets of the records for the BAI index
+typedef struct {
+	int fd;
+	unsigned int thread;
+	bool error;
+	uint64_t coffset;	// compressed offset of the next block
+	string buf;
+	vector<out_record> recs;
+	vector<char *> out;
+	vector<size_t> outCap, outSize;
+	vector<bai_ref> idx;
+	uint64_t noCoor;
+} sorted_writer;
+
+static inline int32_t get_i32( const char *p ) {
+	int32_t v;
+	memcpy( &v, p, 4 );
+	return v;
+}
+
+static inline uint16_t get_u16( const char *p ) {
+	uint16_t v;
+	memcpy( &v, p, 2 );
+	return v;
+}
+
+// p points to block_size of the record
+static inline uint64_t sort_key( const char *p ) {
+	int32_t tid = get_i32( p+4 );
+	uint32_t pos = get_i32( p+8 ) + 1;
+	uint64_t ref = ( tid < 0 ) ? NO_COOR_REF : tid;
+	return (ref << POS_KEY_BITS) | ((uint64_t)pos << 1) | ((get_u16(p+18) & 0x10) ? 1 : 0);
+}
+
+// end position (exclusive) of the record on the reference
+static inline int32_t record_end( const char *p ) {
+	int32_t pos = get_i32( p+8 );
+	if( get_u16(p+18) & 0x4 )	// unmapped
+		return pos + 1;
+	unsigned int ncigar = get_u16( p+16 );
+	const char *c = p + 36 + (unsigned char)p[12];
+	int32_t len = 0;
+	for( unsigned int i=0; i!=ncigar; ++i ) {
+		uint32_t v;
+		memcpy( &v, c + 4*i, 4 );
+		unsigned int op = v & 0xf;
+		if( op==0 || op==2 || op==3 || op==7 || op==8 )
+			len += v >> 4;
+	}
+	return pos + ( len ? len : 1 );
+}
+
+// stable LSD radix sort of n items on the lower POS_KEY_BITS of the key; tmp has n items
+static void radix_sort( sort_item *a, sort_item *tmp, size_t n ) {
+	sort_item *src = a, *dst = tmp;
+	vector<size_t> cnt( 1 << RADIX_BITS );
+	for( unsigned int shift=0; shift<POS_KEY_BITS; shift+=RADIX_BITS ) {
+		const uint64_t mask = (1 << RADIX_BITS) - 1;
+		fill( cnt.begin(), cnt.end(), 0 );
+		for( size_t i=0; i!=n; ++i )
+			++ cnt[ (src[i].key >> shift) & mask ];
+		if( cnt[ (src[0].key >> shift) & mask ] == n )	// all the same, skip this digit
+			continue;
+		size_t sum = 0;
+		for( size_t d=0; d!=cnt.size(); ++d ) {
+			size_t c = cnt[d];
+			cnt[d] = sum;
+			sum += c;
+		}
+		for( size_t i=0; i!=n; ++i )
+			dst[ cnt[(src[i].key >> shift) & mask]++ ] = src[i];
+		swap( src, dst );
+	}
+	if( src != a )
+		memcpy( a, src, n*sizeof(sort_item) );
+}
+
+// counting sort by reference, then radix sort on position and strand for each reference in parallel
+static void sort_items( vector<sort_item> & items, unsigned int nref, unsigned int thread ) {
+	size_t n = items.size();
+	vector<sort_item> tmp( n );
+	vector<size_t> start( nref+2, 0 );
+	for( size_t i=0; i!=n; ++i ) {
+		uint64_t r = items[i].key >> POS_KEY_BITS;
+		++ start[ (r<nref ? r : nref) + 1 ];
+	}
+	for( unsigned int r=1; r<=nref+1; ++r )
+		start[r] += start[r-1];
+	vector<size_t> next( start.begin(), start.end()-1 );
+	for( size_t i=0; i!=n; ++i ) {
+		uint64_t r = items[i].key >> POS_KEY_BITS;
+		tmp[ next[r<nref ? r : nref]++ ] = items[i];
+	}
+
+	#pragma omp parallel for num_threads( thread ) schedule( dynamic, 1 )
+	for( int r=0; r<=(int)nref; ++r ) {
+		size_t len = start[r+1] - start[r];
+		if( len > 1 )
+			radix_sort( &tmp[start[r]], &items[start[r]], len );
+	}
+	items.swap( tmp );
+}
+
+// add a record to the BAI index
+static void index_record( sorted_writer & sw, const out_record & r, uint64_t vbeg, uint64_t vend ) {
+	if( r.tid < 0 || r.tid >= (int32_t)sw.idx.size() ) {
+		++ sw.noCoor;
+		return;
+	}
+	bai_ref & ref = sw.idx[ r.tid ];
+	vector< pair<uint64_t, uint64_t> > & chunks = ref.bins[ reg2bin(r.beg, r.end) ];
+	// merge the chunks that are adjacent or in the same BGZF block
+	if( !chunks.empty() && (chunks.back().second==vbeg || (chunks.back().second>>16)==(vbeg>>16)) )
+		chunks.back().second = vend;
+	else
+		chunks.push_back( make_pair(vbeg, vend) );
+
+	unsigned int w0 = ( r.beg<0 ? 0 : r.beg ) >> BAI_LINEAR_SHIFT;
+	unsigned int w1 = ( r.end-1 < 0 ? 0 : r.end-1 ) >> BAI_LINEAR_SHIFT;
+	if( ref.linear.size() <= w1 )
+		ref.linear.resize( w1+1, 0 );
+	for( unsigned int w=w0; w<=w1; ++w )
+		if( ref.linear[w] == 0 )
+			ref.linear[w] = vbeg;
+
+	if( ! ref.used ) {
+		ref.used = true;
+		ref.beg = vbeg;
+	}
+	ref.end = vend;
+	if( r.unmapped )
+		++ ref.unmapped;
+	else
+		++ ref.mapped;
+}
+
+// compress the buffer (cut into slices at block boundaries), write it and index the records
+static void flush_sorted_writer( sorted_writer & sw ) {
+	if( sw.buf.empty() )
+		return;
+	size_t len = sw.buf.size();
+	int nslice = ( len + SORTER_OUT_SLICE - 1 ) / SORTER_OUT_SLICE;
+	if( (int)sw.out.size() < nslice ) {
+		sw.out.resize( nslice, NULL );
+		sw.outCap.resize( nslice, 0 );
+		sw.outSize.resize( nslice, 0 );
+	}
+
+	#pragma omp parallel for num_threads( sw.thread ) schedule( dynamic, 1 )
+	for( int i=0; i<nslice; ++i ) {
+		size_t s = i * SORTER_OUT_SLICE;
+		size_t l = ( len-s < SORTER_OUT_SLICE ) ? len-s : SORTER_OUT_SLICE;
+		size_t need = bgzf_bound( l );
+		if( need > sw.outCap[i] ) {
+			sw.out[i] = (char *) realloc( sw.out[i], need );
+			sw.outCap[i] = need;
+		}
+		sw.outSize[i] = bgzf_compress( sw.buf.data()+s, l, sw.out[i], BAM_COMPRESS_LEVEL );
+	}
+
+	// compressed offset of each block; a slice is a multiple of BAM_BLOCK_DATA (except the last one)
+	// so block i holds the data starting from i*BAM_BLOCK_DATA
+	vector<uint64_t> block;
+	uint64_t c = sw.coffset;
+	for( int i=0; i!=nslice; ++i ) {
+		for( size_t p=0; p<sw.outSize[i]; ) {
+			block.push_back( c + p );
+			p += get_u16( sw.out[i]+p+16 ) + 1;
+		}
+		c += sw.outSize[i];
+		if( ! write_all(sw.fd, sw.out[i], sw.outSize[i]) )
+			sw.error = true;
+	}
+	for( size_t i=0; i!=sw.recs.size(); ++i ) {
+		const out_record & r = sw.recs[i];
+		size_t e = r.offset + r.len;
+		uint64_t vbeg = ( block[r.offset/BAM_BLOCK_DATA] << 16 ) | ( r.offset % BAM_BLOCK_DATA );
+		uint64_t vend = ( e/BAM_BLOCK_DATA < block.size() ) ?
+						(( block[e/BAM_BLOCK_DATA] << 16 ) | ( e % BAM_BLOCK_DATA )) : ( c << 16 );
+		index_record( sw, r, vbeg, vend );
+	}
+	sw.coffset = c;
+	sw.buf.clear();
+	sw.recs.clear();
+}
+
+static bool open_sorted_writer( sorted_writer & sw, const char *file, const string & text, const bam_refs & refs, unsigned int thread ) {
+	sw.fd = open( file, O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+	if( sw.fd < 0 ) {
+		cerr << "Error: could not write file '" << file << "'!\n";
+		return false;
+	}
+	sw.thread = thread;
+	sw.error = false;
+	string head;
+	bam_header_blocks( text, refs, head );
+	if( ! write_all(sw.fd, head.data(), head.size()) )
+		sw.error = true;
+	sw.coffset = head.size();
+	sw.buf.reserve( SORTER_OUT_SLICE * thread + BAM_BLOCK_MAX );
+	sw.idx.resize( refs.name.size() );
+	for( unsigned int i=0; i!=sw.idx.size(); ++i ) {
+		sw.idx[i].used = false;
+		sw.idx[i].mapped = sw.idx[i].unmapped = 0;
+	}
+	sw.noCoor = 0;
+	return true;
+}
+
+// p points to block_size of the record
+static inline void sorted_write( sorted_writer & sw, const char *p ) {
+	out_record r;
+	r.offset = sw.buf.size();
+	r.len = get_i32( p ) + 4;
+	r.tid = get_i32( p+4 );
+	r.beg = get_i32( p+8 );
+	r.end = record_end( p );
+	r.unmapped = get_u16( p+18 ) & 0x4;
+	sw.recs.push_back( r );
+	sw.buf.append( p, r.len );
+	if( sw.buf.size() >= SORTER_OUT_SLICE * sw.thread )
+		flush_sorted_writer( sw );
+}
+
+static inline void put_bai( string & s, const void *p, unsigned int size ) {
+	s.append( (const char *)p, size );
+}
+
+static bool write_bai( const sorted_writer & sw, const char *file ) {
+	string s = "BAI\1";
+	int32_t n = sw.idx.size();
+	put_bai( s, &n, 4 );
+	for( unsigned int i=0; i!=sw.idx.size(); ++i ) {
+		const bai_ref & ref = sw.idx[i];
+		n = ref.bins.size() + ( ref.used ? 1 : 0 );
+		put_bai( s, &n, 4 );
+		map<uint32_t, vector< pair<uint64_t, uint64_t> > >::const_iterator it;
+		for( it=ref.bins.begin(); it!=ref.bins.end(); ++it ) {
+			put_bai( s, &it->first, 4 );
+			n = it->second.size();
+			put_bai( s, &n, 4 );
+			for( unsigned int j=0; j!=it->second.size(); ++j ) {
+				put_bai( s, &it->second[j].first, 8 );
+				put_bai( s, &it->second[j].second, 8 );
+			}
+		}
+		if( ref.used ) {
+			n = 2;
+			put_bai( s, &BAI_PSEUDO_BIN, 4 );
+			put_bai( s, &n, 4 );
+			put_bai( s, &ref.beg, 8 );
+			put_bai( s, &ref.end, 8 );
+			put_bai( s, &ref.mapped, 8 );
+			put_bai( s, &ref.unmapped, 8 );
+		}
+		// windows without records point to the previous one
+		n = ref.linear.size();
+		put_bai( s, &n, 4 );
+		uint64_t last = 0;
+		for( unsigned int j=0; j!=ref.linear.size(); ++j ) {
+			if( ref.linear[j] )
+				last = ref.linear[j];
+			put_bai( s, &last, 8 );
+		}
+	}
+	put_bai( s, &sw.noCoor, 8 );
+
+	int fd = open( file, O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+	if( fd < 0 ) {
+		cerr << "Error: could not write file '" << file << "'!\n";
+		return false;
+	}
+	bool ok = write_all( fd, s.data(), s.size() );
+	close( fd );
+	return ok;
+}
+
+static bool close_sorted_writer( sorted_writer & sw, const char *baifile ) {
+	flush_sorted_writer( sw );
+	if( ! write_all(sw.fd, BGZF_EOF_BLOCK, 28) )
+		sw.error = true;
+	close( sw.fd );
+	for( unsigned int i=0; i!=sw.out.size(); ++i )
+		free( sw.out[i] );
+	if( sw.error ) {
+		cerr << "Error: write BAM file failed!\n";
+		return false;
+	}
+	return write_bai( sw, baifile );
+}
+
+// mark the header as sorted by coordinate
+static void set_sort_order( string & text ) {
+	if( text.compare(0, 3, "@HD") != 0 ) {
+		text = "@HD\tVN:1.0\tSO:coordinate\n" + text;
+		return;
+	}
+	size_t e = text.find( '\n' );
+	if( e == string::npos )
+		e = text.size();
+	size_t so = text.find( "\tSO:" );
+	if( so!=string::npos && so<e ) {
+		so += 4;
+		size_t ve = text.find_first_of( "\t\n", so );
+		if( ve == string::npos )
+			ve = text.size();
+		text.replace( so, ve-so, "coordinate" );
+	} else {
+		text.insert( e, "\tSO:coordinate" );
+	}
+}
+
+// a sorted run spilled to a temporary file
+typedef struct {
+	FILE *fp;
+	string file;
+	vector<char> rec;	// current record
+	uint64_t key;
+} sort_run;
+
+static bool next_run_record( sort_run & run ) {
+	int32_t len;
+	if( fread(&len, 4, 1, run.fp) != 1 )
+		return false;
+	run.rec.resize( len+4 );
+	memcpy( &run.rec[0], &len, 4 );
+	if( fread(&run.rec[4], 1, len, run.fp) != (size_t)len )
+		return false;
+	run.key = sort_key( &run.rec[0] );
+	return true;
+}
+
+// for the heap: the smallest key first, ties are broken by the run index (i.e., the input order)
+struct run_order {
+	const vector<sort_run> *runs;
+	bool operator()( unsigned int a, unsigned int b ) const {
+		uint64_t ka = (*runs)[a].key, kb = (*runs)[b].key;
+		return ( ka != kb ) ? ka > kb : a > b;
+	}
+};
+
+int main( int argc, char *argv[] ) {
+	if( argc < 3 ) {
+		cerr << "\nUsage: " << argv[0] << " <in.bam> <out.bam> [thread=1] [mem.budget=768]\n"
+			 << "\nThis program is part of Msuite, designed to sort the BAM file by coordinate and\n"
+			 << "build its index (out.bam.bai) in the same pass.\n"
+			 << "mem.budget (in MB) limits the records loaded at a time; if the input is larger, the\n"
+			 << "sorted runs are spilled to out.bam.tmp.* and merged afterwards.\n\n";
+		return 2;
+	}
+	unsigned int thread = 1;
+	if( argc > 3 && atoi(argv[3]) > 0 )
+		thread = atoi( argv[3] );
+	size_t budget = 768;
+	if( argc > 4 && atoi(argv[4]) > 0 )
+		budget = atoi( argv[4] );
+	budget <<= 20;
+
+	bgzf_reader br;
+	if( ! open_bgzf_reader(br, argv[1], thread) )
+		exit(11);
+	string text;
+	bam_refs refs;
+	if( ! read_bam_header(br, text, refs) )
+		exit(11);
+	set_sort_order( text );
+	unsigned int nref = refs.name.size();
+
+	string outfile = argv[2];
+	string baifile = outfile + ".bai";
+	vector<sort_run> runs;
+	char *buf = (char *) malloc( budget );
+	size_t capacity = budget;
+	vector<sort_item> items;
+	bool done = false;
+	int32_t pending = -1;	// size of the record that does not fit into the last buffer
+	sorted_writer sw;
+
+	while( ! done ) {
+		// load the records into the buffer
+		size_t used = 0;
+		items.clear();
+		while( true ) {
+			int32_t len;
+			if( pending >= 0 ) {
+				len = pending;
+				pending = -1;
+			} else if( ! bgzf_read(br, (char *)&len, 4) ) {
+				done = true;
+				break;
+			}
+			if( len < 32 ) {
+				cerr << "Error: invalid BAM record!\n";
+				exit(11);
+			}
+			if( used + len + 4 > capacity ) {
+				if( used ) {	// the buffer is full
+					pending = len;
+					break;
+				}
+				capacity = len + 4;	// a record larger than the budget
+				buf = (char *) realloc( buf, capacity );
+			}
+			memcpy( buf+used, &len, 4 );
+			if( ! bgzf_read(br, buf+used+4, len) ) {
+				cerr << "Error: truncated BAM file!\n";
+				exit(11);
+			}
+			sort_item it;
+			it.key = sort_key( buf+used );
+			it.offset = used;
+			items.push_back( it );
+			used += len + 4;
+		}
+		if( br.error )
+			exit(11);
+		sort_items( items, nref, thread );
+
+		if( done && runs.empty() ) {	// everything is in the buffer, write the output directly
+			if( ! open_sorted_writer(sw, outfile.c_str(), text, refs, thread) )
+				exit(13);
+			for( size_t i=0; i!=items.size(); ++i )
+				sorted_write( sw, buf+items[i].offset );
+			break;
+		}
+		if( items.empty() )
+			break;
+		// spill this run
+		sort_run run;
+		char tmp[ 32 ];
+		sprintf( tmp, ".tmp.%u", (unsigned int)runs.size() );
+		run.file = outfile + tmp;
+		run.fp = fopen( run.file.c_str(), "wb" );
+		if( run.fp == NULL ) {
+			cerr << "Error: could not write file '" << run.file << "'!\n";
+			exit(13);
+		}
+		for( size_t i=0; i!=items.size(); ++i ) {
+			const char *p = buf + items[i].offset;
+			if( fwrite(p, 1, get_i32(p)+4, run.fp) != (size_t)get_i32(p)+4 ) {
+				cerr << "Error: write file '" << run.file << "' failed!\n";
+				exit(13);
+			}
+		}
+		fclose( run.fp );
+		runs.push_back( run );
+	}
+	close_bgzf_reader( br );
+	free( buf );
+	vector<sort_item>().swap( items );
+
+	if( ! runs.empty() ) {	// k-way merge of the runs
+		if( ! open_sorted_writer(sw, outfile.c_str(), text, refs, thread) )
+			exit(13);
+		run_order cmp;
+		cmp.runs = &runs;
+		priority_queue<unsigned int, vector<unsigned int>, run_order> heap( cmp );
+		for( unsigned int i=0; i!=runs.size(); ++i ) {
+			runs[i].fp = fopen( runs[i].file.c_str(), "rb" );
+			if( runs[i].fp == NULL ) {
+				cerr << "Error: could not open file '" << runs[i].file << "'!\n";
+				exit(12);
+			}
+			if( next_run_record(runs[i]) )
+				heap.push( i );
+		}
+		while( ! heap.empty() ) {
+			unsigned int i = heap.top();
+			heap.pop();
+			sorted_write( sw, &runs[i].rec[0] );
+			if( next_run_record(runs[i]) )
+				heap.push( i );
+		}
+		for( unsigned int i=0; i!=runs.size(); ++i ) {
+			fclose( runs[i].fp );
+			remove( runs[i].file.c_str() );
+		}
+	}
+
+	if( ! close_sorted_writer(sw, baifile.c_str()) )
+		exit(13);
+	return 0;
+}
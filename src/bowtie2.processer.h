@@ -0,0 +1,831 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "util.h"
+#include "sidecar.h"
+#include "bam.h"
+
+using namespace std;
+
+/*
+ * Author: Kun Sun (sunkun@szbl.ac.cn)
+ * This program is part of the Msuite package
+ * Date: Oct 2026
+ *
+ * Functions shared by bowtie2.processer.pe and bowtie2.processer.se to parse the bowtie2 records
+ * and restore the converted reads.
+ *
+ * Bowtie2 records the mismatch-score in the AS:i: tag and next match (if any) in XS:i: tag
+ *
+ * 10753_chr1:226691056-226691358_R1    99  chr1    226691056   35  50M =   226691309   303
+ * GTCTTTACAATTTGGCATGTTTTTGCAGTGGCTGGTACCAGTTGTTCCTT  HHHHHHHHHHHHHHGGGGGFFFFEEDDCCBBA@@?>=<<;:8765321/.
+ * AS:i:0  XS:i:-6 XN:i:0  XM:i:0  XO:i:0      XG:i:0  NM:i:0  MD:Z:50 YS:i:0  YT:Z:CP
+ *
+ * Mostly AS-scores are 0 or negative
+**/
+
+#ifndef _MSUITE_BOWTIE2_PROCESSER_
+#define _MSUITE_BOWTIE2_PROCESSER_
+
+// per-thread working space to parse and restore the records
+typedef struct {
+	sam_view view, mview;	// fields of read 1 and read 2 (i.e., the mate)
+	char *seqName;
+	char chr[  MAX_ITERM_SIZE ];
+	char flag[ MAX_ITERM_SIZE ];
+	string cigar, seq, qual;
+	int pos, score;
+	unsigned int line;	// line number of this fragment
+	bool endC, frontG;	// indicators: "C" at the end, "G" at the front
+	char Qend;			// quality score for the "C"
+	sidecar_record rec;
+	// mate of the read being restored (Paired-End data): position, template length and CIGAR (for MC tag)
+	int mpos, tlen;
+	string mcigar;
+	// chromosome of the last fragment key; the input is mostly clustered by chromosome
+	string chrKey;
+	int chrID;
+} sam_parser;
+
+// a fragment in the streaming mode: index of its hit in the CG2TG and CG2CA batch, -1 if not aligned
+typedef struct {
+	int tg, ca;
+} fragment;
+
+void inline init_sam_parser( sam_parser & w ) {
+	w.seqName = (char *) malloc( MAX_SEQNAME_SIZE );
+	w.chrID = -1;
+}
+
+void inline free_sam_parser( sam_parser & w ) {
+	free( w.seqName );
+}
+
+// the two-pass mode needs to rewind CG2TG.sam, so pipes/FIFOs (e.g., fed by running bowtie2 instances)
+// could only be merged in the streaming mode
+bool inline is_regular_file( const char *file ) {
+	struct stat st;
+	return stat( file, &st )==0 && S_ISREG( st.st_mode );
+}
+
+// load the next record; returns false at the end of the file
+bool inline load_record( ifstream & fin, string & r ) {
+	getline( fin, r );
+	return ! fin.eof();
+}
+
+// the line number (in HEX) at the beginning of read 1
+unsigned int inline get_line_number( const char *p ) {
+	register unsigned int j = 0;
+	for( register int i=0; p[i]!=LINE_NUMBER_SEPARATOR && p[i]!='\t' && p[i]; ++i ) {
+		j <<= 4;
+		if( p[i]<='9' ) {	//0-9
+			j += p[i] - '0';
+		} else {	//a-f
+			j += p[i] - 87;	// 'a'-10
+		}
+	}
+	return j;
+}
+
+/*
+ * load the next record (R2 is NULL for Single-End data) and its line number in the streaming mode;
+ * the line numbers MUST be increasing, i.e., bowtie2 is called with --reorder
+ * returns false at the end of the file
+*/
+bool inline next_record( ifstream & fin, string & R1, string * R2, unsigned int & line ) {
+	if( ! load_record(fin, R1) )
+		return false;
+	if( R2 != NULL )
+		load_record( fin, *R2 );
+	register unsigned int j = get_line_number( R1.c_str() );
+	if( j <= line ) {
+		cerr << "Error: the alignments are not in the order of the input reads! "
+			 << "Please run bowtie2 with --reorder.\n";
+		exit(15);
+	}
+	line = j;
+	return true;
+}
+
+/*
+ * hit table of the two-pass mode: the AS-score of each fragment on CG2TG (indexed by its line
+ * number) or the marks set when processing CG2CA, 16 bits per fragment
+ * the table could cover part of the fragments (i.e., a shard of line numbers) to limit the memory
+*/
+typedef int16_t hit_score;
+
+// scores lower than the marks (should not happen for short reads) are raised above them
+hit_score inline compact_score( int score ) {
+	return ( score > AMB_HIT_MARKER ) ? score : AMB_HIT_MARKER+1;
+}
+
+const unsigned int MAX_HIT_SHARDS = 256;	// the shard files are all open when splitting
+
+// number of fragments in a shard for the memory budget (in MB, 0 for no limit); the shards are
+// enlarged beyond the budget if there would be more than MAX_HIT_SHARDS of them
+unsigned int inline hit_shard_size( unsigned int readNum, unsigned int budget ) {
+	if( budget == 0 )
+		return readNum;
+	uint64_t n = ( (uint64_t)budget << 20 ) / sizeof(hit_score);
+	uint64_t least = ( (uint64_t)readNum + MAX_HIT_SHARDS - 1 ) / MAX_HIT_SHARDS;
+	if( n < least )
+		n = least;
+	return ( n < readNum ) ? n : readNum;
+}
+
+// temporary file holding the records of a shard, next to the output file
+string inline shard_file( const char *output, unsigned int shard, const char *tag ) {
+	ostringstream ss;
+	ss << output << ".shard" << shard << '.' << tag << ".sam";
+	return ss.str();
+}
+
+/*
+ * distribute the records of an alignment file to the shard files by their line numbers in one pass,
+ * then each shard is processed from its own files; lines is the number of lines per record (2 for
+ * Paired-End data). returns false if the shard files could not be written
+*/
+bool inline split_into_shards( ifstream & fin, const char *output, const char *tag,
+								unsigned int shardSize, unsigned int shardNum, unsigned int lines ) {
+	vector<ofstream *> fout( shardNum );
+	bool ok = true;
+	for( unsigned int i=0; i!=shardNum; ++i ) {
+		string file = shard_file( output, i, tag );
+		fout[i] = new ofstream( file.c_str() );
+		if( fout[i]->fail() ) {
+			cerr << "Error: cannot open file " << file << " to write!\n";
+			ok = false;
+		}
+	}
+
+	string line;
+	while( ok ) {
+		getline( fin, line );
+		if( fin.eof() )break;
+		register unsigned int s = get_line_number( line.c_str() ) / shardSize;
+		ofstream *o = ( s < shardNum ) ? fout[s] : NULL;	// out of the line numbers, ignored by all shards
+		if( o != NULL )
+			*o << line << '\n';
+		for( register unsigned int k=1; k!=lines; ++k ) {
+			getline( fin, line );
+			if( o != NULL )
+				*o << line << '\n';
+		}
+	}
+
+	for( unsigned int i=0; i!=shardNum; ++i ) {
+		fout[i]->close();
+		if( fout[i]->fail() ) {
+			cerr << "Error: write file " << shard_file(output, i, tag) << " failed!\n";
+			ok = false;
+		}
+		delete fout[i];
+	}
+	return ok;
+}
+
+// the AS:i: tag is on column 12 (1-based), i.e., the first tag; it is always there for aligned reads
+int inline get_AS_score( const string & r ) {
+	sam_view v;
+	sam_view_split( v, r, SAM_TAGS+1 );
+	const char *as = sam_view_tag( v, "AS" );
+	return ( as == NULL ) ? 0 : sam_atoi( as );
+}
+
+// if XS tag exists, it will be always after the AS tag, i.e., on column 13
+bool inline has_XS_tag( const string & r ) {
+	sam_view v;
+	sam_view_split( v, r, SAM_TAGS+2 );
+	return sam_view_tag( v, "XS" ) != NULL;
+}
+
+// split read 1 and parse the first 5 columns (the score is needed to decide whether the fragment is kept),
+// the other columns are used by restore_*_read1 if the fragment is kept
+void inline parse_head( sam_parser & w, const string & R1 ) {
+	sam_view_split( w.view, R1, SAM_TAGS );
+	sam_view_copy( w.view, SAM_QNAME, w.seqName, MAX_SEQNAME_SIZE );
+	sam_view_copy( w.view, SAM_FLAG,  w.flag, MAX_ITERM_SIZE );
+	sam_view_copy( w.view, SAM_RNAME, w.chr,  MAX_ITERM_SIZE );
+	w.pos   = sam_view_int( w.view, SAM_POS );
+	w.score = sam_view_int( w.view, SAM_MAPQ );
+	w.line = get_line_number( w.seqName );
+}
+
+/*
+ * whether a hit is kept according to its score (MAPQ), R2 is NULL for Single-End data
+ * ambigous hits (i.e., aligned to both CG2TG and CG2CA but this one is the unique best) must have
+ * higher scores and their scores are lowered; poor unique hits are kept if there is no 2nd hit
+*/
+bool inline keep_hit( sam_parser & w, bool ambigous, const string & R1, const string * R2 ) {
+	if( ambigous ) {
+		if( w.score < MIN_ALIGN_SCORE_AMB )
+			return false;
+		w.score >>= 1;	// lower the score
+	} else if( w.score < MIN_ALIGN_SCORE_UNQ ) {	// too poor quality
+		// TODO: if both R1 and R2 do not have 2nd hits (i.e., no XS tag), still keep it
+		if( has_XS_tag(R1) )	// there is a XS index, DISCARD
+			return false;
+		if( R2!=NULL && has_XS_tag(*R2) )
+			return false;
+		// here this read will be kept !!!
+	}
+	return true;
+}
+
+// index of the conversion log in seqName (after the line number), used when there is no sidecar
+int inline conversion_log_start( const char *seqName ) {
+	register int i;
+	for( i=0; seqName[i] != LINE_NUMBER_SEPARATOR && seqName[i]; ++i ) ;
+	return i;
+}
+
+// add 1M to the first match segment of CIGAR xM[yID]zM (for the extra base at the front)
+void inline extend_cigar_front( string & cigar ) {
+	register int i, j = 0;
+	const char *p = cigar.c_str();
+	char tmp[ MAX_ITERM_SIZE ];
+	for( i=0; p[i] != 'M'; ++i ) {
+		j *= 10;
+		j += p[i] - '0';
+	}
+	sprintf( tmp, "%d", j+1 );
+	cigar.replace( 0, i, tmp );
+}
+
+// add 1M to the last match segment of CIGAR xM[yID]zM (for the extra base at the end)
+void inline extend_cigar_end( string & cigar ) {
+	register int i, j, k;
+	const char *p = cigar.c_str();
+	char tmp[ MAX_ITERM_SIZE ];
+	i = cigar.size() - 3;	// size-1 is 'M', size-2 MUST be a digital
+	while( i >= 0 ) {
+		if( p[i] > '9' ) break;	// it is not a digital (should be I/D/), stop here
+		-- i;
+	}
+	++ i;	// now it point to the first digital of the LAST match segment; could be 0 (i.e., cigar is xxM only)
+	j = 0;
+	for( k=i; p[k] != 'M'; ++k ) {
+		j *= 10;
+		j += p[k] - '0';
+	}
+	sprintf( tmp, "%dM", j+1 );
+	cigar.resize( i );
+	cigar += tmp;
+}
+
+// number of reference bases covered by CIGAR (i.e., M/D/N/=/X)
+int inline cigar_ref_length( const char *cigar ) {
+	register int n = 0, len = 0;
+	for( ; *cigar; ++cigar ) {
+		if( *cigar <= '9' ) {
+			n *= 10;
+			n += *cigar - '0';
+		} else {
+			if( *cigar=='M' || *cigar=='D' || *cigar=='N' || *cigar=='=' || *cigar=='X' )
+				len += n;
+			n = 0;
+		}
+	}
+	return len;
+}
+
+/*
+ * split read 2 (used by restore_*_read2) and load its position and CIGAR into the mate fields (i.e.,
+ * what restore_*_read2 will output) and set the template length of read 1; MUST be called after the
+ * sidecar record is loaded
+ * CG2TG: read 2 is on CRICK chain and a frontG is added to the end of CIGAR
+ * CG2CA: read 2 is on WATSON chain and a frontG is added to the beginning of CIGAR and POS
+ * the template length follows the SAM spec, i.e., from the leftmost mapped base to the rightmost
+ * one, positive for the leftmost read
+*/
+void inline load_mate( sam_parser & w, const string & R2, const sidecar *sc, bool TG ) {
+	const char *name = R2.c_str();
+	sam_view_split( w.mview, R2, SAM_TAGS );
+	w.mpos = sam_view_int( w.mview, SAM_POS );
+	sam_view_copy( w.mview, SAM_CIGAR, w.mcigar );
+
+	bool frontG = ( sc != NULL ) ? (w.rec.flags & SIDECAR_FRONTG) : (name[1] == KEEP_QUAL_MARKER);
+	if( frontG ) {
+		if( TG ) {
+			extend_cigar_end( w.mcigar );
+		} else {
+			extend_cigar_front( w.mcigar );
+			-- w.mpos;
+		}
+	}
+
+	register int end  = w.pos  + cigar_ref_length( w.cigar.c_str() );
+	register int mend = w.mpos + cigar_ref_length( w.mcigar.c_str() );
+	register int left  = ( w.pos < w.mpos ) ? w.pos : w.mpos;
+	register int right = ( end > mend ) ? end : mend;
+	w.tlen = ( w.pos <= w.mpos ) ? right-left : left-right;
+}
+
+// called after read 1 is written: read 1 becomes the mate of read 2
+void inline swap_mate( sam_parser & w ) {
+	w.mpos = w.pos;
+	w.tlen = - w.tlen;
+	w.mcigar = w.cigar;
+}
+
+// RNEXT, PNEXT and TLEN
+char inline * write_mate_fields( const sam_parser & w, bool paired, char *o ) {
+	if( paired )
+		return o + sprintf( o, "=\t%d\t%d", w.mpos, w.tlen );
+	memcpy( o, "*\t0\t0", 5 );
+	return o + 5;
+}
+
+// MC tag: CIGAR of the mate
+char inline * write_mate_cigar( const sam_parser & w, bool paired, char *o ) {
+	if( paired )
+		o += sprintf( o, "\tMC:Z:%s", w.mcigar.c_str() );
+	return o;
+}
+
+// read 1 in CG2CA is ALWAYS on CRICK chain; sc is NULL if there is no sidecar
+// R2 is NULL for Single-End data (only used to fill the mate fields)
+// the record is written into sam and its size is returned
+int inline restore_CA_read1( sam_parser & w, const sidecar *sc, const string * R2, char *sam ) {
+	register int i, j, len;
+	register unsigned int IDstart;
+	char *seqName = w.seqName;
+	string & seq = w.seq;
+
+	sam_view_copy( w.view, SAM_CIGAR, w.cigar );
+	sam_view_copy( w.view, SAM_SEQ,   w.seq );
+	sam_view_copy( w.view, SAM_QUAL,  w.qual );
+	if( sc != NULL ) {
+		get_sidecar_record( *sc, w.line, w.rec, R2!=NULL );
+		check_sidecar_read( w.rec.r1, seq.size(), 0 );
+		w.endC = w.rec.flags & SIDECAR_ENDC;
+		w.Qend = w.rec.qual1;
+		restore_conversion( &seq[0], w.rec.r1, seq.size()-1, -1, 'G' );
+		restore_quality( &w.qual[0], w.qual.size(), w.rec.r1, true );
+		copy_sidecar_name( seqName, w.rec.r1 );
+		IDstart = 0;
+	} else {
+		i = conversion_log_start( seqName );
+		// look for the conversion log start
+		if( seqName[i+2] == KEEP_QUAL_MARKER ) {	// marker for endC
+			w.Qend = seqName[i+1];
+			w.endC = true;
+			i += 3;
+		} else {
+			w.endC = false;
+			++ i;
+		}
+		if( seqName[i] != CONVERSION_LOG_END ) {	// there are C>T conversions
+			// process the conversion log
+			len = seq.size() - 1;
+			// the counting is from the right to the left and the missing 'C' (if exists)
+			// should be the leftmost, therefore it DOES not affect calculating the index
+			j = 0;
+			for( ; seqName[i] != CONVERSION_LOG_END; ++i ) {
+				if ( seqName[i] == CONVERSION_LOG_SEPARATOR ) {	// one change meet
+					seq[len-j] = 'G';
+					j = 0;
+				} else {
+					j <<= 4;
+					if( seqName[i] <= '9' ) {	// 0-9
+						j += seqName[i] - '0';
+					} else {	// a-f
+						j += seqName[i] - 87;	// 'a'-10
+					}
+				}
+			}
+			seq[len-j] = 'G';
+		}
+		IDstart = i + 1;
+	}
+
+	// now seqName is processed, then deal with pos and CIGAR
+	if( w.endC ) {
+		// for CG2CA, read1 is always on crick chain; so if there is an endC,
+		// add '1M' at the beginning of the CIGAR and update POS
+		extend_cigar_front( w.cigar );
+		-- w.pos;
+	}
+	if( R2 != NULL )
+		load_mate( w, *R2, sc, false );
+
+	char *o = sam + sprintf( sam, "%s\t%s\t%s\t%d\t%d\t%s\t",
+						seqName+IDstart, w.flag, w.chr, w.pos, w.score, w.cigar.c_str() );
+	o = write_mate_fields( w, R2!=NULL, o );
+	if( w.endC )
+		o += sprintf( o, "\tG%s\t%c%s", seq.c_str(), w.Qend, w.qual.c_str() );
+	else
+		o += sprintf( o, "\t%s\t%s", seq.c_str(), w.qual.c_str() );
+	o = write_mate_cigar( w, R2!=NULL, o );
+	if( R2 != NULL )
+		swap_mate( w );
+	return o - sam;
+}
+
+// read 1 in CG2TG is ALWAYS on WATSON chain; sc is NULL if there is no sidecar
+int inline restore_TG_read1( sam_parser & w, const sidecar *sc, const string * R2, char *sam ) {
+	register int i, j;
+	register unsigned int IDstart;
+	char *seqName = w.seqName;
+	string & seq = w.seq;
+
+	// extract the other sections in the SAM record
+	sam_view_copy( w.view, SAM_CIGAR, w.cigar );
+	sam_view_copy( w.view, SAM_SEQ,   w.seq );
+	sam_view_copy( w.view, SAM_QUAL,  w.qual );
+	if( sc != NULL ) {
+		get_sidecar_record( *sc, w.line, w.rec, R2!=NULL );
+		check_sidecar_read( w.rec.r1, seq.size(), 0 );
+		w.endC = w.rec.flags & SIDECAR_ENDC;
+		w.Qend = w.rec.qual1;
+		restore_conversion( &seq[0], w.rec.r1, 0, 1, 'C' );
+		restore_quality( &w.qual[0], w.qual.size(), w.rec.r1, false );
+		copy_sidecar_name( seqName, w.rec.r1 );
+		IDstart = 0;
+	} else {
+		i = conversion_log_start( seqName );
+		// check endC marker
+		if( seqName[i+2] == KEEP_QUAL_MARKER ) {	// there is a C at the end
+			w.Qend = seqName[i+1];
+			w.endC = true;
+			i += 3;
+		} else {	// no C at the end
+			w.endC = false;
+			++ i;
+		}
+
+		// process the conversion log
+		if( seqName[i] != CONVERSION_LOG_END ) {	// there are changes in this read
+			j = 0;
+			for( ; seqName[i] != CONVERSION_LOG_END; ++i ) {
+				if ( seqName[i] == CONVERSION_LOG_SEPARATOR ) {	// one change met
+					seq[j] = 'C';	//convert back to 'C'; read 1 is on WATSON
+					j = 0;
+				} else {
+					j <<= 4;
+					if( seqName[i]<='9' ) {	//0-9, seqName > '0' is always true
+						j += seqName[i] - '0';
+					} else {	//a-f
+						j += seqName[i] - 87;	// 'a'-10
+					}
+				}
+			}
+			seq[j] = 'C';	//convert back to C
+		}
+		IDstart = i + 1;
+	}
+
+	// now seqName is processed, then deal with pos and CIGAR
+	if( w.endC ) {
+		// for CG2TG, read1 is always on WATSON chain, so add 1M to the end of CIGAR; do not update POS
+		extend_cigar_end( w.cigar );
+	}
+	if( R2 != NULL )
+		load_mate( w, *R2, sc, true );
+
+	char *o = sam + sprintf( sam, "%s\t%s\t%s\t%d\t%d\t%s\t",
+						seqName+IDstart, w.flag, w.chr, w.pos, w.score, w.cigar.c_str() );
+	o = write_mate_fields( w, R2!=NULL, o );
+	if( w.endC )
+		o += sprintf( o, "\t%sC\t%s%c", seq.c_str(), w.qual.c_str(), w.Qend );
+	else
+		o += sprintf( o, "\t%s\t%s", seq.c_str(), w.qual.c_str() );
+	o = write_mate_cigar( w, R2!=NULL, o );
+	if( R2 != NULL )
+		swap_mate( w );
+	return o - sam;
+}
+
+// read 2 in CG2CA is ALWAYS on WATSON chain; MUST be called after restore_CA_read1
+// the score of read 1 is used
+int inline restore_CA_read2( sam_parser & w, const sidecar *sc, char *sam ) {
+	register int i, j, bias;
+	register unsigned int IDstart;
+	char *seqName = w.seqName;
+	string & seq = w.seq;
+
+	// R2 is split by load_mate
+	sam_view_copy( w.mview, SAM_QNAME, seqName, MAX_SEQNAME_SIZE );
+	sam_view_copy( w.mview, SAM_FLAG,  w.flag, MAX_ITERM_SIZE );
+	sam_view_copy( w.mview, SAM_RNAME, w.chr,  MAX_ITERM_SIZE );
+	w.pos = sam_view_int( w.mview, SAM_POS );
+	sam_view_copy( w.mview, SAM_CIGAR, w.cigar );
+	sam_view_copy( w.mview, SAM_SEQ,   w.seq );
+	sam_view_copy( w.mview, SAM_QUAL,  w.qual );
+
+	// deal seqName
+	// NOTE: in v2, there is NO line number in read 2 !!!
+	if( sc != NULL ) {
+		w.frontG = w.rec.flags & SIDECAR_FRONTG;
+		w.Qend = w.rec.qual2;
+		check_sidecar_read( w.rec.r2, seq.size(), w.frontG );
+		bias = w.frontG ? 1 : 0;
+		restore_conversion( &seq[0], w.rec.r2, -bias, 1, 'G' );
+		restore_quality( &w.qual[0], w.qual.size(), w.rec.r2, false );
+		copy_sidecar_name( seqName, w.rec.r2 );
+		IDstart = 0;
+	} else {
+		// look for frontG marker
+		if( seqName[1] == KEEP_QUAL_MARKER ) {
+			w.Qend = seqName[0];
+			w.frontG = true;
+			i = 2;
+			bias = 1;	// this is to adjust the seq array
+		} else {
+			w.frontG = false;
+			i = 0;
+			bias = 0;
+		}
+
+		// look for the conversion log start
+		if( seqName[i] != CONVERSION_LOG_END ) {	// there are G>A conversions
+			j = 0;
+			for( ; seqName[i] != CONVERSION_LOG_END; ++i ) {
+				if ( seqName[i] == CONVERSION_LOG_SEPARATOR ) {	// one change meet
+					seq[j-bias] = 'G';	// convert back to G; Read 2 is on WATSON strand
+					j = 0;
+				} else {
+					j <<= 4;
+					if( seqName[i] <= '9' ) {	// 0-9
+						j += seqName[i] - '0';
+					} else {	// a-f
+						j += seqName[i] - 87;	// 'a'-10
+					}
+				}
+			}
+			seq[j-bias] = 'G';	//convert back to G
+		}
+		IDstart = i + 1;
+	}
+
+	// now seqName is processed, then deal with pos and CIGAR
+	if( w.frontG ) {
+		// for CG2CA, read 2 is always on WATSON chain, so if there is a frontG,
+		// add a G at the begnning of CIGAR and update pos
+		extend_cigar_front( w.cigar );
+		-- w.pos;
+	}
+
+	char *o = sam + sprintf( sam, "%s\t%s\t%s\t%d\t%d\t%s\t",
+						seqName+IDstart, w.flag, w.chr, w.pos, w.score, w.cigar.c_str() );
+	o = write_mate_fields( w, true, o );
+	if( w.frontG )
+		o += sprintf( o, "\tG%s\t%c%s", seq.c_str(), w.Qend, w.qual.c_str() );
+	else
+		o += sprintf( o, "\t%s\t%s", seq.c_str(), w.qual.c_str() );
+	o = write_mate_cigar( w, true, o );
+	return o - sam;
+}
+
+// read 2 in CG2TG is ALWAYS on CRICK chain; MUST be called after restore_TG_read1
+// the score of read 1 is used
+int inline restore_TG_read2( sam_parser & w, const sidecar *sc, char *sam ) {
+	register int i, j, len;
+	register unsigned int IDstart;
+	char *seqName = w.seqName;
+	string & seq = w.seq;
+
+	// R2 is split by load_mate
+	sam_view_copy( w.mview, SAM_QNAME, seqName, MAX_SEQNAME_SIZE );
+	sam_view_copy( w.mview, SAM_FLAG,  w.flag, MAX_ITERM_SIZE );
+	sam_view_copy( w.mview, SAM_RNAME, w.chr,  MAX_ITERM_SIZE );
+	w.pos = sam_view_int( w.mview, SAM_POS );
+	sam_view_copy( w.mview, SAM_CIGAR, w.cigar );
+	sam_view_copy( w.mview, SAM_SEQ,   w.seq );
+	sam_view_copy( w.mview, SAM_QUAL,  w.qual );
+	if( sc != NULL ) {
+		w.frontG = w.rec.flags & SIDECAR_FRONTG;
+		w.Qend = w.rec.qual2;
+		check_sidecar_read( w.rec.r2, seq.size(), w.frontG );
+		len = w.frontG ? seq.size() : seq.size()-1;
+		restore_conversion( &seq[0], w.rec.r2, len, -1, 'C' );
+		restore_quality( &w.qual[0], w.qual.size(), w.rec.r2, true );
+		copy_sidecar_name( seqName, w.rec.r2 );
+		IDstart = 0;
+	} else {
+		// look for frontG marker
+		if( seqName[1] == KEEP_QUAL_MARKER ) {
+			w.Qend = seqName[0];
+			w.frontG = true;
+			i = 2;
+			len = seq.size();
+		} else {
+			w.frontG = false;
+			i = 0;
+			len = seq.size() - 1;
+		}
+
+		// process the conversion log
+		if( seqName[i] != CONVERSION_LOG_END ) {	// there are G>A conversions
+			j = 0;
+			for( ; seqName[i] != CONVERSION_LOG_END; ++i ) {
+				if ( seqName[i] == CONVERSION_LOG_SEPARATOR ) {	// one change meet
+					seq[len-j] = 'C';	// convert back to C; Read 2 is on CRICK strand
+					j = 0;
+				} else {
+					j <<= 4;
+					if( seqName[i] <= '9' ) {	// 0-9
+						j += seqName[i] - '0';
+					} else {	// a-f
+						j += seqName[i] - 87;	// 'a'-10
+					}
+				}
+			}
+			seq[len-j] = 'C';	//convert back to G
+		}
+		IDstart = i + 1;
+	}
+
+	// now seqName is processed, then deal with pos and CIGAR
+	if( w.frontG ) {
+		// for CG2TG, read 2 is always on CRICK chain; so if there is a frontG, add a 'C' to the end of sequence, add 1M at the _end_ of CIGAR
+		extend_cigar_end( w.cigar );
+	}
+
+	char *o = sam + sprintf( sam, "%s\t%s\t%s\t%d\t%d\t%s\t",
+						seqName+IDstart, w.flag, w.chr, w.pos, w.score, w.cigar.c_str() );
+	o = write_mate_fields( w, true, o );
+	if( w.frontG )
+		o += sprintf( o, "\t%sC\t%s%c", seq.c_str(), w.qual.c_str(), w.Qend );
+	else
+		o += sprintf( o, "\t%s\t%s", seq.c_str(), w.qual.c_str() );
+	o = write_mate_cigar( w, true, o );
+	return o - sam;
+}
+
+/*
+ * per-thread output arena: the records are formatted in place by the working threads, then a
+ * dedicated writer flushes the arenas in thread order, so the output is in the order of the
+ * input (i.e., independent of the thread number) and there is no locking on the output file
+*/
+typedef struct {
+	char *data;
+	size_t size, capacity;
+	frag_key *key;	// keys of the fragments in the arena (offsets are relative to data), NULL if not recorded
+	size_t keys, keyCapacity;
+} sam_arena;
+
+const size_t SAM_ARENA_INIT_SIZE = 1 << 24;	// 16 MB, grows if needed
+const size_t SAM_RECORD_RESERVE  = 4 * MAX_SAMLINE_SIZE;	// space needed by one fragment (with mate fields and MC tags)
+
+void inline init_sam_arena( sam_arena & a ) {
+	a.data = (char *) malloc( SAM_ARENA_INIT_SIZE );
+	a.size = 0;
+	a.capacity = SAM_ARENA_INIT_SIZE;
+	a.key = NULL;
+	a.keys = 0;
+	a.keyCapacity = 0;
+}
+
+// record the fragment keys of this arena
+void inline init_frag_keys( sam_arena & a ) {
+	a.keyCapacity = SAM_ARENA_INIT_SIZE / MAX_SAMLINE_SIZE;
+	a.key = (frag_key *) malloc( a.keyCapacity * sizeof(frag_key) );
+}
+
+void inline free_sam_arena( sam_arena & a ) {
+	free( a.data );
+	free( a.key );
+}
+
+// make sure there is enough space for one more fragment; returns where to write
+char inline * reserve_sam_arena( sam_arena & a ) {
+	if( a.size + SAM_RECORD_RESERVE > a.capacity ) {
+		a.capacity <<= 1;
+		a.data = (char *) realloc( a.data, a.capacity );
+	}
+	return a.data + a.size;
+}
+
+// write the arenas of all threads in order and empty them; returns false on write error
+// if keyfd is valid, the fragment keys are written too, with the offsets shifted by the bytes
+// already in the output file (i.e., written)
+bool inline write_sam_arenas( int fd, sam_arena *a, unsigned int n, int keyfd, uint64_t & written ) {
+	bool ok = true;
+	for( unsigned int i=0; i!=n; ++i ) {
+		if( keyfd >= 0 ) {
+			for( size_t j=0; j!=a[i].keys; ++j )
+				a[i].key[j].offset += written;
+			if( ok && ! write_all(keyfd, (const char *)a[i].key, a[i].keys*sizeof(frag_key)) )
+				ok = false;
+			a[i].keys = 0;
+		}
+		if( ok && ! write_all(fd, a[i].data, a[i].size) )
+			ok = false;
+		written += a[i].size;
+		a[i].size = 0;
+	}
+	return ok;
+}
+
+// append a fragment key for the record(s) starting at start, which end at the end of the arena
+// the chromosome is looked up in chrs (only if it is not the one of the last key of this thread);
+// pos and fragSize are set by the caller
+frag_key inline & add_frag_key( sam_arena & a, sam_parser & w, const chr_dict & chrs, const char *start, unsigned int strand ) {
+	if( a.keys == a.keyCapacity ) {
+		a.keyCapacity <<= 1;
+		a.key = (frag_key *) realloc( a.key, a.keyCapacity * sizeof(frag_key) );
+	}
+	frag_key & f = a.key[ a.keys ++ ];
+	f.offset = start - a.data;
+	f.length = a.data + a.size - start;
+	if( strcmp(w.chr, w.chrKey.c_str()) != 0 )
+		w.chrID = find_chr( chrs, w.chr, strlen(w.chr), w.chrKey );
+	f.chr = w.chrID;
+	f.strand = strand;
+	return f;
+}
+
+// sum of the quality scores of the read just restored (as rmdup does on the SAM record)
+unsigned int inline quality_sum( const sam_parser & w, bool extra ) {
+	register unsigned int score = extra ? w.Qend : 0;
+	register const char *p = w.qual.c_str();
+	for( ; *p; ++p )
+		score += *p;
+	return score;
+}
+
+// convert the SAM records in the arena into BGZF blocks of BAM records (for BAM output);
+// called by the working thread after its slice is done, tmp is its working buffer
+void inline sam_arena_to_bgzf( sam_arena & a, sam_arena & tmp, const bam_refs & refs ) {
+	size_t bamLen = sam_block_to_bam( a.data, a.size, refs, tmp.data, tmp.capacity );
+	size_t need = bgzf_bound( bamLen );
+	if( need > a.capacity ) {
+		a.capacity = need;
+		a.data = (char *) realloc( a.data, a.capacity );
+	}
+	a.size = bgzf_compress( tmp.data, bamLen, a.data, BAM_COMPRESS_LEVEL );
+}
+
+// restore a fragment aligned to CG2CA and append it to the arena; R2 is NULL for Single-End data
+// the XG:Z:GA is to mark that this fragment is aligned to the crick chain
+// this information is used in meth.caller and is consistent with Bismark
+// if chrs is not NULL, the fragment key is recorded
+void inline output_CA_fragment( sam_parser & w, const string * R2, const sidecar *sc, sam_arena & a, const chr_dict *chrs ) {
+	char *start = reserve_sam_arena( a );
+	char *o = start;
+	o += restore_CA_read1( w, sc, R2, o );
+	memcpy( o, "\tXG:Z:GA\n", 9 );
+	o += 9;
+	unsigned int qual = ( chrs != NULL ) ? quality_sum( w, w.endC ) : 0;
+	if( R2 != NULL ) {
+		o += restore_CA_read2( w, sc, o );
+		memcpy( o, "\tXG:Z:GA\n", 9 );
+		o += 9;
+		if( chrs != NULL )
+			qual += quality_sum( w, w.frontG );
+	}
+	a.size = o - a.data;
+	if( chrs != NULL ) {
+		frag_key & f = add_frag_key( a, w, *chrs, start, FRAG_CRICK );
+		f.pos  = w.pos;
+		f.qual = qual;
+		// for Paired-End data, read 2 (w.pos) is the leftmost and read 1 (the mate) is the rightmost
+		f.fragSize = ( R2 != NULL ) ? w.mpos + cigar_ref_length( w.mcigar.c_str() ) - w.pos
+									: cigar_ref_length( w.cigar.c_str() );
+	}
+}
+
+// restore a fragment aligned to CG2TG and append it to the arena; R2 is NULL for Single-End data
+// the XG:Z:CT is to mark that this fragment is aligned to the watson chain
+// if chrs is not NULL, the fragment key is recorded
+void inline output_TG_fragment( sam_parser & w, const string * R2, const sidecar *sc, sam_arena & a, const chr_dict *chrs ) {
+	char *start = reserve_sam_arena( a );
+	char *o = start;
+	o += restore_TG_read1( w, sc, R2, o );
+	memcpy( o, "\tXG:Z:CT\n", 9 );
+	o += 9;
+	unsigned int qual = ( chrs != NULL ) ? quality_sum( w, w.endC ) : 0;
+	if( R2 != NULL ) {
+		o += restore_TG_read2( w, sc, o );
+		memcpy( o, "\tXG:Z:CT\n", 9 );
+		o += 9;
+		if( chrs != NULL )
+			qual += quality_sum( w, w.frontG );
+	}
+	a.size = o - a.data;
+	if( chrs != NULL ) {
+		frag_key & f = add_frag_key( a, w, *chrs, start, FRAG_WATSON );
+		f.qual = qual;
+		// for Paired-End data, read 1 (the mate) is the leftmost and read 2 (w.pos) is the rightmost
+		if( R2 != NULL ) {
+			f.pos = w.mpos;
+			f.fragSize = w.pos + cigar_ref_length( w.cigar.c_str() ) - w.mpos;
+		} else {
+			f.pos = w.pos;
+			f.fragSize = cigar_ref_length( w.cigar.c_str() );
+		}
+	}
+}
+
+#endif
@@ -9,6 +9,8 @@
 #include <omp.h>
 #include <unistd.h>
 #include "common.h"
+#include "sidecar.h"
+#include "bowtie2.processer.h"
 
 using namespace std;
 
@@ -32,13 +34,27 @@ using namespace std;
 
 int main( int argc, char *argv[] ) {
 	if( argc < 5 ) {
-		cerr << "\nUsage: " << argv[0] << " <CG2TG.sam> <CG2CA.sam> <trim.log> <output.sam> [thread=1]\n"
+		cerr << "\nUsage: " << argv[0] << " <CG2TG.sam> <CG2CA.sam> <trim.log> <output.sam> [thread=1] [sidecar.prefix|null] [reorder=0] [chr.info|null] [mem.budget=0]\n"
 			 << "\nThis program is part of Msuite, designed to generate the final alignment file.\n\n"
 			 << "This program will convert 'T' back to 'C' in the alignment file.\n"
 			 << "For ambigous reads, only those with unique best hits and have good scores are kept.\n"
 			 << "Align score cutoff for ambigous reads: " << MIN_ALIGN_SCORE_AMB << '\n'
 			 << "Align score cutoff for non-ambigous reads: " << MIN_ALIGN_SCORE_UNQ << "\n\n"
-			 << "Multi-thread is supported, 4-8 threads are recommended.\n\n";
+			 << "Multi-thread is supported, 4-8 threads are recommended.\n"
+			 << "If sidecar.prefix is set, the conversion logs, read names and quality scores are\n"
+			 << "loaded from sidecar.prefix.sidecar (i.e., preprocessor is called with sidecar=1).\n"
+			 << "If reorder is set to 1, the two alignment files MUST be in the order of the input reads\n"
+			 << "(i.e., bowtie2 is called with --reorder) and they are merged in a single pass; in this\n"
+			 << "mode the alignment files could be pipes (e.g., FIFOs fed by running bowtie2 instances)\n"
+			 << "and they are merged incrementally as the records arrive.\n"
+			 << "If output ends with .bam, BAM is written directly (chr.info is needed for the header);\n"
+			 << "otherwise, if chr.info is given, the keys of the fragments (position, size, strand and\n"
+			 << "quality) are written to output.frag so that rmdup does not need to parse the SAM records.\n"
+			 << "If mem.budget is set (in MB), the hit table used without reorder is limited to it and the\n"
+			 << "fragments are processed in shards of line numbers (the alignment files are split into\n"
+			 << "temporary files of the shards next to output in one pass, which need the same disk space\n"
+			 << "as the alignment files); 0 means no limit, i.e., 2 bytes per read. There are at most\n"
+			 << MAX_HIT_SHARDS << " shards, so the table may exceed a very small budget for a large dataset.\n\n";
 		//cerr << "Rescue mode is ON.\n\n";
 
 		return 2;
@@ -55,23 +71,50 @@ int main( int argc, char *argv[] ) {
 		}
 	}
 
-	// load Ktrim.log, get the read number
-	FILE* ktrimlog = fopen( argv[3], "r" );
-	if( ktrimlog == NULL ) {
-		cerr << "Error: cannot open file " << argv[3] << "!\n";
-		exit(10);
+	sidecar sc;
+	const sidecar *psc = NULL;
+	if( argc > 6 && strcmp(argv[6], "null")!=0 ) {
+		if( ! open_sidecar( sc, argv[6] ) )
+			exit(14);
+		psc = &sc;
+	}
+
+	bool reorder = false;
+	if( argc > 7 )
+		reorder = ( atoi(argv[7]) != 0 );
+
+	// BAM output if the output file name ends with .bam, the references are loaded from chr.info
+	bam_refs refs;
+	unsigned int outLen = strlen( argv[4] );
+	bool bam = ( outLen>4 && strcmp(argv[4]+outLen-4, ".bam")==0 );
+	if( bam ) {
+		if( argc < 9 ) {
+			cerr << "Error: chr.info is needed for BAM output!\n";
+			exit(17);
+		}
+		if( ! load_bam_refs(argv[8], refs) )
+			exit(17);
+	}
+	// for SAM output, chr.info makes the fragment keys written to output.frag (for rmdup); the
+	// chromosomes are indexed as rmdup does
+	chr_dict chrs;
+	const chr_dict *keyChrs = NULL;
+	if( !bam && argc>8 && strcmp(argv[8], "null")!=0 ) {
+		if( ! load_chr_dict(argv[8], chrs) )
+			exit(17);
+		keyChrs = &chrs;
+	}
+	unsigned int budget = 0;	// memory budget (in MB) of the hit table, 0 for no limit
+	if( argc > 9 )
+		budget = atoi( argv[9] );
+	if( ! reorder ) {
+		for( unsigned int i=1; i!=3; ++i ) {
+			if( ! is_regular_file(argv[i]) ) {
+				cerr << "Error: " << argv[i] << " is not a regular file! Pipes could only be merged with reorder=1.\n";
+				exit(16);
+			}
+		}
 	}
-	unsigned int readNum;
-	int fscanRet = fscanf( ktrimlog, "%d", &readNum );
-	fclose( ktrimlog );
-	//printf( "Line number: %d!\n", readNum ); 
-
-    //cerr << "Requesting memory ...\n";
-	++ readNum;
-	int *hits = new int[ readNum ];
-	// initialization
-	for(register int i=0; i!=readNum; ++i)
-		hits[i] = IMPOSSIBLE_AS_SCORE;
 
 	// prepare files
 	ifstream CG2TG( argv[1] );
@@ -93,755 +136,394 @@ int main( int argc, char *argv[] ) {
 			return 100;
 		}
 	}
-	FILE * outsam = fopen( argv[4], "a" );	//this file must be EMPTY or NULL before calling this program!!!
-	if( outsam == NULL ) {
+	int outsam = open( argv[4], O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+	if( outsam < 0 ) {
 		cerr << "Error: cannot open file " << argv[4] << " to write!\n";
 		CG2TG.close();
 		CG2CA.close();
 		exit(13);
 	}
+	int outkey = -1;
+	uint64_t written = 0;	// bytes in the output file, used to locate the records in the fragment keys
+	if( keyChrs != NULL ) {
+		string keyfile = argv[4];
+		keyfile += ".frag";
+		outkey = open( keyfile.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+		if( outkey < 0 ) {
+			cerr << "Error: cannot open file " << keyfile << " to write!\n";
+			exit(13);
+		}
+	}
+	bool writeFail = false;
+	if( bam ) {
+		string head, text;
+		make_sam_header( refs, text );
+		text += "@PG\tID:Msuite\tPN:bowtie2.processer\n";
+		bam_header_blocks( text, refs, head );
+		if( ! write_all(outsam, head.data(), head.size()) )
+			writeFail = true;
+	}
 
-	// prepare Hits arrary
-//	cout << "Preparing HITS array ...\n";
-	// load align.CG2TG.sam, record the hit information
+	sam_parser *w = new sam_parser[ thread ];
+	// two sets of output arenas are used in turn: when the working threads are filling one of them,
+	// the writer thread is writing the other one, which contains the output of the previous batch
+	sam_arena *arena[2];
+	arena[0] = new sam_arena[ thread ];
+	arena[1] = new sam_arena[ thread ];
+	sam_arena *bamtmp = new sam_arena[ thread ];	// working space for BAM output
+	int *cntCA = new int [ thread ];
+	int *cntGT = new int [ thread ];
+	for( unsigned int i=0; i!=thread; ++i ) {
+		init_sam_parser( w[i] );
+		init_sam_arena( arena[0][i] );
+		init_sam_arena( arena[1][i] );
+		if( keyChrs != NULL ) {
+			init_frag_keys( arena[0][i] );
+			init_frag_keys( arena[1][i] );
+		}
+		if( bam )
+			init_sam_arena( bamtmp[i] );
+		cntCA[i] = 0;
+		cntGT[i] = 0;
+	}
 	string *R1 = new string[ READS_PER_BATCH ];
 	string *R2 = new string[ READS_PER_BATCH ];
-	string tmpR2;
-	while( true ) {
-		unsigned int loaded = 0;
-		while( true ) {
-			getline( CG2TG, R1[ loaded ] );
-			if( CG2TG.eof() )break;
-			getline( CG2TG, R2[ loaded ] );
-
-			++ loaded;
-			if( loaded == READS_PER_BATCH )
-				break;
-		}
-//		cerr << loaded << " lines loaded\n";
-		if( loaded == 0 ) break;
-
-		omp_set_num_threads( thread );
-		// get line number
-		#pragma omp parallel
-		{
-			unsigned int tn = omp_get_thread_num();
-			unsigned int start = loaded * tn / thread;
-			unsigned int end   = loaded * (tn+1) / thread;
-			const char * p;
-//          cerr << "Thread " << tn << ": s=" << start << ", e=" << end << '\n';
-
-			// Bowtie2 records the mismatch-score in the AS:i: tag and next match (if any) in XS:i: tag
-			// we will extract AS:i: tag in both read1 and read2
-			// 
-			// 10753_chr1:226691056-226691358_R1    99  chr1    226691056   35  50M =   226691309   303
-			// GTCTTTACAATTTGGCATGTTTTTGCAGTGGCTGGTACCAGTTGTTCCTT  HHHHHHHHHHHHHHGGGGGFFFFEEDDCCBBA@@?>=<<;:8765321/.
-			// AS:i:0  XS:i:-6 XN:i:0  XM:i:0  XO:i:0      XG:i:0  NM:i:0  MD:Z:50 YS:i:0  YT:Z:CP
-			// 10753_chr1:226691056-226691358_R2    147 chr1    226691309   35  50M =   226691056   -303
-			// TTCTGCTGAGAGATCTGCTGTTAGTCTGATGGGTTTCCCTTTGTGGGTAA  ./1235678:;<<=>?@@ABBCCDDEEFFFFGGGGGHHHHHHHHHHHHHH
-			// AS:i:0  XS:i:-6 XN:i:0  XM:i:0  XO:i:0      XG:i:0  NM:i:0  MD:Z:50 YS:i:0  YT:Z:CP
-			//
-			// Mostly AS-scores are 0 or negative
-			for( unsigned int ii=start; ii!=end; ++ii ) {
-				p = R1[ii].c_str();
-				register int i;
-				register unsigned int j = 0;
-				for( i=0; p[i]!=LINE_NUMBER_SEPARATOR; ++i ) {
-					j <<= 4;
-					if( p[i]<='9' ) {	//0-9
-						j += p[i] - '0';
-					} else {	//a-f
-						j += p[i] - 87;	// 'a'-10
-					}
+	unsigned int k = 0;	// batch index
+	omp_set_dynamic( 0 );
+	omp_set_num_threads( thread );
+
+	if( reorder ) {
+		//////////////////////////////////////////////////////////////////////////////////////////////////
+		// streaming mode: both files are in the order of the input reads, so the hits of the same fragment
+		// are met at the same time and the ambigous ones could be resolved on the fly
+		string *CA1 = new string[ READS_PER_BATCH ];
+		string *CA2 = new string[ READS_PER_BATCH ];
+		fragment *frag = new fragment[ READS_PER_BATCH ];
+		string nextTG1, nextTG2, nextCA1, nextCA2;	// look-ahead records
+		unsigned int lineTG = 0, lineCA = 0;
+		bool moreTG = next_record( CG2TG, nextTG1, &nextTG2, lineTG );
+		bool moreCA = next_record( CG2CA, nextCA1, &nextCA2, lineCA );
+		while( moreTG || moreCA ) {
+			unsigned int loaded = 0, loadedTG = 0, loadedCA = 0;
+			while( loaded!=READS_PER_BATCH && (moreTG || moreCA) ) {
+				register unsigned int line = ( moreTG && (!moreCA || lineTG<=lineCA) ) ? lineTG : lineCA;
+				fragment & f = frag[ loaded ];
+				f.tg = f.ca = -1;
+				if( moreTG && lineTG==line ) {
+					R1[ loadedTG ].swap( nextTG1 );
+					R2[ loadedTG ].swap( nextTG2 );
+					f.tg = loadedTG ++;
+					moreTG = next_record( CG2TG, nextTG1, &nextTG2, lineTG );
 				}
-
-				// skip the data before AS:i: tag (which is on column 12 (1-based)
-				// therefore there are 11 TABS before it)
-				register int k = 0;
-				++ i;
-				while( true ) {
-					if( p[i] == '\t' ) {
-						++ k;
-						if( k == 11 )
-							break;
-					}
-					++ i;
+				if( moreCA && lineCA==line ) {
+					CA1[ loadedCA ].swap( nextCA1 );
+					CA2[ loadedCA ].swap( nextCA2 );
+					f.ca = loadedCA ++;
+					moreCA = next_record( CG2CA, nextCA1, &nextCA2, lineCA );
 				}
-				int AStag1value = 0;
-				bool AStag1flag;
-				i += 6; // move from '\t' to AS:i:
-				if( p[i] == '-' ) {
-					AStag1flag = true;
-					++ i;
+				++ loaded;
+			}
+
+			#pragma omp parallel num_threads( thread+1 )
+			{
+				unsigned int tn = omp_get_thread_num();
+				if( tn == thread ) {	// writer: flush the output of the previous batch
+					if( ! write_sam_arenas(outsam, arena[(k+1)&1], thread, outkey, written) )
+						writeFail = true;
 				} else {
-					AStag1flag = false;
-				}
-				while( p[i] != '\t' ) {
-					AStag1value *= 10;
-					AStag1value += p[i] - '0';
-					++ i;
-				}
-				if( AStag1flag )
-				  AStag1value = - AStag1value;
+					unsigned int start = loaded * tn / thread;
+					unsigned int end   = loaded * (tn+1) / thread;
+					sam_parser & wk = w[tn];
+					register int AStg, ASca;
+					register bool ambigous;
+
+					for( unsigned int ii=start; ii!=end; ++ii ) {
+						register int tg = frag[ii].tg;
+						register int ca = frag[ii].ca;
+						ambigous = ( tg!=-1 && ca!=-1 );
+						if( ambigous ) {	// aligned to both CG2TG and CG2CA, only the unique best hit is kept
+							AStg = get_AS_score( R1[tg] ) + get_AS_score( R2[tg] );
+							ASca = get_AS_score( CA1[ca] ) + get_AS_score( CA2[ca] );
+							if( AStg == ASca )	// discard both (non-unique best hits)
+								continue;
+							if( AStg > ASca )
+								ca = -1;
+							else
+								tg = -1;
+						}
 
-				// deal read2
-				p = R2[ii].c_str();
-				k = 0;
-				i = 1;
-				while( true ) {
-					if( p[i] == '\t' ) {
-						++ k;
-						if( k == 11 )
-							break;
+						if( ca != -1 ) {	// read1 is ALWAYS on crick chain and read2 is always on WATSON chain
+							parse_head( wk, CA1[ca] );
+							if( ! keep_hit(wk, ambigous, CA1[ca], &CA2[ca]) )
+								continue;
+							output_CA_fragment( wk, &CA2[ca], psc, arena[k&1][tn], keyChrs );
+							++ cntCA[tn];
+						} else {	// read1 is ALWAYS on WATSON chain and read2 is always on CRICK chain
+							parse_head( wk, R1[tg] );
+							if( ! keep_hit(wk, ambigous, R1[tg], &R2[tg]) )
+								continue;
+							output_TG_fragment( wk, &R2[tg], psc, arena[k&1][tn], keyChrs );
+							++ cntGT[tn];
+						}
 					}
-					++ i;
-				}
-				int AStag2value = 0;
-				bool AStag2flag;
-				i += 6;
-				if( p[i] == '-' ) {
-					AStag2flag = true;
-					++ i;
-				} else {
-					AStag2flag = false;
+					if( bam )	// convert and compress the records of this slice
+						sam_arena_to_bgzf( arena[k&1][tn], bamtmp[tn], refs );
 				}
-				while( p[i] != '\t' ) {
-					AStag2value *= 10;
-					AStag2value += p[i] - '0';
-					++ i;
-				}
-				if( AStag2flag )
-					AStag2value = - AStag2value;
-
-				hits[j] = AStag1value + AStag2value;
-//				cerr << "j=" << j << ", score=" << hits[j] << '\n';
 			}
+			++ k;
+		}
+		delete [] CA1;
+		delete [] CA2;
+		delete [] frag;
+	} else {
+		// load Ktrim.log, get the read number
+		FILE* ktrimlog = fopen( argv[3], "r" );
+		if( ktrimlog == NULL ) {
+			cerr << "Error: cannot open file " << argv[3] << "!\n";
+			exit(10);
+		}
+		unsigned int readNum;
+		int fscanRet = fscanf( ktrimlog, "%d", &readNum );
+		fclose( ktrimlog );
+		//printf( "Line number: %d!\n", readNum ); 
+
+	    //cerr << "Requesting memory ...\n";
+		++ readNum;
+		// the hit table covers shardSize fragments; if the memory budget could not hold all of them,
+		// the alignment files are split into shards in one pass and processed shard by shard
+		unsigned int shardSize = hit_shard_size( readNum, budget );
+		unsigned int shardNum  = ( readNum + shardSize - 1 ) / shardSize;
+		hit_score *hits = new hit_score[ shardSize ];
+		if( shardNum > 1 ) {
+			if( ! split_into_shards(CG2TG, argv[4], "TG", shardSize, shardNum, 2) ||
+				! split_into_shards(CG2CA, argv[4], "CA", shardSize, shardNum, 2) )
+				exit(13);
 		}
-		if( CG2TG.eof() )break;
-	}
-	//cerr << "Done.\n";
 
-	//////////////////////////////////////////////////////////////////////////////////////////////////
-	// process CG2CA.sam file
-	// In this file, read1 is ALWAYS on crick chain and read2 is always on WATSON chain
-//	cout << "Processing CG2CA ...\n";
-	int *cntCA = new int [ thread ];
-	for( unsigned int i=0; i!=thread; ++i )
-		cntCA[i] = 0;
+		for( unsigned int first=0, shard=0; first<readNum; first+=shardSize, ++shard ) {
+			unsigned int size = ( readNum-first < shardSize ) ? readNum-first : shardSize;
+			// initialization
+			for(register unsigned int i=0; i!=size; ++i)
+				hits[i] = IMPOSSIBLE_AS_SCORE;
+			if( shardNum > 1 ) {	// load the records of this shard from its own files
+				CG2TG.close();
+				CG2TG.clear();
+				CG2TG.open( shard_file(argv[4], shard, "TG").c_str() );
+				CG2CA.close();
+				CG2CA.clear();
+				CG2CA.open( shard_file(argv[4], shard, "CA").c_str() );
+				if( CG2TG.fail() || CG2CA.fail() ) {
+					cerr << "Error: cannot open the files of shard " << shard << "!\n";
+					exit(11);
+				}
+			}
 
-	while( true ) {
-		unsigned int loaded = 0;
-		while( true ) {
-			getline( CG2CA, R1[ loaded ] );
-			if( CG2CA.eof() )break;
-			getline( CG2CA, R2[ loaded ] );
+			// prepare Hits arrary
+		//	cout << "Preparing HITS array ...\n";
+			// load align.CG2TG.sam, record the hit information
+			while( true ) {
+				unsigned int loaded = 0;
+				while( true ) {
+					getline( CG2TG, R1[ loaded ] );
+					if( CG2TG.eof() )break;
+					getline( CG2TG, R2[ loaded ] );
 
-			++ loaded;
-			if( loaded == READS_PER_BATCH ) break;
-		}
-		//cerr << loaded << "lines loaded\n";
-
-		// start task
-		omp_set_num_threads( thread );
-		#pragma omp parallel
-		{
-			unsigned int tn = omp_get_thread_num();
-			unsigned int sindex = loaded * tn / thread;
-			unsigned int eindex = loaded * (tn+1) / thread;
-
-			const char *p;	// *IDstr, *CIGARstr;
-			register unsigned int IDstart, IDend;
-			register bool endC, frontG, posStrand;	// indicators: "C" at the end, "G" at the front, and WATSON strand
-			register char Qend;	// quality score for the "C"
-			stringstream ss;
-			register char * seqName = (char *) malloc( MAX_SEQNAME_SIZE );
-			char * sam1 = (char *) malloc( MAX_SAMLINE_SIZE );
-			char * sam2 = (char *) malloc( MAX_SAMLINE_SIZE );
-			char chr[  MAX_ITERM_SIZE ];
-			char flag[ MAX_ITERM_SIZE ];
-			string cigar, seq, qual;
-			register int pos, score;
-			// the following items will not be updated, therefore string is OK
-			char scoreSTR[ MAX_ITERM_SIZE ];
-			char mateinfo[ MAX_ITERM_SIZE ];
-			register int len, bias;
-
-
-			for( unsigned int ii=sindex; ii!=eindex; ++ii ) {
-                // deal read 1: should be on CRICK chain
-                ss.clear();
-                ss.str( R1[ii] );
-                // extract seqName to score first; score is needed in case there is another hit on CT2TG
-                // this fragment could be discarded, so no need to extract others here
-                ss >> seqName >> flag >> chr >> pos >> score;
-
-                // deal seqName
-				register int i, k;
-                register unsigned int j = 0;
-                for( i=0; seqName[i] != LINE_NUMBER_SEPARATOR; ++i ) {
-                    j <<= 4;	// the number is in HEX
-                    if( seqName[i] <= '9' ) {	//0-9
-                        j += seqName[i] - '0';
-                    } else {	//a-f
-                        j += seqName[i] - 87;	// 'a'-10
-                    }
-                }
-
-				// check whether it is an ambigous hit
-				if( hits[j] != IMPOSSIBLE_AS_SCORE ) {	// this is an ambigous hit
-					register int ASindex = i + 1;
-					p = R1[ii].c_str();
-					k = 0;
-					while( true ) {
-						if( p[ASindex] == '\t' ) {
-							++ k;
-							if( k == 11 )
-							  break;
-						}
-						++ ASindex;
-					}
-					int AStag1value = 0;
-					bool AStag1flag;
-					ASindex += 6;
-					if( p[ASindex] == '-' ) {
-						AStag1flag  = true;
-						++ ASindex;
-					} else {
-						AStag1flag  = false;
-					}
-					while( p[ASindex] != '\t' ) {
-						AStag1value *= 10;
-						AStag1value += p[ASindex] - '0';
-						++ ASindex;
-					}
-					if( AStag1flag ) AStag1value = - AStag1value;
-
-					p = R2[ii].c_str();
-					k = 0;
-					ASindex = 1;
-					while( true ) {
-						if( p[ASindex] == '\t' ) {
-							++ k;
-							if( k == 11 )
-							  break;
-						}
-						++ ASindex;
+					++ loaded;
+					if( loaded == READS_PER_BATCH )
+						break;
+				}
+		//		cerr << loaded << " lines loaded\n";
+				if( loaded == 0 ) break;
+
+				// get line number, we will extract AS:i: tag in both read1 and read2
+				#pragma omp parallel
+				{
+					unsigned int tn = omp_get_thread_num();
+					unsigned int start = loaded * tn / thread;
+					unsigned int end   = loaded * (tn+1) / thread;
+		//          cerr << "Thread " << tn << ": s=" << start << ", e=" << end << '\n';
+
+					for( unsigned int ii=start; ii!=end; ++ii ) {
+						register unsigned int j = get_line_number( R1[ii].c_str() ) - first;
+						if( j < size )	// in this shard
+							hits[j] = compact_score( get_AS_score( R1[ii] ) + get_AS_score( R2[ii] ) );
 					}
-					int AStag2value = 0;
-					bool AStag2flag;
-					ASindex += 6;	// move from '\t' to AS:i:
-					if( p[ASindex] == '-' ) {
-						AStag2flag = true;
-						++ ASindex;
+				}
+				if( CG2TG.eof() )break;
+			}
+			//cerr << "Done.\n";
+
+			//////////////////////////////////////////////////////////////////////////////////////////////////
+			// process CG2CA.sam file
+			// In this file, read1 is ALWAYS on crick chain and read2 is always on WATSON chain
+		//	cout << "Processing CG2CA ...\n";
+			while( true ) {
+				unsigned int loaded = 0;
+				while( true ) {
+					getline( CG2CA, R1[ loaded ] );
+					if( CG2CA.eof() )break;
+					getline( CG2CA, R2[ loaded ] );
+
+					++ loaded;
+					if( loaded == READS_PER_BATCH ) break;
+				}
+				//cerr << loaded << "lines loaded\n";
+
+				// start task
+				#pragma omp parallel num_threads( thread+1 )
+				{
+					unsigned int tn = omp_get_thread_num();
+					if( tn == thread ) {	// writer: flush the output of the previous batch
+						if( ! write_sam_arenas(outsam, arena[(k+1)&1], thread, outkey, written) )
+							writeFail = true;
 					} else {
-						AStag2flag = false;
-					}
-					while( p[ASindex] != '\t' ) {
-						AStag2value *= 10;
-						AStag2value += p[ASindex] - '0';
-						++ ASindex;
-					}
-					if( AStag2flag ) AStag2value = - AStag2value;
-
-					ASindex = AStag1value + AStag2value;	// AS-score of this hit
-
-//					cerr << "Ambigous: j=" << j << ", score=" << ASindex << '\n';
-
-					if( ASindex > hits[j] ) {	// this one is the unique best hit
-						hits[j] = DISCARD_AMB_HIT;
-						if( score < MIN_ALIGN_SCORE_AMB )
-							continue;
-						score >>= 1;	// lower the score
-					} else if ( ASindex == hits[j] ) {	// discard both (non-unique best hits)
-						hits[j] = DISCARD_AMB_HIT;
-						continue;
-					} else {	// the other one is the unique best hit
-						hits[j] = AMB_HIT_MARKER;
-						continue;
-					}
-				} else {	// non-ambigous
-					if( score < MIN_ALIGN_SCORE_UNQ ) {	// too poor quality, discard
-						// TODO: if both R1 and R2 do not have 2nd hits (i.e., no XS tag), still keep it
-						// if XS tag exists, it will be always after the AS tag, i.e., on column 13
-						//cerr << "Checking " << seqName << '\n';
-						register int XSindex = i + 1;
-						p = R1[ii].c_str();
-						k = 0;
-						while( true ) {
-							if( p[XSindex] == '\t' ) {
-								++ k;
-								if( k == 12 )
-								  break;
+						unsigned int sindex = loaded * tn / thread;
+						unsigned int eindex = loaded * (tn+1) / thread;
+						sam_parser & wk = w[tn];
+						register int ASindex;
+						register bool ambigous;
+
+						for( unsigned int ii=sindex; ii!=eindex; ++ii ) {
+							register unsigned int j = get_line_number( R1[ii].c_str() ) - first;
+							if( j >= size )	// not in this shard
+								continue;
+							// extract seqName to score first; score is needed in case there is another hit on CT2TG
+							// this fragment could be discarded, so no need to extract others here
+							parse_head( wk, R1[ii] );
+
+							// check whether it is an ambigous hit
+							ambigous = false;
+							if( hits[j] != IMPOSSIBLE_AS_SCORE ) {	// this is an ambigous hit
+								ASindex = compact_score( get_AS_score( R1[ii] ) + get_AS_score( R2[ii] ) );	// AS-score of this hit
+								if( ASindex > hits[j] ) {	// this one is the unique best hit
+									hits[j] = DISCARD_AMB_HIT;
+									ambigous = true;
+								} else if ( ASindex == hits[j] ) {	// discard both (non-unique best hits)
+									hits[j] = DISCARD_AMB_HIT;
+									continue;
+								} else {	// the other one is the unique best hit
+									hits[j] = AMB_HIT_MARKER;
+									continue;
+								}
 							}
-							++ XSindex;
-						}
-						if( p[XSindex+1]=='X' && p[XSindex+2]=='S' )	// there is a XS index, DISCARD
-							continue;
-
-						XSindex = 1;
-						p = R2[ii].c_str();
-						k = 0;
-						while( true ) {
-							if( p[XSindex] == '\t' ) {
-								++ k;
-								if( k == 12 )
-								  break;
-							}
-							++ XSindex;
-						}
-						if( p[XSindex+1]=='X' && p[XSindex+2]=='S' )	// there is a XS index, DISCARD
-							continue;
-						//cerr << "UNIQUE_POOR\t" << seqName << '\n';
-						//continue;
+							if( ! keep_hit(wk, ambigous, R1[ii], &R2[ii]) )
+								continue;
 
-						// here this read will be kept !!!
-						//cerr << "Rescued: " << seqName << '\n';
+							//this fragment will be kept, restore the reads
+							output_CA_fragment( wk, &R2[ii], psc, arena[k&1][tn], keyChrs );
+							++ cntCA[tn];
+						}
+						if( bam )	// convert and compress the records of this slice
+							sam_arena_to_bgzf( arena[k&1][tn], bamtmp[tn], refs );
 					}
 				}
+				++ k;
 
-                //this fragment will be kept, extract other information
-                ss >> cigar >> mateinfo >> mateinfo >> mateinfo >> seq >> qual;
-
-                // look for the conversion log start
-                if( seqName[i+2] == KEEP_QUAL_MARKER ) {	// marker for endC
-                    Qend = seqName[i+1];
-                    endC = true;
-                    i += 3;
-                } else {
-                    endC = false;
-                    ++ i;
-                }
-                if( seqName[i] != CONVERSION_LOG_END ) {	// there are C>T conversions
-                    // process the conversion log
-                    len = seq.size() - 1;
-                    // the counting is from the right to the left and the missing 'C' (if exists)
-                    // should be the leftmost, therefore it DOES not affect calculating the index
-                    j = 0;
-                    for( ; seqName[i] != CONVERSION_LOG_END; ++i ) {
-                        if ( seqName[i] == CONVERSION_LOG_SEPARATOR ) {	// one change meet
-                            seq[len-j] = 'G';
-                            j = 0;
-                        } else {
-                            j <<= 4;
-                            if( seqName[i] <= '9' ) {	// 0-9
-                                j += seqName[i] - '0';
-                            } else {	// a-f
-                                j += seqName[i] - 87;	// 'a'-10
-                            }
-                        }
-                    }
-                    seq[len-j] = 'G';
-                }
-                IDstart = i + 1;
-
-                // now seqName is processed, then deal with pos and CIGAR;
-                // matepos is NOT considered here!!! Dist is always not affected, so ignore it
-                if( endC ) {
-                    // for CG2CA, read1 is always on crick chain; so if there is an endC,
-                    // add '1M' at the beginning of the CIGAR and update POS
-                    -- pos;
-                    j = 0;
-                    p = cigar.c_str();
-                    for(i=0; p[i] != 'M'; ++i) {
-                        j *= 10;
-                        j += p[i] - '0';
-                    }
-                    ++ j;	// this is to add the '1M' at the beginning of the CIGAR
-                    /*
-                        fout << seqName+IDstart << '\t' << flag << '\t' << chr << '\t' << pos << '\t' << score
-                             << '\t' << j << 'M' << p+i+1 << '\t' << mateinfo << '\t' << matepos << '\t' << dist
-                             << '\t' << 'G' << seq << '\t' << Qend << qual << endl;
-                        */
-					// the XG:Z:GA is to mark that this fragment is aligned to the crick chain
-					// this information is used in meth.caller and is consistent with Bismark
-					// this mark is ONLY added to read1
-                    sprintf( sam1, "%s\t%s\t%s\t%d\t%d\t%d%s\t*\t0\t0\tG%s\t%c%s",
-								seqName+IDstart, flag, chr, pos, score, j, p+i,
-								seq.c_str(), Qend, qual.c_str() );
-                } else {	// do not need to update CIGAR and pos
-                    /*
-                        fout << seqName+IDstart << '\t' << flag << '\t' << chr << '\t' << pos << '\t' << score
-                            << '\t' << cigar << '\t' << mateinfo << '\t' << matepos << '\t' << dist
-                            << '\t' << seq << '\t' << qual << endl;
-                        */
-                    sprintf( sam1, "%s\t%s\t%s\t%d\t%d\t%s\t*\t0\t0\t%s\t%s",
-								seqName+IDstart, flag, chr, pos, score, cigar.c_str(),
-								seq.c_str(), qual.c_str() );
-                }
-
-                /////////////////////////////////////////////////////////////////////////////////////////////////////
-                // deal read 2: should be on WATSON chain
-                ss.clear();
-                ss.str( R2[ ii ] );
-                ss >> seqName >> flag >> chr >> pos >> scoreSTR >> cigar
-                    >> mateinfo >> mateinfo >> mateinfo >> seq >> qual;
-
-                // deal seqName
-                // skip the LINE_NUMBER since it has been handled in Read 1
-                // NOTE: in v2, there is NO line number in read 2 !!!
-
-                // look for frontG marker
-                if( seqName[1] == KEEP_QUAL_MARKER ) {
-                    Qend = seqName[0];
-                    frontG = true;
-                    i = 2;
-                    bias = 1;	// this is to adjust the seq array
-                } else {
-                    frontG = false;
-                    i = 0;
-                    bias = 0;
-                }
-
-                // look for the conversion log start
-                if( seqName[i] != CONVERSION_LOG_END ) {	// there are G>A conversions
-                    j = 0;
-                    for( ; seqName[i] != CONVERSION_LOG_END; ++i ) {
-                        if ( seqName[i] == CONVERSION_LOG_SEPARATOR ) {	// one change meet
-                            seq[j-bias] = 'G';	// convert back to G; Read 2 is on WATSON strand
-                            j = 0;
-                        } else {
-                            j <<= 4;
-                            if( seqName[i] <= '9' ) {	// 0-9
-                                j += seqName[i] - '0';
-                            } else {	// a-f
-                                j += seqName[i] - 87;	// 'a'-10
-                            }
-                        }
-                    }
-                    seq[j-bias] = 'G';	//convert back to G
-                }
-                IDstart = i + 1;
-
-                // now seqName is processed, then deal with pos and CIGAR;
-                // matepos is NOT considered here!!! Dist is always not affected, so ignore it
-                if( frontG ) {
-                    // for CG2CA, read 2 is always on WATSON chain, so if there is a frontG,
-                    // add a G at the begnning of CIGAR and update pos
-                    // CIGAR: xM[yID]zM
-                    -- pos;
-                    // add 1M at the beginning of the CIGAR
-                    j = 0;
-                    p = cigar.c_str();
-                    for(i=0; p[i] != 'M'; ++i) {
-                        j *= 10;
-                        j += p[i] - '0';
-                    }
-                    ++ j;	// this is to add the '1M' at the beginning of the CIGAR
-                    /*fout << seqName+IDstart << '\t' << flag << '\t' << chr << '\t' << pos << '\t' << scoreSTR
-                        << '\t' << j << 'M' << p+i+1 << '\t' << mateinfo << '\t' << matepos << '\t' << dist
-                        << '\t' << 'G' << seq << '\t' << Qend << qual << endl;*/
-                    sprintf( sam2, "%s\t%s\t%s\t%d\t%d\t%d%s\t*\t0\t0\tG%s\t%c%s",
-								seqName+IDstart, flag, chr, pos, score, j, p+i,
-								seq.c_str(), Qend, qual.c_str() );
-                } else {	// do not need to update CIGAR and pos
-                    /*fout << seqName+IDstart << '\t' << flag << '\t' << chr << '\t' << pos << '\t' << scoreSTR
-                        << '\t' << cigar << '\t' << mateinfo << '\t' << matepos << '\t' << dist
-                        << '\t' << seq << '\t' << qual << endl;*/
-                    sprintf( sam2, "%s\t%s\t%s\t%d\t%d\t%s\t*\t0\t0\t%s\t%s",
-								seqName+IDstart, flag, chr, pos, score, cigar.c_str(),
-								seq.c_str(), qual.c_str() );
-                }                
-                fprintf( outsam, "%s\tXG:Z:GA\n%s\tXG:Z:GA\n", sam1, sam2 );
-                ++ cntCA[tn];
-            }
-            free( seqName );
-            free( sam1    );
-            free( sam2    );
-        }
-
-        if( CG2CA.eof() )break;
-	}
-    unsigned int CAall = 0;
-    for( unsigned int i=0; i!=thread; ++i )
-        CAall += cntCA[i];
-
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	// process CG2TG.sam
-	// In this file, read1 is ALWAYS on WATSON chain and read2 is always on CRICK chain
-//	cout << "Processing CG2TG ...\n";
-	CG2TG.clear();
-	CG2TG.seekg( ios_base::beg );
-    int *cntGT = new int [ thread ];
-    for( unsigned int i=0; i!=thread; ++i )
-        cntGT[i] = 0;
-    while( true ) {
-        unsigned int loaded = 0;
-		while( true ) {
-			getline( CG2TG, R1[ loaded ] );
-			if( CG2TG.eof() )break;
-			getline( CG2TG, R2[ loaded ] );
-
-			++ loaded;
-			if( loaded == READS_PER_BATCH )
-				break;
-		}
-        //cerr << loaded << "lines loaded\n";
-
-        // start task
-		omp_set_num_threads( thread );
-		#pragma omp parallel
-		{
-            unsigned int tn = omp_get_thread_num();
-			unsigned int sindex = loaded * tn / thread;
-			unsigned int eindex = loaded * (tn+1) / thread;
-
-            char * sam1 = (char *) malloc( MAX_SAMLINE_SIZE );
-            char * sam2 = (char *) malloc( MAX_SAMLINE_SIZE );
-            //unsigned int sam1len, sam2len;
-
-			const char *p;	//*IDstr, *CIGARstr;
-			register unsigned int IDstart, IDend;
-			register bool endC, frontG, posStrand;	// indicators: "C" at the end, "G" at the front, and WATSON strand
-			register char Qend;	// quality score for the "C"
-			stringstream ss;
-			register char * seqName = (char *) malloc( MAX_SEQNAME_SIZE );
-			char chr[  MAX_ITERM_SIZE ];
-			char flag[ MAX_ITERM_SIZE ];
-			string cigar, seq, qual;
-			register int pos, score;
-			//the following items will not be updated, therefore string is OK
-			char scoreSTR[ MAX_ITERM_SIZE ];
-			char mateinfo[ MAX_ITERM_SIZE ];
-			register int len, bias;
-
-            for( unsigned int ii=sindex; ii!=eindex; ++ii ) {
-                // deal read 1: should be on WATSON chain
-                ss.clear();
-                ss.str( R1[ ii ] );
-                ss >> seqName >> flag >> chr >> pos >> score;
-
-                // deal seqName
-				register int i, k;
-                register unsigned int j = 0;
-                for( i=0; seqName[i] != LINE_NUMBER_SEPARATOR; ++i ) {
-                    j <<= 4;	// the number is in HEX
-                    if( seqName[i]<='9' ) {	//0-9; seqName > '0' is always true
-                        j += seqName[i] - '0';
-                    } else {	//a-f
-                        j += seqName[i] - 87;	// 'a'-10
-                    }
-				}
+				if( CG2CA.eof() )break;
+			}
 
-				// check ambigous
-				if( hits[j] == DISCARD_AMB_HIT ) { // ambigous marked and discarded by CG2CA
-					continue;
-				} else if ( hits[j] == AMB_HIT_MARKER ) {	// ambigous marked BUT kept by CG2CA
-					if( score < MIN_ALIGN_SCORE_AMB )
-						continue;
-					score >>= 1;	// lower the score
-				} else {	// unique hit
-					if( score < MIN_ALIGN_SCORE_UNQ ) {
-						// TODO: if both R1 and R2 do not have 2nd hits (i.e., no XS tag), still keep it
-						// if XS tag exists, it will be always after the AS tag, i.e., on column 13
-						// It seems that this will introduce lots of errors!!!
-						//cerr << "Checking " << seqName << '\n';
-						register int XSindex = i + 1;
-						p = R1[ii].c_str();
-						k = 0;
-						while( true ) {
-							if( p[XSindex] == '\t' ) {
-								++ k;
-								if( k == 12 )
-								  break;
-							}
-							++ XSindex;
-						}
-						if( p[XSindex+1]=='X' && p[XSindex+2]=='S' )	// there is a XS index, DISCARD
-							continue;
-
-						XSindex = 1;
-						p = R2[ii].c_str();
-						k = 0;
-						while( true ) {
-							if( p[XSindex] == '\t' ) {
-								++ k;
-								if( k == 12 )
-								  break;
-							}
-							++ XSindex;
-						}
-						if( p[XSindex+1]=='X' && p[XSindex+2]=='S' )	// there is a XS index, DISCARD
-							continue;
+			/////////////////////////////////////////////////////////////////////////////////////////////////
+			/////////////////////////////////////////////////////////////////////////////////////////////////
+			// process CG2TG.sam
+			// In this file, read1 is ALWAYS on WATSON chain and read2 is always on CRICK chain
+		//	cout << "Processing CG2TG ...\n";
+			CG2TG.clear();
+			CG2TG.seekg( ios_base::beg );
+			while( true ) {
+				unsigned int loaded = 0;
+				while( true ) {
+					getline( CG2TG, R1[ loaded ] );
+					if( CG2TG.eof() )break;
+					getline( CG2TG, R2[ loaded ] );
 
-						//cerr << "UNIQUE_POOR\t" << seqName << '\n';
-						//continue;
-						//now this hit will be kept!!!
-						//cerr << "Rescued: " << seqName << '\n';
+					++ loaded;
+					if( loaded == READS_PER_BATCH )
+						break;
+				}
+				//cerr << loaded << "lines loaded\n";
+
+				// start task
+				#pragma omp parallel num_threads( thread+1 )
+				{
+					unsigned int tn = omp_get_thread_num();
+					if( tn == thread ) {	// writer: flush the output of the previous batch
+						if( ! write_sam_arenas(outsam, arena[(k+1)&1], thread, outkey, written) )
+							writeFail = true;
+					} else {
+						unsigned int sindex = loaded * tn / thread;
+						unsigned int eindex = loaded * (tn+1) / thread;
+						sam_parser & wk = w[tn];
+
+						for( unsigned int ii=sindex; ii!=eindex; ++ii ) {
+							register unsigned int j = get_line_number( R1[ii].c_str() ) - first;
+							if( j >= size )	// not in this shard
+								continue;
+							parse_head( wk, R1[ii] );
+
+							// check ambigous
+							if( hits[j] == DISCARD_AMB_HIT ) // ambigous marked and discarded by CG2CA
+								continue;
+							// ambigous marked BUT kept by CG2CA, or unique hit
+							if( ! keep_hit(wk, hits[j]==AMB_HIT_MARKER, R1[ii], &R2[ii]) )
+								continue;
+
+							output_TG_fragment( wk, &R2[ii], psc, arena[k&1][tn], keyChrs );
+							++ cntGT[tn];
+						}
+						if( bam )	// convert and compress the records of this slice
+							sam_arena_to_bgzf( arena[k&1][tn], bamtmp[tn], refs );
 					}
 				}
-
-                // extract the other sections in the SAM record
-                ss >> cigar >> mateinfo >> mateinfo >> mateinfo >> seq >> qual;
-
-                // check endC marker
-                if( seqName[i+2] == KEEP_QUAL_MARKER ) {	// there is a C at the end
-                    Qend = seqName[i+1];
-                    endC = true;
-                    i += 3;
-                } else {	// no C at the end
-                    endC = false;
-                    ++ i;
-                }
-
-                // process the conversion log
-                if( seqName[i] != CONVERSION_LOG_END ) {	// there are changes in this read
-                    j = 0;
-                    for( ; seqName[i] != CONVERSION_LOG_END; ++i ) {
-                        if ( seqName[i] == CONVERSION_LOG_SEPARATOR ) {	// one change met
-                            seq[j] = 'C';	//convert back to 'C'; read 1 is on WATSON
-                            j = 0;
-                        } else {
-                            j <<= 4;
-                            if( seqName[i]<='9' ) {	//0-9, seqName > '0' is always true
-                                j += seqName[i] - '0';
-                            } else {	//a-f
-                                j += seqName[i] - 87;	// 'a'-10
-                            }
-                        }
-                    }
-                    seq[j] = 'C';	//convert back to C
-                }
-                IDstart = i + 1;
-
-                // now seqName is processed, then deal with pos and CIGAR;
-                // matepos is NOT considered here!!! Dist is always not affected, so ignore it
-                if( endC ) {
-                    // for CG2TG, read1 is always on WATSON chain, so add 1M to the end of CIGAR; do not update POS
-                    // CIGAR: xM[yID]zM
-                    len = cigar.size();
-                    p = cigar.c_str();
-                    i = len - 3;	// len-1 is 'M', len-2 MUST be a digital
-                    while( i >= 0 ) {
-                        if( p[i] > '9' ) break;	// it is not a digital (should be I/D/), stop here
-                        -- i;
-                    }
-                    ++ i;	// now it point to the first digital of the LAST match segment; could be 0 (i.e., cigar is xxM only)
-                    j = 0;
-                    for( k=i; p[k] != 'M'; ++k ) {
-                        j *= 10;
-                        j += p[k] - '0';
-                    }
-                    ++ j;	// this is to add the 1M at the end of CIGAR
-                    cigar.resize( i );
-                    /*fout << seqName+IDstart << '\t' << flag << '\t' << chr << '\t' << pos << '\t' << scoreSTR
-                        << '\t' << cigar << j << 'M' << '\t' << mateinfo << '\t' << matepos << '\t' << dist
-                        << '\t' << seq << 'C' << '\t' << qual << Qend << endl;*/
-					// the XG:Z:CT is to mark that this fragment is aligned to the watson chain
-					// this information is used in meth.caller and is the same as Bismark
-					// this mark is ONLY added to read1
-                    sprintf( sam1, "%s\t%s\t%s\t%d\t%d\t%s%dM\t*\t0\t0\t%sC\t%s%c",
-								seqName+IDstart, flag, chr, pos, score, cigar.c_str(), j,
-								seq.c_str(), qual.c_str(), Qend );
-                } else {	// do not need to update CIGAR
-                    /*fout << seqName+IDstart << '\t' << flag << '\t' << chr << '\t' << pos << '\t' << scoreSTR
-                        << '\t' << cigar << '\t' << mateinfo << '\t' << matepos << '\t' << dist
-                        << '\t' << seq << '\t' << qual << endl;*/
-                    sprintf( sam1, "%s\t%s\t%s\t%d\t%d\t%s\t*\t0\t0\t%s\t%s",
-								seqName+IDstart, flag, chr, pos, score, cigar.c_str(),
-								seq.c_str(), qual.c_str() );
-                }
-
-                /////////////////////////////////////////////////////////////////////////////////////////////////////
-                // deal read 2: should be on CRICK chain
-                ss.clear();
-                ss.str( R2[ ii ] );
-                ss >> seqName >> flag >> chr >> pos >> scoreSTR >> cigar
-                    >> mateinfo >> mateinfo >> mateinfo >> seq >> qual;
-                // look for the conversion log start
-                // look for frontG marker
-                if( seqName[1] == KEEP_QUAL_MARKER ) {
-                    Qend = seqName[0];
-                    frontG = true;
-                    i = 2;
-                    len = seq.size();
-                } else {
-                    frontG = false;
-                    i = 0;
-                    len = seq.size() - 1;
-                }
-
-                // process the conversion log
-                if( seqName[i] != CONVERSION_LOG_END ) {	// there are G>A conversions
-                    j = 0;
-                    for( ; seqName[i] != CONVERSION_LOG_END; ++i ) {
-                        if ( seqName[i] == CONVERSION_LOG_SEPARATOR ) {	// one change meet
-                            seq[len-j] = 'C';	// convert back to C; Read 2 is on CRICK strand
-                            j = 0;
-                        } else {
-                            j <<= 4;
-                            if( seqName[i] <= '9' ) {	// 0-9
-                                j += seqName[i] - '0';
-                            } else {	// a-f
-                                j += seqName[i] - 87;	// 'a'-10
-                            }
-                        }
-                    }
-                    seq[len-j] = 'C';	//convert back to G
-                }
-                IDstart = i + 1;
-
-                // now seqName is processed, then deal with pos and CIGAR;
-                // matepos is NOT considered here!!! Dist is always not affected, so ignore it
-                if( frontG ) {
-                    // for CG2CA, read 2 is always on CRICK chain; so if there is a frontG, add a 'C' to the end of sequence, add 1M at the _end_ of CIGAR
-                    // CIGAR: xM[yID]zM
-                    len = cigar.size();
-                    p = cigar.c_str();
-                    i = len - 3;	// len-1 is 'M', len-2 MUST be a digital
-                    while( i >= 0 ) {
-                        if( p[i] > '9' ) break;	// it is not a digital (should be I/D/), stop here
-                        -- i;
-                    }
-                    ++ i;	// now it point to the first digital of the LAST match segment; could be 0 (i.e., cigar is xxM only)
-                    j = 0;
-                    for( k=i; p[k] != 'M'; ++k ) {
-                        j *= 10;
-                        j += p[k] - '0';
-                    }
-                    ++ j;	// this is to add the 1M at the end of CIGAR
-                    cigar.resize( i );
-                    /*fout << seqName+IDstart << '\t' << flag << '\t' << chr << '\t' << pos << '\t' << scoreSTR
-                        << '\t' << cigar << j << 'M' << '\t' << mateinfo << '\t' << matepos << '\t' << dist
-                        << '\t' << seq << 'C' << '\t' << qual << Qend << endl;*/
-                    sprintf( sam2, "%s\t%s\t%s\t%d\t%d\t%s%dM\t*\t0\t0\t%sC\t%s%c",
-								seqName+IDstart, flag, chr, pos, score, cigar.c_str(), j,
-								seq.c_str(), qual.c_str(), Qend );
-
-                } else {	// do not need to update CIGAR and pos
-                    /*fout << seqName+IDstart << '\t' << flag << '\t' << chr << '\t' << pos << '\t' << scoreSTR
-                        << '\t' << cigar << '\t' << mateinfo << '\t' << matepos << '\t' << dist
-                        << '\t' << seq << '\t' << qual << endl;*/
-                    sprintf( sam2, "%s\t%s\t%s\t%d\t%d\t%s\t*\t0\t0\t%s\t%s",
-								seqName+IDstart, flag, chr, pos, score, cigar.c_str(),
-								seq.c_str(), qual.c_str() );
-                }
-                fprintf( outsam, "%s\tXG:Z:CT\n%s\tXG:Z:CT\n", sam1, sam2 );
-                ++ cntGT[tn];
-            }
-            free( seqName );
-            free( sam1    );
-            free( sam2    );
-        }
-        if( CG2TG.eof() )break;
+				++ k;
+				if( CG2TG.eof() )break;
+			}
+			if( shardNum > 1 ) {
+				remove( shard_file(argv[4], shard, "TG").c_str() );
+				remove( shard_file(argv[4], shard, "CA").c_str() );
+			}
+		}
+		delete [] hits;
+	}
+	// write the output of the last batch
+	if( ! write_sam_arenas(outsam, arena[(k+1)&1], thread, outkey, written) )
+		writeFail = true;
+	if( bam && ! write_all(outsam, BGZF_EOF_BLOCK, 28) )
+		writeFail = true;
+
+	unsigned int CAall = 0, GTall = 0;
+	for( unsigned int i=0; i!=thread; ++i ) {
+		CAall += cntCA[i];
+		GTall += cntGT[i];
+		free_sam_parser( w[i] );
+		free_sam_arena( arena[0][i] );
+		free_sam_arena( arena[1][i] );
+		if( bam )
+			free_sam_arena( bamtmp[i] );
 	}
-    unsigned int GTall = 0;
-    for( unsigned int i=0; i!=thread; ++i )
-        GTall += cntGT[i];
 
 	cout << "WATSON\t" << GTall << '\n'
 		 << "CRICK\t"  << CAall << '\n';
 
 	CG2CA.close();
 	CG2TG.close();
-    fclose( outsam );
-
-	delete [] hits;
+	close( outsam );
+	if( outkey >= 0 )
+		close( outkey );
+
+	if( psc != NULL )
+		close_sidecar( sc );
+	delete [] w;
+	delete [] arena[0];
+	delete [] arena[1];
+	delete [] bamtmp;
 	delete [] R1;
 	delete [] R2;
     delete [] cntCA;
     delete [] cntGT;
 
+	if( writeFail ) {
+		cerr << "Error: write file " << argv[4] << " failed!\n";
+		return 13;
+	}
 	return 0;
 }
-
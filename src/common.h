@@ -38,33 +38,20 @@ typedef struct {
 	unsigned int N;
 } fastqstat;
 
-typedef struct {
-	const char* adapter_r1;
-	const char* adapter_r2;
-	const unsigned int adapter_len;
-	const char* adapter_index;
-} adapter_info;
-
 //illumina sequencing adapters
-const char* illumina_adapter_sequence = "AGATCGGAAGAGC";
+constexpr char illumina_adapter_sequence[] = "AGATCGGAAGAGC";
 const unsigned int illumina_adapter_len = 13;	//strlen(illumina_adapter_sequence)
-const char* illumina_adapter_index = "AGA";
-static adapter_info illumina_adapter = {illumina_adapter_sequence, illumina_adapter_sequence,
-										illumina_adapter_len, illumina_adapter_index};
+constexpr char illumina_adapter_index[] = "AGA";
 //nextera sequencing adapters
-const char* nextera_adapter_sequence = "CTGTCTCTTATACACATCT";
+constexpr char nextera_adapter_sequence[] = "CTGTCTCTTATACACATCT";
 const unsigned int nextera_adapter_len = 19;	//strlen(nextera_adapter_sequence)
-const char* nextera_adapter_index = "CTG";
-static adapter_info nextera_adapter = {nextera_adapter_sequence, nextera_adapter_sequence,
-										nextera_adapter_len, nextera_adapter_index};
+constexpr char nextera_adapter_index[] = "CTG";
 
 //bgi sequencing adapters
-const char* bgi_adapter1_sequence = "AAGTCGGAGGCCAAGCGGTC";
-const char* bgi_adapter2_sequence = "AAGTCGGATCGTAGCCATGT";
+constexpr char bgi_adapter1_sequence[] = "AAGTCGGAGGCCAAGCGGTC";
+constexpr char bgi_adapter2_sequence[] = "AAGTCGGATCGTAGCCATGT";
 const unsigned int bgi_adapter_len = 19;	//strlen(bgi_adapter_sequence)
-const char* bgi_adapter_index = "AAG";
-static adapter_info bgi_adapter = {bgi_adapter1_sequence, bgi_adapter2_sequence,
-										bgi_adapter_len, bgi_adapter_index};
+constexpr char bgi_adapter_index[] = "AAG";
 
 const char FILE_SEPARATOR = ',';		// separator if multiple files are provided
 
@@ -81,6 +68,7 @@ const char CONVERSION_LOG_END    = '#';	// original version uses '&'
 const char CONVERSION_LOG_SEPARATOR = ';';	//':' is replaced because it's commonly used in illumina seqName
 const char KEEP_QUAL_MARKER      = '|';
 const char NORMAL_SEQNAME_START  = '@';
+const char FASTA_SEQNAME_START   = '>';
 
 const int MAX_CHANGES_CNT  =  256;
 const int MAX_SEQ_CYCLE    =  255;
@@ -89,9 +77,10 @@ const int MAX_ITERM_SIZE   =   32;	// MAX sam iterm (e.g., chr, mateinfo) size
 // there could be something like chr12_GA_converted, so set to 32
 
 //const unsigned int MIN_ALIGN_SCORE = 10;	// minimum alignemnt score to keep the record
-const int IMPOSSIBLE_AS_SCORE = - (1<<20);
-const int DISCARD_AMB_HIT     = - (1<<15);
-const int AMB_HIT_MARKER      = - (1<<10);
+// marks in the hit table of bowtie2.processer (16-bit), the AS-scores are stored above them
+const int IMPOSSIBLE_AS_SCORE = - (1<<15);
+const int DISCARD_AMB_HIT     = IMPOSSIBLE_AS_SCORE + 1;
+const int AMB_HIT_MARKER      = IMPOSSIBLE_AS_SCORE + 2;
 const int MIN_ALIGN_SCORE_AMB = 2;	// minimum alignemnt score to keep the ambigous record
 const int MIN_ALIGN_SCORE_UNQ = 2;	// minimum alignemnt score to keep the unique record
 
@@ -102,6 +91,20 @@ const int PERFECT_AMBIGOUS_SCORE = 50;	// extremely high score that will be kept
 const int MIN_AMBIGOUS_SCORE = 20;		// minimum alignemnt score to keep the ambigous record
 const int MAX_AMBIGOUS_HIT   = 5;		// maximum alignemnt score of the pair to keep the ambigous record
 
+// fragment key written by bowtie2.processer (one per fragment, in the order of the SAM records)
+// so that rmdup could make its decisions without parsing the SAM file
+const unsigned int FRAG_WATSON = 0;	// XG:Z:CT
+const unsigned int FRAG_CRICK  = 1;	// XG:Z:GA
+typedef struct {
+	unsigned long long offset;	// offset of the record(s) in the SAM file
+	unsigned int length;		// size of the record(s), including the '\n's
+	int chr;					// index of the chromosome in chr.info, -1 if not there
+	unsigned int pos;			// leftmost position of the fragment
+	unsigned int fragSize;		// fragment size for Paired-End data, read length on the reference for Single-End
+	unsigned int qual;			// sum of the quality scores of all reads
+	unsigned int strand;		// FRAG_WATSON or FRAG_CRICK
+} frag_key;
+
 const int READS_PER_BATCH  = 1 << 18;	// process 256K reads per batch (for parallelization)
 const int MAX_SAMLINE_SIZE = 1024;
 const int BUFFER_SIZE_PER_BATCH_READ = 1 << 28;	// 256 MB buffer for each thread to convert FASTQ
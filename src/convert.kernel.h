@@ -0,0 +1,108 @@
+#include <string.h>
+#include "common.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Author: Kun Sun (sunkun@szbl.ac.cn)
+ * This program is part of the Msuite package
+ * Date: Oct 2026
+ *
+ * Kernels used by the preprocessors for C->T (G->A) conversion.
+ * The converted positions are kept in a bitmask (bit i of word i/32 for position i) and the
+ * conversion logs are written from the bitmask with a hand-rolled HEX encoder, the format is
+ * the same as the one generated by sprintf("%x;").
+ * The source reads MUST be padded (see trim.kernel.h), and the destination MUST have 16 bytes
+ * of extra space as the bases are written 16 at a time.
+**/
+
+#ifndef _MSUITE_CONVERT_KERNEL_
+#define _MSUITE_CONVERT_KERNEL_
+
+const char HEX_DIGITS[] = "0123456789abcdef";
+
+// number of bitmask words needed for reads of length len
+unsigned int inline conversion_words( unsigned int len ) {
+	return (len >> 5) + 1;
+}
+
+// write v in lower-case HEX without leading zeros
+char inline * write_hex( char *o, unsigned int v ) {
+	char tmp[8];
+	register int k = 0;
+	do {
+		tmp[k++] = HEX_DIGITS[ v & 15 ];
+		v >>= 4;
+	} while( v );
+	while( k )
+		*o++ = tmp[--k];
+	return o;
+}
+
+// write the converted positions as HEX separated by CONVERSION_LOG_SEPARATOR
+char inline * write_conversion_log( char *o, const unsigned int *bits, unsigned int len ) {
+	register unsigned int n = conversion_words( len );
+	register unsigned int w;
+	register bool first = true;
+	for( register unsigned int k=0; k!=n; ++k ) {
+		w = bits[k];
+		while( w ) {
+			if( ! first )
+				*o++ = CONVERSION_LOG_SEPARATOR;
+			first = false;
+			o = write_hex( o, (k<<5) + __builtin_ctz(w) );
+			w &= w - 1;
+		}
+	}
+	return o;
+}
+
+// conversion rules of the run modes: C>T in read 1 and G>A in read 2, in CpG context in mode 4
+template <unsigned int MODE>
+struct conversion_rule {
+	static constexpr char next1 = ( MODE==4 ) ? 'G' : 0;	// the base that MUST follow the 'C' in read 1
+	static constexpr char prev2 = ( MODE==4 ) ? 'C' : 0;	// the base that MUST precede the 'G' in read 2
+};
+
+/*
+ * copy s[0, len) into dst and convert FROM to TO, the converted positions are set in bits
+ * PREV/NEXT: the base that MUST precede/follow FROM (i.e., CpG context in mode 4), 0 for no
+ * requirement; the base before the read is considered as nothing
+*/
+template <char FROM, char TO, char PREV, char NEXT>
+void inline convert_read( char *dst, const char *s, unsigned int len, unsigned int *bits ) {
+	memset( bits, 0, conversion_words(len)*sizeof(unsigned int) );
+	register unsigned int mask;
+#ifdef __SSE2__
+	__m128i v, m, pv;
+	for( register unsigned int base=0; base<len; base+=16 ) {
+		v = _mm_loadu_si128( (const __m128i *)(s+base) );
+		m = _mm_cmpeq_epi8( v, _mm_set1_epi8(FROM) );
+		if( NEXT )
+			m = _mm_and_si128( m, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s+base+1)), _mm_set1_epi8(NEXT)) );
+		if( PREV ) {
+			pv = base ? _mm_loadu_si128( (const __m128i *)(s+base-1) ) : _mm_slli_si128( v, 1 );
+			m = _mm_and_si128( m, _mm_cmpeq_epi8(pv, _mm_set1_epi8(PREV)) );
+		}
+		_mm_storeu_si128( (__m128i *)(dst+base),
+							_mm_or_si128(_mm_andnot_si128(m, v), _mm_and_si128(m, _mm_set1_epi8(TO))) );
+		mask = _mm_movemask_epi8( m );
+		if( len-base < 16 )
+			mask &= (1U << (len-base)) - 1;
+		bits[ base>>5 ] |= mask << (base & 31);
+	}
+#else
+	for( register unsigned int i=0; i!=len; ++i ) {
+		if( s[i]==FROM && (NEXT==0 || s[i+1]==NEXT) && (PREV==0 || (i && s[i-1]==PREV)) ) {
+			dst[i] = TO;
+			bits[ i>>5 ] |= 1U << (i & 31);
+		} else {
+			dst[i] = s[i];
+		}
+	}
+#endif
+}
+
+#endif
+
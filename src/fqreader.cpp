@@ -0,0 +1,473 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <omp.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "fqreader.h"
+
+using namespace std;
+
+/*
+ * Author: Kun Sun (sunkun@szbl.ac.cn)
+ * This program is part of the Msuite package
+ * Date: Oct 2026
+*/
+
+void init_fq_input( fq_input & in, const char *files, unsigned int thread ) {
+	string fileName="";
+	for(unsigned int i=0; files[i]!='\0'; ++i) {
+		if( files[i] == FILE_SEPARATOR ) {
+			in.files.push_back( fileName );
+			fileName.clear();
+		} else {
+			fileName += files[i];
+		}
+	}
+	in.files.push_back( fileName );
+
+	in.fileCnt = 0;
+	in.thread  = (thread==0) ? 1 : thread;
+	in.is_open = false;
+	in.error   = false;
+	in.fp	   = NULL;
+	in.zbuf	   = new unsigned char [ FQ_BGZF_CHUNK_SIZE ];
+	in.zsize   = 0;
+	in.zpos	   = 0;
+
+	in.curr.data = NULL;
+	in.curr.size = 0;
+	in.curr.capacity = 0;
+	in.next.data = NULL;
+	in.next.size = 0;
+	in.next.capacity = 0;
+	in.next_ready = false;
+	in.cur = NULL;
+	in.map = NULL;
+	in.mapSize = 0;
+	in.mapPos  = 0;
+}
+
+void free_fq_input( fq_input & in ) {
+	close_file( in );
+	delete [] in.zbuf;
+	if( in.curr.data != NULL )
+		delete [] in.curr.data;
+	if( in.next.data != NULL )
+		delete [] in.next.data;
+	for( unsigned int i=0; i!=in.maps.size(); ++i )
+		munmap( in.maps[i].first, in.maps[i].second );
+	in.maps.clear();
+}
+
+void init_arena( fq_arena & arena ) {
+	arena.index = 0;
+	arena.used  = 0;
+}
+
+void free_arena( fq_arena & arena ) {
+	for( unsigned int i=0; i!=arena.blocks.size(); ++i )
+		delete [] arena.blocks[i];
+	arena.blocks.clear();
+}
+
+static void reserve_chunk( fq_chunk & c, size_t size ) {
+	if( c.capacity >= size )
+		return;
+	if( c.data != NULL )
+		delete [] c.data;
+	c.data = new char [ size ];
+	c.capacity = size;
+}
+
+// open the next file of this read end; returns false if there is no more file or open failed
+bool open_next_file( fq_input & in ) {
+	if( in.fileCnt == in.files.size() )
+		return false;
+
+	const char * p_file = in.files[in.fileCnt].c_str();
+	in.fp = fopen( p_file, "rb" );
+	if( in.fp == NULL ) {
+		cerr << "Error: open fastq file " << p_file << " failed!\n";
+		in.error = true;
+		return false;
+	}
+
+	// check the magic bytes to determine the file type
+	in.zsize = fread( in.zbuf, 1, BGZF_HEADER_SIZE, in.fp );
+	in.zpos  = 0;
+	const unsigned char *z = in.zbuf;
+	if( in.zsize>=2 && z[0]==0x1f && z[1]==0x8b ) {
+		// BGZF: FEXTRA is set and the extra field is a 'BC' subfield holding the block size
+		if( in.zsize==BGZF_HEADER_SIZE && (z[3]&4) && z[10]==6 && z[11]==0 &&
+				z[12]=='B' && z[13]=='C' && z[14]==2 && z[15]==0 ) {
+			in.type = FQ_BGZF;
+		} else {
+			in.type = FQ_GZIP;
+			memset( &in.strm, 0, sizeof(z_stream) );
+			if( inflateInit2( &in.strm, 15+16 ) != Z_OK ) {
+				cerr << "Error: initialize zlib failed!\n";
+				fclose( in.fp );
+				in.error = true;
+				return false;
+			}
+			in.strm.next_in  = in.zbuf;
+			in.strm.avail_in = in.zsize;
+			in.member_end = false;
+		}
+	} else {
+		in.type = FQ_PLAIN;
+		// map the whole file if it is a regular one
+		struct stat st;
+		if( fstat(fileno(in.fp), &st)==0 && S_ISREG(st.st_mode) && st.st_size!=0 ) {
+			void *m = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in.fp), 0 );
+			if( m != MAP_FAILED ) {
+				madvise( m, st.st_size, MADV_SEQUENTIAL );
+				in.type = FQ_MMAP;
+				in.map  = (const char *) m;
+				in.mapSize = st.st_size;
+				in.mapPos  = 0;
+				in.maps.push_back( pair<char *, size_t>( (char *)m, st.st_size ) );
+				fclose( in.fp );
+				in.fp = NULL;
+			}
+		}
+	}
+
+	in.file_eof = false;
+	in.curr.size = 0;
+	in.cur = in.curr.data;
+	in.next_ready = false;
+	in.carry.clear();
+
+	++ in.fileCnt;
+	in.is_open = true;
+	return true;
+}
+
+void close_file( fq_input & in ) {
+	if( ! in.is_open )
+		return;
+
+	if( in.type == FQ_GZIP )
+		inflateEnd( &in.strm );
+	if( in.fp != NULL )
+		fclose( in.fp );
+	in.is_open = false;
+}
+
+static void fill_plain( fq_input & in, fq_chunk & c ) {
+	reserve_chunk( c, FQ_CHUNK_SIZE );
+	c.size = in.zsize - in.zpos;	// the bytes used to check magic
+	if( c.size != 0 ) {
+		memcpy( c.data, in.zbuf+in.zpos, c.size );
+		in.zpos = in.zsize;
+	}
+	c.size += fread( c.data+c.size, 1, FQ_CHUNK_SIZE-c.size, in.fp );
+	if( c.size != FQ_CHUNK_SIZE )
+		in.file_eof = true;
+}
+
+static void fill_gzip( fq_input & in, fq_chunk & c ) {
+	reserve_chunk( c, FQ_CHUNK_SIZE );
+	z_stream & strm = in.strm;
+	strm.next_out  = (unsigned char *) c.data;
+	strm.avail_out = FQ_CHUNK_SIZE;
+	while( strm.avail_out != 0 ) {
+		if( strm.avail_in == 0 ) {
+			in.zsize = fread( in.zbuf, 1, FQ_BGZF_CHUNK_SIZE, in.fp );
+			if( in.zsize == 0 ) {
+				in.file_eof = true;
+				if( ! in.member_end ) {
+					cerr << "\nError: " << in.files[in.fileCnt-1] << " is a truncated gzip file!\n";
+					in.error = true;
+				}
+				break;
+			}
+			strm.next_in  = in.zbuf;
+			strm.avail_in = in.zsize;
+		}
+		// data after the last member that is not another member (e.g., zero padding) is ignored like gzip
+		if( in.member_end && ( strm.next_in[0]!=0x1f || (strm.avail_in>1 && strm.next_in[1]!=0x8b) ) ) {
+			cerr << "\nWarning: " << in.files[in.fileCnt-1] << " has trailing garbage after the gzip data, ignored!\n";
+			in.file_eof = true;
+			break;
+		}
+		int ret = inflate( &strm, Z_NO_FLUSH );
+		if( ret == Z_STREAM_END ) {	// end of a member, there may be more members
+			inflateReset( &strm );
+			in.member_end = true;
+		} else if( ret == Z_OK ) {
+			in.member_end = false;
+		} else if( ret != Z_OK && ret != Z_BUF_ERROR ) {
+			cerr << "\nError: " << in.files[in.fileCnt-1] << " is not a valid gzip file!\n";
+			in.error = true;
+			break;
+		}
+	}
+	c.size = FQ_CHUNK_SIZE - strm.avail_out;
+}
+
+static void fill_bgzf( fq_input & in, fq_chunk & c ) {
+	// move the incomplete block to the front then load more data
+	in.zsize -= in.zpos;
+	if( in.zsize != 0 )
+		memmove( in.zbuf, in.zbuf+in.zpos, in.zsize );
+	in.zpos = 0;
+	size_t want = FQ_BGZF_CHUNK_SIZE - in.zsize;
+	size_t got  = fread( in.zbuf+in.zsize, 1, want, in.fp );
+	in.zsize += got;
+
+	// locate the complete blocks
+	vector<size_t> boff, ooff;
+	size_t total = 0;
+	register const unsigned char *z = in.zbuf;
+	while( in.zpos + BGZF_HEADER_SIZE <= in.zsize ) {
+		const unsigned char *h = z + in.zpos;
+		if( h[0]!=0x1f || h[1]!=0x8b || h[12]!='B' || h[13]!='C' ) {
+			cerr << "\nError: " << in.files[in.fileCnt-1] << " is not a valid BGZF file!\n";
+			in.error = true;
+			c.size = 0;
+			return;
+		}
+		size_t bsize = (h[16] | (h[17]<<8)) + 1;
+		if( in.zpos + bsize > in.zsize )
+			break;
+		const unsigned char *t = h + bsize - 4;
+		size_t isize = t[0] | (t[1]<<8) | (t[2]<<16) | ((size_t)t[3]<<24);
+		boff.push_back( in.zpos );
+		ooff.push_back( total );
+		total += isize;
+		in.zpos += bsize;
+	}
+	if( got != want )
+		in.file_eof = true;
+	if( in.file_eof && in.zpos != in.zsize ) {
+		cerr << "\nError: " << in.files[in.fileCnt-1] << " is truncated!\n";
+		in.error = true;
+	}
+
+	reserve_chunk( c, total );
+	c.size = total;
+	ooff.push_back( total );
+
+	// inflate the blocks in parallel
+	bool fail = false;
+	int n = boff.size();
+	#pragma omp parallel for num_threads( in.thread ) schedule( dynamic, 4 )
+	for( int i=0; i<n; ++i ) {
+		const unsigned char *h = z + boff[i];
+		size_t bsize = (h[16] | (h[17]<<8)) + 1;
+		z_stream s;
+		memset( &s, 0, sizeof(z_stream) );
+		inflateInit2( &s, -15 );	// raw deflate
+		s.next_in   = (unsigned char *) h + BGZF_HEADER_SIZE;
+		s.avail_in  = bsize - BGZF_HEADER_SIZE - 8;
+		s.next_out  = (unsigned char *) c.data + ooff[i];
+		s.avail_out = ooff[i+1] - ooff[i];
+		if( inflate( &s, Z_FINISH ) != Z_STREAM_END || s.avail_out != 0 )
+			fail = true;
+		inflateEnd( &s );
+	}
+	if( fail ) {
+		cerr << "\nError: " << in.files[in.fileCnt-1] << " contains corrupted BGZF block!\n";
+		in.error = true;
+	}
+}
+
+// decompress the next chunk of the current file; size is 0 if the file reaches its end
+static void fill_chunk( fq_input & in, fq_chunk & c ) {
+	c.size = 0;
+	if( in.error )
+		return;
+	// an empty chunk may be produced by BGZF EOF blocks, keep loading
+	while( c.size==0 && ! in.file_eof && ! in.error ) {
+		switch( in.type ) {
+			case FQ_PLAIN: fill_plain( in, c ); break;
+			case FQ_GZIP : fill_gzip ( in, c ); break;
+			case FQ_BGZF : fill_bgzf ( in, c ); break;
+		}
+	}
+}
+
+// locate the 4 lines of a record starting at p; returns the position after the record,
+// or NULL if the record is incomplete. the last line may not contain '\n' at the end of file
+static const char * parse_record( const char *p, const char *e, bool at_eof, fq_record & r ) {
+	const char *line[4];
+	unsigned int len[4];
+	register const char *n;
+	for( register unsigned int k=0; k!=4; ++k ) {
+		n = (const char *) memchr( p, '\n', e-p );
+		if( n == NULL ) {
+			if( k==3 && at_eof ) {
+				line[3] = p;
+				len[3]  = e - p;
+				p = e;
+				break;
+			}
+			return NULL;
+		}
+		line[k] = p;
+		len[k]  = n - p;
+		p = n + 1;
+	}
+	r.id   = line[0];
+	r.seq  = line[1];
+	r.qual = line[3];
+	r.idLen   = len[0];
+	r.seqLen  = len[1];
+	r.qualLen = len[3];
+	return p;
+}
+
+// copy the record into the arena and point the views to the copy
+static void store_record( fq_arena & arena, const char *src, size_t size, fq_record & r ) {
+	if( arena.index == arena.blocks.size() )
+		arena.blocks.push_back( new char [ FQ_ARENA_BLOCK ] );
+	if( arena.used + size > FQ_ARENA_BLOCK ) {
+		++ arena.index;
+		arena.used = 0;
+		if( arena.index == arena.blocks.size() )
+			arena.blocks.push_back( new char [ FQ_ARENA_BLOCK ] );
+	}
+	char *dst = arena.blocks[arena.index] + arena.used;
+	memcpy( dst, src, size );
+	arena.used += size;
+
+	r.id   = dst + (r.id   - src);
+	r.seq  = dst + (r.seq  - src);
+	r.qual = dst + (r.qual - src);
+}
+
+// the record spanning 2 chunks is finished (or the file ends)
+static bool store_carry( fq_input & in, fq_record & r, fq_arena & arena, bool at_eof ) {
+	const char *p = in.carry.data();
+	const char *e = p + in.carry.size();
+	bool ok = ( parse_record( p, e, at_eof, r ) != NULL );
+	if( ok )
+		store_record( arena, p, e-p, r );
+	in.carry.clear();
+	return ok;
+}
+
+// split the current chunk into records until the chunk is exhausted or max reads are loaded
+static void split_chunk( fq_input & in, fq_record *reads, unsigned int & loaded, unsigned int max, fq_arena & arena ) {
+	register const char *end = in.curr.data + in.curr.size;
+	register const char *next;
+	while( loaded!=max && in.cur!=end ) {
+		if( ! in.carry.empty() ) {	// finish the record started in the previous chunk
+			unsigned int lines = 0;
+			for( next=in.carry.data(); (next=(const char *)memchr(next, '\n', in.carry.data()+in.carry.size()-next))!=NULL; ++next )
+				++ lines;
+			for( next=in.cur; lines!=4; ++lines ) {
+				next = (const char *) memchr( next, '\n', end-next );
+				if( next == NULL )
+					break;
+				++ next;
+			}
+			if( next == NULL ) {	// still incomplete
+				in.carry.append( in.cur, end-in.cur );
+				in.cur = end;
+				return;
+			}
+			in.carry.append( in.cur, next-in.cur );
+			in.cur = next;
+			store_carry( in, reads[loaded], arena, false );
+			++ loaded;
+			continue;
+		}
+
+		next = parse_record( in.cur, end, false, reads[loaded] );
+		if( next == NULL ) {	// the record continues in the next chunk
+			in.carry.assign( in.cur, end-in.cur );
+			in.cur = end;
+			return;
+		}
+		store_record( arena, in.cur, next-in.cur, reads[loaded] );
+		in.cur = next;
+		++ loaded;
+	}
+}
+
+static void warn_incomplete( fq_input & in ) {
+	cerr << "\nWarning: the last read in " << in.files[in.fileCnt-1] << " is incomplete and discarded!\n";
+}
+
+// load at most max reads; the next file is opened if the current one reaches its end
+// so a batch could contain reads from multiple files
+unsigned int load_reads( fq_input & in, fq_record *reads, unsigned int max, fq_arena & arena ) {
+	unsigned int loaded = 0;
+	arena.index = 0;
+	arena.used  = 0;
+	while( loaded!=max && in.is_open ) {
+		if( in.type == FQ_MMAP ) {	// zero-copy
+			register const char *p = in.map;
+			register const char *e = in.map + in.mapSize;
+			register const char *next = p + in.mapPos;
+			while( loaded!=max && next!=e ) {
+				next = parse_record( next, e, true, reads[loaded] );
+				if( next == NULL ) {
+					warn_incomplete( in );
+					next = e;
+					break;
+				}
+				++ loaded;
+			}
+			in.mapPos = next - p;
+			if( next == e ) {
+				close_file( in );
+				open_next_file( in );
+			}
+			continue;
+		}
+
+		if( in.cur == in.curr.data+in.curr.size ) {	// current chunk is exhausted
+			if( ! in.next_ready )
+				fill_chunk( in, in.next );
+			fq_chunk tmp = in.curr;
+			in.curr = in.next;
+			in.next = tmp;
+			in.next_ready = false;
+			in.cur = in.curr.data;
+
+			if( in.error ) {
+				close_file( in );
+				break;
+			}
+			if( in.curr.size == 0 ) {	// reach the end of file
+				if( ! in.carry.empty() ) {	// the last read may not contain '\n' for quality line
+					if( store_carry( in, reads[loaded], arena, true ) )
+						++ loaded;
+					else
+						warn_incomplete( in );
+				}
+				close_file( in );
+				open_next_file( in );
+				continue;
+			}
+		}
+
+		// decompress the next chunk while splitting the current one
+		#pragma omp parallel sections num_threads( 2 )
+		{
+			#pragma omp section
+			{
+				if( ! in.next_ready ) {
+					fill_chunk( in, in.next );
+					in.next_ready = true;
+				}
+			}
+			#pragma omp section
+			{
+				split_chunk( in, reads, loaded, max, arena );
+			}
+		}
+	}
+	return loaded;
+}
+
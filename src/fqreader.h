@@ -0,0 +1,97 @@
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <zlib.h>
+
+using namespace std;
+
+/*
+ * Author: Kun Sun (sunkun@szbl.ac.cn)
+ * This program is part of the Msuite package
+ * Date: Oct 2026
+ *
+ * Fastq loader for the preprocessors.
+ * Each read is kept as views (pointer+length) of its ID, sequence and quality lines, no string is
+ * allocated per line. 4 types of input are supported (detected by the magic bytes, not the file name):
+ *   plain file : memory-mapped, the views point into the mapping directly
+ *   BGZF		: the blocks in one chunk are inflated in parallel
+ *   gzip		: inflated by one thread (multi-member supported), while the previous
+ *				  chunk is being split into records by another thread (like pigz)
+ *   pipe		: (e.g., /dev/stdin) loaded in chunks by fread
+ * For the last 3 types, the records are copied into an arena owned by the batch, as the
+ * decompressed chunks are re-used.
+**/
+
+#ifndef _MSUITE_FQREADER_
+#define _MSUITE_FQREADER_
+
+const unsigned int FQ_CHUNK_SIZE	  = 1 << 24;	// decompressed bytes per chunk for pipe and gzip
+const unsigned int FQ_BGZF_CHUNK_SIZE = 1 << 22;	// compressed bytes per chunk for BGZF
+const unsigned int FQ_ARENA_BLOCK	  = 1 << 24;	// bytes per arena block
+const unsigned int BGZF_HEADER_SIZE	  = 18;
+
+enum fq_file_type { FQ_MMAP, FQ_PLAIN, FQ_GZIP, FQ_BGZF };
+
+// a fastq record; the lengths are modified during trimming
+typedef struct {
+	const char *id, *seq, *qual;
+	unsigned int idLen, seqLen, qualLen;
+} fq_record;
+
+// storage of the records copied from the decompressed chunks; the blocks are never moved
+// so the views are valid until the arena is reset for the next batch
+typedef struct {
+	vector<char *> blocks;
+	unsigned int index;		// block in use
+	size_t used;			// bytes used in that block
+} fq_arena;
+
+// a decompressed chunk
+typedef struct {
+	char *data;
+	size_t size;		// bytes in use
+	size_t capacity;	// bytes allocated
+} fq_chunk;
+
+// the input files of one read end; multiple files are loaded one after another
+typedef struct {
+	vector<string> files;
+	unsigned int fileCnt;	// index of the file being loaded
+	unsigned int thread;	// number of threads used for BGZF decompression
+	bool is_open;
+	bool error;
+
+	FILE *fp;
+	fq_file_type type;
+	bool file_eof;			// all data of the current file has been decompressed
+
+	// memory-mapped file; the mappings are kept until free_fq_input as the loaded
+	// batches may still be in use when the next file is opened
+	const char *map;
+	size_t mapSize, mapPos;
+	vector< pair<char *, size_t> > maps;
+
+	// compressed input
+	unsigned char *zbuf;
+	size_t zsize;			// bytes in zbuf
+	size_t zpos;			// bytes consumed in zbuf
+	z_stream strm;
+	bool member_end;		// the last gzip member has been inflated completely
+
+	// chunk being split and the prefetched one
+	fq_chunk curr, next;
+	bool next_ready;
+	const char *cur;		// split position in curr
+	string carry;			// the record spanning chunks
+} fq_input;
+
+void init_fq_input( fq_input & in, const char *files, unsigned int thread );
+void free_fq_input( fq_input & in );
+bool open_next_file( fq_input & in );
+void close_file( fq_input & in );
+void init_arena( fq_arena & arena );
+void free_arena( fq_arena & arena );
+unsigned int load_reads( fq_input & in, fq_record *reads, unsigned int max, fq_arena & arena );
+
+#endif
+
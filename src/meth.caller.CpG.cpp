@@ -26,10 +26,10 @@ unsigned int cycle;				// sequencing cycle
 void deal_SE_CpG( const char *gfile, const char *samfile, const char *output );
 void deal_PE_CpG( const char *gfile, const char *samfile, const char *output );
 
-void callmeth_CpG( string &realSEQ, string &realQUAL, string &chr, int pos, bool strand,
-				unordered_map<string, string> :: iterator &git, map<string, map<int, meth>*> &methcall, mbias *mb );
-void write_methcall_CpG( map<string, map<int, meth>*> & mc, map<string, int> & chrcount,
-				unordered_map<string, string> & g, const char *outfile );
+void callmeth_CpG( string &realSEQ, string &realQUAL, const string &gseq, int pos, bool strand,
+				map<int, meth> *mp, mbias *mb );
+void write_methcall_CpG( chr_dict & chrs, vector<map<int, meth>*> & mc, vector<int> & chrcount,
+				vector<const string *> & gseq, const char *outfile );
 
 int main( int argc, char *argv[] ) {
 	if( argc != 8 ) {
@@ -72,14 +72,15 @@ void deal_SE_CpG( const char *gfile, const char *samfile, const char *output) {
 	// load genome
 	unordered_map<string, string> g;
 	loadgenome( gfile, g );
-	unordered_map<string, string> :: iterator git;
-	unordered_map<string, string> :: iterator no_such_chr = g.end();
-
-	map<string, map<int, meth>*> methcall;
-	map<string, int> chrcount;
-	for( git=g.begin(); git!=g.end(); ++git ) {
-		methcall.insert( pair<string, map<int, meth>*>(git->first, new map<int, meth>()) );
-		chrcount.insert( pair<string, int>(git->first, 0) );
+	chr_dict chrs;
+	vector<const string *> gseq;	// genome sequence of each chromosome ID
+	index_genome( g, chrs, gseq );
+	int chrID;
+
+	vector<map<int, meth>*> methcall;
+	vector<int> chrcount( chrs.name.size(), 0 );
+	for( unsigned int i=0; i!=chrs.name.size(); ++i ) {
+		methcall.push_back( new map<int, meth>() );
 	}
 
 	mbias *mb = new mbias[ MAX_SAM_LEN ];
@@ -96,11 +97,9 @@ void deal_SE_CpG( const char *gfile, const char *samfile, const char *output) {
 	}
 	cout << "Loading alignment " << samfile << " in SE mode ...\n";
 	unsigned int count = 0;
-	string line, seqName, chr, cigar, seq, qual;
-	int flag;
-	string mateinfo, matepos, dist;   //fields that are ignored; all the sequence are converted to WATSON chain
+	string line, cigar, seq, qual;
 	register unsigned int pos, score;
-	stringstream ss;
+	sam_view v;	// the other fields are ignored; all the sequence are converted to WATSON chain
 	string realSEQ, realQUAL;   //these are CIGAR-processed seq and qual
 	line.resize( MAX_SAM_LEN );
 	bool strand;
@@ -110,14 +109,16 @@ void deal_SE_CpG( const char *gfile, const char *samfile, const char *output) {
 		if( fin.eof() ) break;
 		//14_R1	83	chr9	73301642	42	36M	=	73301399	-279	TCCTTCTCTCCCTC	GHHHHHHHHHH	XG:Z:GA
 
-		ss.clear();
-		ss.str( line );
-		ss >> seqName >> flag >> chr >> pos >> score >> cigar >> mateinfo >> matepos >> dist >> seq >> qual;
-		
+		sam_view_split( v, line, SAM_TAGS );
+		score = sam_view_int( v, SAM_MAPQ );
 		if( score < MIN_ALIGN_SCORE ) {
-			//cerr << "Discard " << seqName << " due to poor alignment score.\n";
+			//cerr << "Discard " << line.substr(0, line.find('\t')) << " due to poor alignment score.\n";
 			continue;
 		}
+		pos = sam_view_int( v, SAM_POS );
+		sam_view_copy( v, SAM_CIGAR, cigar );
+		sam_view_copy( v, SAM_SEQ,   seq );
+		sam_view_copy( v, SAM_QUAL,  qual );
 		// determine whether the alignemnt is on watson chain or crick chain using the XG:Z: tag
 		// which is ALWAYS at the end of read1 for TAPSaligner and Bismark
 		if( line.back() == 'T' ) {	// XG:Z:CT => watson
@@ -126,8 +127,8 @@ void deal_SE_CpG( const char *gfile, const char *samfile, const char *output) {
 			strand = false;
 		}
 
-		git = g.find(chr);
-		if( git == no_such_chr ) continue;   // there is NO such chromosome in the genome!!!
+		chrID = find_chr( chrs, v );
+		if( chrID < 0 ) continue;   // there is NO such chromosome in the genome!!!
 
 		// process the CIGAR, handle the indels
 		if( ! fix_cigar(cigar, realSEQ, realQUAL, seq, qual ) ) {
@@ -136,9 +137,9 @@ void deal_SE_CpG( const char *gfile, const char *samfile, const char *output) {
 		}
 
 		// call CpG methylation
-		callmeth_CpG( realSEQ, realQUAL, chr, pos, strand, git, methcall, mb );
+		callmeth_CpG( realSEQ, realQUAL, *gseq[chrID], pos, strand, methcall[chrID], mb );
 		// chr count
-		chrcount.find( chr )->second ++;
+		chrcount[ chrID ] ++;
 
 		// report progress for every 4 million reads
 		++ count;
@@ -149,7 +150,7 @@ void deal_SE_CpG( const char *gfile, const char *samfile, const char *output) {
 	cout << '\r' << "Done: " << count << " lines loaded.\n";
 
 	cout << "Writing methylation call ...\n";
-	write_methcall_CpG( methcall, chrcount, g, output );
+	write_methcall_CpG( chrs, methcall, chrcount, gseq, output );
 
 	// write M-bias data
 	string outfile = output;
@@ -173,15 +174,16 @@ void deal_PE_CpG( const char *gfile, const char *samfile, const char *output) {
 	// load genome
 	unordered_map<string, string> g;
 	loadgenome( gfile, g );
-	unordered_map<string, string> :: iterator git;
-	unordered_map<string, string> :: iterator no_such_chr = g.end();
+	chr_dict chrs;
+	vector<const string *> gseq;	// genome sequence of each chromosome ID
+	index_genome( g, chrs, gseq );
+	int chrID;
 
-	map<string, map<int, meth>*> methcall;
-	map<string, int> chrcount;
+	vector<map<int, meth>*> methcall;
+	vector<int> chrcount( chrs.name.size(), 0 );
 
-	for( git=g.begin(); git!=g.end(); ++git ) {
-		methcall.insert( pair<string, map<int, meth>*>(git->first, new map<int, meth>()) );
-		chrcount.insert( pair<string, int>(git->first, 0) );
+	for( unsigned int i=0; i!=chrs.name.size(); ++i ) {
+		methcall.push_back( new map<int, meth>() );
 	}
 	map<int, meth>* mp;
 	map<int, meth> :: iterator mit;
@@ -208,11 +210,9 @@ void deal_PE_CpG( const char *gfile, const char *samfile, const char *output) {
 	cout << "Loading alignment " << samfile << " in PE mode ...\n";
 
 	unsigned int count = 0;
-	string line1, line2, seqName, chr, cigar1, seq1, qual1, cigar2, seq2, qual2;
-	register int flag;
-	string mateinfo, matepos, dist;   //fields that are ignored; all the sequence are converted to WATSON chain
+	string line1, line2, seqName, cigar1, seq1, qual1, cigar2, seq2, qual2;
 	register unsigned int pos1, pos2, score;
-	stringstream ss;
+	sam_view v;	// the other fields are ignored; all the sequence are converted to WATSON chain
 	string realSEQ1, realQUAL1, realSEQ2, realQUAL2;   //these are CIGAR-processed seq and qual
 	string mSEQ, mQUAL; //merged sequence and quality if read1 and read2 has overlap
 	line1.resize( MAX_SAM_LEN );
@@ -232,15 +232,17 @@ void deal_PE_CpG( const char *gfile, const char *samfile, const char *output) {
 		//14_R1	83	chr9	73301642	42	36M	=	73301399	-279	TCCTCCTTCTCTCCCTC	HHHHHHHHH	XG:Z:CT
 		//14_R2	163	chr9	73301399	42	36M	=	73301642	279	TTTATTTTGATCCTGTA	DDCBA@?>=<;986420.
 
-		ss.clear();
-		ss.str( line1 );
-		ss >> seqName >> flag >> chr >> pos1 >> score >> cigar1 >> mateinfo >> matepos >> dist >> seq1 >> qual1;
-		//cerr << seqName << '\n';
-
+		sam_view_split( v, line1, SAM_TAGS );
+		score = sam_view_int( v, SAM_MAPQ );
 		if( score < MIN_ALIGN_SCORE ) {
-			//cerr << "Discard " << seqName << " due to poor alignment score.\n";
+			//cerr << "Discard " << line1.substr(0, line1.find('\t')) << " due to poor alignment score.\n";
 			continue;
 		}
+		sam_view_copy( v, SAM_QNAME, seqName );
+		pos1 = sam_view_int( v, SAM_POS );
+		sam_view_copy( v, SAM_CIGAR, cigar1 );
+		sam_view_copy( v, SAM_SEQ,   seq1 );
+		sam_view_copy( v, SAM_QUAL,  qual1 );
 
 		// determine whether the alignemnt is on watson chain or crick chain using the XG:Z: tag
 		// which is ALWAYS at the end of read1 for TAPSaligner and Bismark
@@ -250,12 +252,14 @@ void deal_PE_CpG( const char *gfile, const char *samfile, const char *output) {
 			strand = false;
 		}
 
-		git = g.find( chr );
-		if( git == no_such_chr ) continue;   // there is NO such chromosome in the genome!!!
+		chrID = find_chr( chrs, v );
+		if( chrID < 0 ) continue;   // there is NO such chromosome in the genome!!!
 
-		ss.clear();
-		ss.str( line2 );
-		ss >> seqName >> flag >> chr >> pos2 >> score >> cigar2 >> mateinfo >> matepos >> dist >> seq2 >> qual2;
+		sam_view_split( v, line2, SAM_TAGS );
+		pos2 = sam_view_int( v, SAM_POS );
+		sam_view_copy( v, SAM_CIGAR, cigar2 );
+		sam_view_copy( v, SAM_SEQ,   seq2 );
+		sam_view_copy( v, SAM_QUAL,  qual2 );
 
 		// process CIGAR 1, handle the indels
 		realSEQ1.clear();
@@ -281,8 +285,8 @@ void deal_PE_CpG( const char *gfile, const char *samfile, const char *output) {
 		}
 
 		if( p1 + r1->size() <= p2 ) { //there is NO overlap
-			callmeth_CpG( realSEQ1, realQUAL1, chr, pos1, strand, git, methcall, mb1 );
-			callmeth_CpG( realSEQ2, realQUAL2, chr, pos2, strand, git, methcall, mb2 );
+			callmeth_CpG( realSEQ1, realQUAL1, *gseq[chrID], pos1, strand, methcall[chrID], mb1 );
+			callmeth_CpG( realSEQ2, realQUAL2, *gseq[chrID], pos2, strand, methcall[chrID], mb2 );
 		} else {	// there is overlap in read 1 and read 2
 			//cerr << "Found overlap in " << seqName << '\n';
 			if( p2+r2->size() >= p1+r1->size() ) {	// most case
@@ -315,13 +319,13 @@ void deal_PE_CpG( const char *gfile, const char *samfile, const char *output) {
 					mQUAL += q2->at(k-offset);
 				}
 				//cerr << "mSEQ\t" << mSEQ << "\n";
-				callmeth_CpG( mSEQ, mQUAL, chr, p1, strand, git, methcall, mb3 );
+				callmeth_CpG( mSEQ, mQUAL, *gseq[chrID], p1, strand, methcall[chrID], mb3 );
 			} else {	// rare case that R1 completely contains R2 => use R1 directly
-				callmeth_CpG( realSEQ1, realQUAL1, chr, pos1, strand, git, methcall, mb3 );
+				callmeth_CpG( realSEQ1, realQUAL1, *gseq[chrID], pos1, strand, methcall[chrID], mb3 );
 			}
 		}
 
-		chrcount.find( chr )->second ++;
+		chrcount[ chrID ] ++;
 		++ count;
 //		if( ! (count & 0x003fffff) )
 //			cout << '\r' << count << " lines loaded.";
@@ -329,7 +333,7 @@ void deal_PE_CpG( const char *gfile, const char *samfile, const char *output) {
 	fin.close();
 	cout << '\r' << "Done: " << count << " lines loaded.\n";
 
-	write_methcall_CpG( methcall, chrcount, g, output );
+	write_methcall_CpG( chrs, methcall, chrcount, gseq, output );
 
 	// write M-bias data
 	string outfile = output;
@@ -365,9 +369,8 @@ void deal_PE_CpG( const char *gfile, const char *samfile, const char *output) {
 }
 
 // call meth from sequence
-void callmeth_CpG( string &realSEQ, string &realQUAL, string &chr, int pos, bool strand,
-				unordered_map<string, string> :: iterator &git, map<string, map<int, meth>*> &methcall, mbias *mb ) {
-	map<int, meth>* mp;
+void callmeth_CpG( string &realSEQ, string &realQUAL, const string &gseq, int pos, bool strand,
+				map<int, meth> *mp, mbias *mb ) {
 	map<int, meth> :: iterator mit;
 	meth m;
 	unsigned int rs = realSEQ.size();
@@ -378,16 +381,15 @@ void callmeth_CpG( string &realSEQ, string &realQUAL, string &chr, int pos, bool
 //		if( realQUAL[i] < MIN_QUAL_SCORE )
 //			continue;
 		if( strand ) {	// watson strand
-			if( j == git->second.size() - 1 )
+			if( j == gseq.size() - 1 )
 				continue;
 
-			c1 = git->second[j];
-			c2 = git->second[j+1];
+			c1 = gseq[j];
+			c2 = gseq[j+1];
 
 			if( (c1!='C' && c1!='c') || (c2!='G' && c2!='g') )	// not a CpG site
 				continue;
 
-			mp  = methcall.find( chr )->second;
 			mit = mp->find( j );
 			if( mit == mp->end() ) {	// no record, insert one
 				if( realSEQ[i] == 'C' ) {
@@ -417,13 +419,12 @@ void callmeth_CpG( string &realSEQ, string &realQUAL, string &chr, int pos, bool
 			if( j == 0 )
 				continue;
 
-			c1 = git->second[j-1];
-			c2 = git->second[j];
+			c1 = gseq[j-1];
+			c2 = gseq[j];
 
 			if( (c1!='C' && c1!='c') || (c2!='G' && c2!='g') )	// not a CpG site
 				continue;
 
-			mp  = methcall.find( chr )->second;
 			mit = mp->find( j-1 );
 			if( mit == mp->end() ) {	// no record, insert one
 				if( realSEQ[i] == 'G' ) {
@@ -454,8 +455,8 @@ void callmeth_CpG( string &realSEQ, string &realQUAL, string &chr, int pos, bool
 }
 
 // write meth call into file
-void write_methcall_CpG( map<string, map<int, meth>*> & mc, map<string, int> & chrcount,
-						unordered_map<string, string> & g, const char *outpre ) {
+void write_methcall_CpG( chr_dict & chrs, vector<map<int, meth>*> & mc, vector<int> & chrcount,
+						vector<const string *> & gseq, const char *outpre ) {
 	string outfile = outpre;
 	outfile += ".CpG.meth.call";
 	ofstream fcpg( outfile.c_str() );
@@ -480,29 +481,27 @@ void write_methcall_CpG( map<string, map<int, meth>*> & mc, map<string, int> & c
 		exit(21);
 	}
 
-	unordered_map<string, string> :: iterator git;
-	map<string, map<int, meth>*> :: iterator mit;	// methcall iterator
 	map<int, meth> :: iterator cit;	// methcall iterator for each chromosome
-	map<string, int> :: iterator chrit;
 
 	meth m;
 
 	fcpg << "#chr\tLocus\tTotal\twC\twT\twOther\tContext\tcC\tcT\tcOther\n";
 	flog << "#chr\tNo.Reads\tCpG.wC\tCpG.wT\tCpG.cC\tCpG.cT\n";
-	for( mit=mc.begin(); mit!=mc.end(); ++mit ) {
-		git = g.find( mit->first );
+	for( unsigned int id=0; id!=mc.size(); ++id ) {	// the IDs are in the order of the names
+		const string & chr = chrs.name[id];
+		const string & gs  = *gseq[id];
 		int totalWC=0, totalWT=0, totalCC=0, totalCT=0;	//total C, T
 		int total_CpG_WC=0, total_CpG_WT=0, total_CpG_CC=0, total_CpG_CT=0;	//total C, T on CpG sites
 
-		for( cit=mit->second->begin(); cit!=mit->second->end(); ++cit ) {
+		for( cit=mc[id]->begin(); cit!=mc[id]->end(); ++cit ) {
 			int i = cit->first;
 			m = cit->second;
 			unsigned int Valid = m.wC+m.wT+m.cC+m.cT;
 
-			if( (git->second[i]=='C' || git->second[i]=='c') && (git->second[i+1]=='G' || git->second[i+1]=='g') ) {	// CpG sites
-				fcpg << mit->first << '\t' << i << '\t' << Valid+m.wZ+m.cZ << '\t'
+			if( (gs[i]=='C' || gs[i]=='c') && (gs[i+1]=='G' || gs[i+1]=='g') ) {	// CpG sites
+				fcpg << chr << '\t' << i << '\t' << Valid+m.wZ+m.cZ << '\t'
 					 << m.wC << '\t' << m.wT << '\t' << m.wZ << '\t'
-					 << git->second[i-1] << git->second[i] << git->second[i+1] << git->second[i+2] << '\t'
+					 << gs[i-1] << gs[i] << gs[i+1] << gs[i+2] << '\t'
 					 << m.cC << '\t' << m.cT << '\t' << m.cZ << '\n';
 
 				if( Valid != 0 ) {
@@ -512,7 +511,7 @@ void write_methcall_CpG( map<string, map<int, meth>*> & mc, map<string, int> & c
 					} else {
 						md = (m.wC+m.cC)*100.0/Valid;
 					}
-					fbed << mit->first << '\t' << i-1 << '\t' << i << '\t' << md << '\n';
+					fbed << chr << '\t' << i-1 << '\t' << i << '\t' << md << '\n';
 				}
 				total_CpG_WC += m.wC;
 				total_CpG_WT += m.wT;
@@ -521,12 +520,11 @@ void write_methcall_CpG( map<string, map<int, meth>*> & mc, map<string, int> & c
 			}
 		}
 
-		chrit = chrcount.find( mit->first );
-		flog << mit->first << '\t' << chrit->second << '\t'
+		flog << chr << '\t' << chrcount[id] << '\t'
 			 << total_CpG_WC << '\t' << total_CpG_WT << '\t'
 			 << total_CpG_CC << '\t' << total_CpG_CT << '\n';
 
-		delete mit->second;
+		delete mc[id];
 	}
 	fcpg.close();
 	flog.close();
@@ -10,6 +10,10 @@
 #include <omp.h>
 #include <zlib.h>
 #include "common.h"
+#include "fqreader.h"
+#include "trim.kernel.h"
+#include "convert.kernel.h"
+#include "sidecar.h"
 
 using namespace std;
 
@@ -32,48 +36,6 @@ using namespace std;
  *	   it to the output files after the multi-thread trimming/conversion
 **/
 
-/*
- * use dynamic max_mismatch as the covered size can range from 3 to a large number such as 50,
- * so use 4 is not good
-*/
-bool check_mismatch_dynamic_PE( const string & s1, string & s2, unsigned int pos, const adapter_info* ai ) {
-	register unsigned int mis1=0, mis2=0;
-	register unsigned int i, len;
-	len = s1.length() - pos;
-	if( len > ai->adapter_len )
-		len = ai->adapter_len;
-
-	register unsigned int max_mismatch_dynamic = len >> 2;
-	// here use 1/4 of the total length, use roof(len/4)
-
-	if( (max_mismatch_dynamic<<2) != len )
-		++ max_mismatch_dynamic;
-
-	// check mismatch for each read
-	const char * p = s1.c_str();
-	for( i=0; i!=len; ++i ) {
-		if( p[pos+i] != ai->adapter_r1[i] ) {
-			++ mis1;
-			if( mis1 > max_mismatch_dynamic )
-				return false;
-		}
-	}
-	p = s2.c_str();
-	for( i=0; i!=len; ++i ) {
-		if( p[pos+i] != ai->adapter_r2[i] ) {
-			++ mis2;
-			if( mis2 > max_mismatch_dynamic )
-				return false;
-		}
-	}
-	// check total mismatch
-	max_mismatch_dynamic = (len+1) >> 1;
-	if( mis1 + mis2 > max_mismatch_dynamic )
-		return false;
-
-	return true;
-}
-
 bool inline is_revcomp( const char a, const char b ) {
 	switch( a ) {
 		case 'A': return b=='T';
@@ -84,10 +46,452 @@ bool inline is_revcomp( const char a, const char b ) {
 	}
 }
 
+void inline resize_pair( fq_record & r1, fq_record & r2, unsigned int len ) {
+	r1.seqLen  = len;
+	r2.seqLen  = len;
+	r1.qualLen = len;
+	r2.qualLen = len;
+}
+
+char inline * append( char *o, const char *s, unsigned int len ) {
+	memcpy( o, s, len );
+	return o + len;
+}
+
+// write '\n' seq "\n+\n" qual '\n' (the ID is written by the caller)
+char inline * write_read( char *o, const char *seq, const char *qual, unsigned int seqLen, unsigned int qualLen ) {
+	*o = '\n';
+	o = append( o+1, seq, seqLen );
+	o[0] = '\n';
+	o[1] = '+';
+	o[2] = '\n';
+	o = append( o+3, qual, qualLen );
+	*o = '\n';
+	return o + 1;
+}
+
+// write '\n' seq '\n' for the FASTA output used with sidecar (the ID is written by the caller)
+char inline * write_fasta_read( char *o, const char *seq, unsigned int seqLen ) {
+	*o = '\n';
+	o = append( o+1, seq, seqLen );
+	*o = '\n';
+	return o + 1;
+}
+
+// write the head of ID in mode 3 and 4: @LINE_NUMBER (or >LINE_NUMBER in FASTA)
+char inline * write_id_head( char *o, char start, unsigned int line ) {
+	*o = start;
+	return write_hex( o+1, line );
+}
+
+// write the rest of ID in mode 3 and 4: conversionLog # raw_seq_name
+char inline * write_id_tail( char *o, const unsigned int *bits, unsigned int len, const char *id, unsigned int idLen ) {
+	o = write_conversion_log( o, bits, len );
+	*o = CONVERSION_LOG_END;
+	return append( o+1, id+1, idLen-1 );
+}
+
+// one batch of read pairs together with the per-thread output buffers
+typedef struct {
+	fq_record *reads1, *reads2;
+	fq_arena arena1, arena2;	// only used for compressed input
+	unsigned int loaded;	// number of read1 loaded
+	unsigned int loaded2;	// number of read2 loaded, MUST be the same as loaded
+	unsigned int line;		// line number of the first read in this batch
+	unsigned int processed;	// number of reads processed by the trimming threads, used by the writer
+
+	char **buffer1, **buffer2;
+	int  *b1stored, *b2stored;
+
+	// sidecar records (if enabled) and their sizes per read (0 for dropped reads)
+	char **buffer3;
+	int  *b3stored;
+	unsigned int *reclen;
+} pe_batch;
+
+void init_batch( pe_batch & b, unsigned int thread, bool sidecar ) {
+	b.reads1 = new fq_record [READS_PER_BATCH];
+	b.reads2 = new fq_record [READS_PER_BATCH];
+	init_arena( b.arena1 );
+	init_arena( b.arena2 );
+	b.loaded  = 0;
+	b.loaded2 = 0;
+	b.line    = 1;
+	b.processed = 0;
+
+	b.buffer1  = new char * [thread];
+	b.buffer2  = new char * [thread];
+	b.b1stored = new int [thread];
+	b.b2stored = new int [thread];
+	for(unsigned int i=0; i!=thread; ++i) {
+		b.buffer1[i] = new char[ BUFFER_SIZE_PER_BATCH_READ ];
+		b.buffer2[i] = new char[ BUFFER_SIZE_PER_BATCH_READ ];
+		b.b1stored[i] = 0;
+		b.b2stored[i] = 0;
+	}
+
+	b.buffer3  = NULL;
+	b.b3stored = NULL;
+	b.reclen   = NULL;
+	if( sidecar ) {
+		b.buffer3  = new char * [thread];
+		b.b3stored = new int [thread];
+		b.reclen   = new unsigned int [READS_PER_BATCH];
+		for(unsigned int i=0; i!=thread; ++i) {
+			b.buffer3[i] = new char[ BUFFER_SIZE_PER_BATCH_READ ];
+			b.b3stored[i] = 0;
+		}
+	}
+}
+
+void free_batch( pe_batch & b, unsigned int thread ) {
+	delete [] b.reads1;
+	delete [] b.reads2;
+	free_arena( b.arena1 );
+	free_arena( b.arena2 );
+	for(unsigned int i=0; i!=thread; ++i) {
+		delete [] b.buffer1[i];
+		delete [] b.buffer2[i];
+	}
+	delete [] b.buffer1;
+	delete [] b.buffer2;
+	delete [] b.b1stored;
+	delete [] b.b2stored;
+	if( b.buffer3 != NULL ) {
+		for(unsigned int i=0; i!=thread; ++i)
+			delete [] b.buffer3[i];
+		delete [] b.buffer3;
+		delete [] b.b3stored;
+		delete [] b.reclen;
+	}
+}
+
+// parameters shared by all the trimming threads
+typedef struct {
+	unsigned int cycle;
+	unsigned int min_length;
+	unsigned char quality;
+	bool sidecar;
+	adapter_kernel ak;
+} trim_param;
+
+// working space and counters of one trimming thread
+typedef struct {
+	char *scratch, *scratch2;	// the converted sequences
+	unsigned int *convbits, *convbits2;	// the converted positions
+	char *pad1, *pad2, *qpad1, *qpad2;	// padded reads and qualities for the kernels
+	base_stat R1stat, R2stat;
+	int dropped, real_adapter, tail_adapter;
+} trim_space;
+
+void init_trim_space( trim_space & ts, unsigned int cycle ) {
+	ts.scratch   = new char [ cycle+READ_PADDING ];
+	ts.scratch2  = new char [ cycle+READ_PADDING ];
+	ts.convbits  = new unsigned int [ conversion_words(cycle) ];
+	ts.convbits2 = new unsigned int [ conversion_words(cycle) ];
+	ts.pad1  = new char [ cycle+READ_PADDING ];
+	ts.pad2  = new char [ cycle+READ_PADDING ];
+	ts.qpad1 = new char [ cycle+READ_PADDING ];
+	ts.qpad2 = new char [ cycle+READ_PADDING ];
+	init_base_stat( ts.R1stat, cycle );
+	init_base_stat( ts.R2stat, cycle );
+	ts.dropped = 0;
+	ts.real_adapter = 0;
+	ts.tail_adapter = 0;
+}
+
+void free_trim_space( trim_space & ts ) {
+	delete [] ts.scratch;
+	delete [] ts.scratch2;
+	delete [] ts.convbits;
+	delete [] ts.convbits2;
+	delete [] ts.pad1;
+	delete [] ts.pad2;
+	delete [] ts.qpad1;
+	delete [] ts.qpad2;
+	free_base_stat( ts.R1stat );
+	free_base_stat( ts.R2stat );
+}
+
+/*
+ * trimming and conversion of the read pairs [start, end) in one batch by thread tn
+ * the run mode and the adapter kit are template parameters, so the per-read branches on them
+ * are resolved at compile time (see select_trimmer for the dispatching)
+*/
+template <unsigned int MODE, class KIT>
+void trim_batch( pe_batch & b, unsigned int tn, unsigned int start, unsigned int end,
+					const trim_param & tp, trim_space & ts ) {
+	char **buffer1 = b.buffer1;
+	char **buffer2 = b.buffer2;
+	int  *b1stored = b.b1stored;
+	int  *b2stored = b.b2stored;
+	unsigned int line = b.line;
+	bool sidecar = tp.sidecar;
+
+	register int i, j;
+	const char *p, *q;
+	char *scratch  = ts.scratch;
+	char *scratch2 = ts.scratch2;
+	unsigned int *convbits  = ts.convbits;
+	unsigned int *convbits2 = ts.convbits2;
+	char *pad1  = ts.pad1;
+	char *pad2  = ts.pad2;
+	char *qpad1 = ts.qpad1;
+	char *qpad2 = ts.qpad2;
+	unsigned int len1, len2;	// bp covered by the conversion logs
+	unsigned char flags;	// endC and frontG
+	char qEnd, qFront;
+	char *o, *s;
+
+	for( unsigned int ii=start; ii!=end; ++ii ) {
+		fq_record & r1 = b.reads1[ii];
+		fq_record & r2 = b.reads2[ii];
+
+		// check whether read1 and read2 are of the same read length
+		if( r2.seqLen != r1.seqLen ) {
+			if( r2.seqLen > r1.seqLen ) {
+				r2.seqLen  = r1.seqLen;
+				r2.qualLen = r1.qualLen;
+			} else {
+				r1.seqLen  = r2.seqLen;
+				r1.qualLen = r2.qualLen;
+			}
+		}
+
+		//if the reads are longer than "cycle" paramater, only keep the head "cycle" ones
+		if( r1.seqLen > tp.cycle ) {
+			r1.seqLen  = tp.cycle;
+			r1.qualLen = tp.cycle;
+			r2.seqLen  = tp.cycle;
+			r2.qualLen = tp.cycle;
+		}
+
+		if( r1.qualLen > tp.cycle )	// malformed records only
+			r1.qualLen = tp.cycle;
+		if( r2.qualLen > tp.cycle )
+			r2.qualLen = tp.cycle;
+
+		// fqstatistics and quality control in one pass
+		pad_read( pad1,  r1.seq,  r1.seqLen );
+		pad_read( pad2,  r2.seq,  r2.seqLen );
+		pad_read( qpad1, r1.qual, r1.qualLen );
+		pad_read( qpad2, r2.qual, r2.qualLen );
+		i = scan_read_PE( ts.R1stat, ts.R2stat, pad1, pad2, qpad1, qpad2, r1.seqLen, r1.qualLen, tp.quality );
+		if( i < tp.min_length ) { // not long enough
+			++ ts.dropped;
+			continue;
+		}
+		resize_pair( r1, r2, i );
+
+		// looking for seed target, 1 mismatch is allowed for these 2 seeds
+		// which means seq1 and seq2 at least should take 1 perfect seed match
+		// the padded reads are still valid as they are only shortened
+		i = find_adapter_PE<KIT>( pad1, pad2, r1.seqLen, tp.ak );
+		if( i != -1 ) {	// adapter found
+			++ ts.real_adapter;
+			if( i >= tp.min_length )	{
+				resize_pair( r1, r2, i );
+			} else {	// drop this read as its length is not enough
+				++ ts.dropped;
+				continue;
+			}
+		} else {	// seed not found, now check the tail 2 or 1, if perfect match, drop these 2
+			i = r1.seqLen - 2;
+			p = r1.seq;
+			q = r2.seq;
+			if( p[i]==KIT::r1_0 && p[i+1]==KIT::r1_1 &&
+						q[i]==KIT::r2_0 && q[i+1]==KIT::r2_1 ) {
+				// if it is a real adapter, then Read1 and Read2 should be complimentary
+				// in real data, the heading 5 bp are usually of poor quality, therefore we test the 6th, 7th
+				if( is_revcomp(p[5], q[i-6]) && is_revcomp(q[5], p[i-6]) ) {
+					if( i < tp.min_length ) {
+						++ ts.dropped;
+						continue;
+					}
+					resize_pair( r1, r2, i );
+
+					++ ts.tail_adapter;
+				}
+			} else {	// tail 2 is not good, check tail 1
+				++ i;
+				if( p[i] == KIT::r1_0 && q[i] == KIT::r2_0 ) {
+					if(is_revcomp(p[5], q[i-6]) && is_revcomp(q[5], p[i-6]) &&
+							is_revcomp(p[6], q[i-7]) && is_revcomp(q[6], p[i-7]) ) {
+						if( i < tp.min_length ) {
+							++ ts.dropped;
+							continue;
+						}
+						resize_pair( r1, r2, i );
+
+						++ ts.tail_adapter;
+					}
+				}
+			}
+		}
+
+		//check if there is any white space in the IDs; if so, remove all the data after the whitespace
+		j = r1.idLen;
+		p = r1.id;
+		for( i=1; i!=j; ++i ) {
+			if( p[i]==' ' || p[i]=='\t' ) {	// white space, then trim ID
+				r1.idLen = i;
+				break;
+			}
+		}
+		j = r2.idLen;
+		q = r2.id;
+		for( i=0; i!=j; ++i ) {
+			if( q[i]==' ' || q[i]=='\t' ) {	// white space, then trim ID
+				r2.idLen = i;
+				break;
+			}
+		}
+
+		// do C->T and G->A conversion
+		// the converted sequence is written into the output buffer directly
+		if( MODE == 0 ) {	// no need to do conversion
+			o = buffer1[tn] + b1stored[tn];
+			o = append( o, r1.id, r1.idLen );
+			o = write_read( o, r1.seq, r1.qual, r1.seqLen, r1.qualLen );
+			b1stored[tn] = o - buffer1[tn];
+
+			o = buffer2[tn] + b2stored[tn];
+			o = append( o, r2.id, r2.idLen );
+			o = write_read( o, r2.seq, r2.qual, r2.seqLen, r2.qualLen );
+			b2stored[tn] = o - buffer2[tn];
+		} else {	// mode 3 and 4; in this implementation, id1 and id2 are different!!!
+			p = r1.seq;
+			q = r2.seq;
+			flags  = 0;
+			qEnd   = 0;
+			qFront = 0;
+			len2   = r2.seqLen;
+			if( MODE == 3 ) {	// in mode 3, there is NO endC and frontG issues
+				len1 = r1.seqLen;	// seq1 and seq2 are of the same size
+				convert_read<'C', 'T', 0, 0>( scratch, pad1, len1, convbits );
+				convert_read<'G', 'A', 0, 0>( scratch2, pad2, len2, convbits2 );
+			} else {	// mode 4, this is the major task for EMaligner
+				// check seq1 for C>T conversion in CpG context
+				len1 = r1.seqLen-1;
+				if( p[len1] == 'C' ) { //ther is a 'C' and the end, discard it (but record its Quality score);
+					//otherwise it may introduce a mismatch in alignment
+					flags |= SIDECAR_ENDC;
+					qEnd = r1.qual[ r1.qualLen-1 ];
+					-- r1.seqLen;
+					-- r1.qualLen;
+				}
+				convert_read<'C', 'T', 0, conversion_rule<MODE>::next1>( scratch, pad1, len1, convbits );
+				scratch[len1] = p[len1];	// the last base is kept if it is not an endC
+
+				// check seq2 for G>A conversion in CpG context
+				if( q[0] == 'G' ) { //'G' at the front, discard it (but record its Quality score)
+					flags |= SIDECAR_FRONTG;
+					qFront = r2.qual[0];
+				}
+				convert_read<'G', 'A', conversion_rule<MODE>::prev2, 0>( scratch2, pad2, len2, convbits2 );
+			}
+
+			// modify id1 to add line number (to facilitate removing ambigous step)
+			o = buffer1[tn] + b1stored[tn];
+			if( sidecar ) {
+				o = write_id_head( o, FASTA_SEQNAME_START, line+ii );
+				o = write_fasta_read( o, scratch, r1.seqLen );
+			} else {
+				o = write_id_head( o, NORMAL_SEQNAME_START, line+ii );
+				*o++ = LINE_NUMBER_SEPARATOR;
+				if( flags & SIDECAR_ENDC ) {
+					o[0] = qEnd;
+					o[1] = KEEP_QUAL_MARKER;
+					o += 2;
+				}
+				o = write_id_tail( o, convbits, len1, r1.id, r1.idLen );
+				o = write_read( o, scratch, r1.qual, r1.seqLen, r1.qualLen );
+			}
+			b1stored[tn] = o - buffer1[tn];
+			// format for ID1:
+			// if there is a C at the end
+			//	@line_number '+' x| C1;C2;C3$ raw_seq_name
+			//	the | is the marker for the existence of tail 'C' and 'x' is its quality score
+			//	if exists, | is ALWAYS two bytes after '+' (use this to test its existence)
+			// if there is No C at the end
+			//	@line_number '+' C1&C2&C3$ raw_seq_name
+			// if sidecar is used (FASTA)
+			//	>line_number
+			//
+			// All the numbers in line_number and C1,C2,C3... are HEX
+
+			if( flags & SIDECAR_FRONTG ) {	// the frontG is discarded
+				p = scratch2 + 1;
+				q = r2.qual + 1;
+				-- r2.seqLen;
+				-- r2.qualLen;
+			} else {
+				p = scratch2;
+				q = r2.qual;
+			}
+			o = buffer2[tn] + b2stored[tn];
+			if( sidecar ) {
+				o = write_id_head( o, FASTA_SEQNAME_START, line+ii );
+				o = write_fasta_read( o, p, r2.seqLen );
+			} else {	// do not add line number to read 2
+				*o++ = NORMAL_SEQNAME_START;
+				if( flags & SIDECAR_FRONTG ) {
+					o[0] = qFront;
+					o[1] = KEEP_QUAL_MARKER;
+					o += 2;
+				}
+				o = write_id_tail( o, convbits2, len2, r2.id, r2.idLen );
+				o = write_read( o, p, q, r2.seqLen, r2.qualLen );
+			}
+			b2stored[tn] = o - buffer2[tn];
+			// format for ID2:
+			// if there is a G at the front
+			//	@x| C1&C2&C3$ raw_seq_name
+			//	if exists, | is ALWAYS two bytes after '@' (use this to test its existence)
+			// if there is No G at the front
+			//	@C1&C2&C3$ raw_seq_name
+			// if sidecar is used (FASTA)
+			//	>line_number
+			//
+			// All the numbers in line_number and C1,C2,C3... are HEX
+
+			if( sidecar ) {
+				// read 2 usually has the same name as read 1, then its name is not recorded
+				i = sam_name_length( r1.id+1, r1.idLen-1 );
+				j = sam_name_length( r2.id+1, r2.idLen-1 );
+				if( i==j && memcmp(r1.id+1, r2.id+1, i)==0 ) {
+					flags |= SIDECAR_SAME_NAME;
+					j = 0;
+				}
+				s = b.buffer3[tn] + b.b3stored[tn];
+				o = write_sidecar_head( s, flags, qEnd, qFront );
+				o = write_sidecar_read( o, convbits,  len1, r1.id+1, i, r1.qual, r1.qualLen );
+				o = write_sidecar_read( o, convbits2, len2, r2.id+1, j, q, r2.qualLen );
+				b.reclen[ii] = o - s;
+				b.b3stored[tn] = o - b.buffer3[tn];
+			}
+		}
+	}
+}
+
+typedef void (*pe_trimmer)( pe_batch &, unsigned int, unsigned int, unsigned int, const trim_param &, trim_space & );
+
+// dispatch the run mode once per run
+template <class KIT>
+pe_trimmer select_trimmer( unsigned int mode ) {
+	if( mode == 0 )
+		return trim_batch<0, KIT>;
+	else if( mode == 3 )
+		return trim_batch<3, KIT>;
+	else
+		return trim_batch<4, KIT>;
+}
+
+
 int main( int argc, const char *argv[] ) {
 	if( argc < 5 ) {
 		cerr << "\nUsage: " << argv[0] << " <r1.fq> <r2.fq> <cycle> <out.prefix> "
-			 << "[mode=0|3|4] [thread=1] [min.length=36] [min.quality=53] [library=illumina]\n\n"
+			 << "[mode=0|3|4] [thread=1] [min.length=36] [min.quality=53] [library=illumina] [sidecar=0]\n\n"
 
 			 << "This program is part of Msuite and is designed to do fastq statistics, quality-trimming,\n"
 			 << "adapter-trimming and C->T/G->A conversions for Paired-End reads generated by illumina sequencers.\n\n"
@@ -100,7 +504,10 @@ int main( int argc, const char *argv[] ) {
 			 << "Default parameters:\n"
 			 << "  mode: 0\n"
 			 << "  min.length: 36\n"
-			 << "  min.quality: 53 (33+20 for phred33('!') scoring system)\n\n"
+			 << "  min.quality: 53 (33+20 for phred33('!') scoring system)\n"
+			 << "  sidecar: 0 (set to 1 to write the conversion logs and read names into out.prefix.sidecar\n"
+			 << "           and the quality scores into out.prefix.sidecar, then the reads are written in\n"
+			 << "           FASTA format with only the line numbers as names; mode 3 and 4 only)\n\n"
 
 			 << "Other commonly used Phred scoring systems are 35('#') and 64('@').\n"
 			 << "You may need to set this parameter manually based on your data.\n\n"
@@ -122,8 +529,8 @@ int main( int argc, const char *argv[] ) {
 	unsigned int  thread = 1;
 	unsigned int  min_length = 36;
 	unsigned char quality = 53;
-	const char *libraryKit;
-	const adapter_info* ai;
+	const char *libraryKit = "illumina";
+	bool sidecar = false;
 	unsigned int  cycle = atoi( argv[3] );
 	if( cycle == 0 ) {
 		cerr << "Error: Unacceptable cycle!\n";
@@ -139,6 +546,8 @@ int main( int argc, const char *argv[] ) {
 					quality = (unsigned char) atoi( argv[8] );
 					if( argc > 9 ) {
 						libraryKit = argv[9];
+						if( argc > 10 )
+							sidecar = ( atoi(argv[10]) != 0 );
 					} else {
 						libraryKit = "illumina";
 					}
@@ -150,6 +559,10 @@ int main( int argc, const char *argv[] ) {
 		cerr << "Error: invalid run mode! Must be 0, 3, or 4!\n";
 		return 100;
 	}
+	if( sidecar && mode == 0 ) {
+		cerr << "Error: sidecar is only supported in mode 3 and 4!\n";
+		return 104;
+	}
 	if( thread == 0 ) {
 		cerr << "Warning: thread is set to 0! I will use all threads instead.\n";
 		thread = omp_get_max_threads();
@@ -162,84 +575,71 @@ int main( int argc, const char *argv[] ) {
 		cerr << "Error: invalid quality! Must be a positive number!\n";
 		return 102;
 	}
+	trim_param tp;
+	tp.cycle = cycle;
+	tp.min_length = min_length;
+	tp.quality = quality;
+	tp.sidecar = sidecar;
+
+	// the trimming/conversion function specialized for this run
+	pe_trimmer trim;
 	if( strcmp(libraryKit, "illumina")==0 || strcmp(libraryKit, "Illumina")==0 ) {
-		ai = &illumina_adapter;
+		trim = select_trimmer<illumina_kit>( mode );
+		init_adapter_kernel<illumina_kit>( tp.ak );
 	} else if ( strcmp(libraryKit, "nextera")==0 || strcmp(libraryKit, "Nextera")==0 ) {
-		ai = &nextera_adapter;
+		trim = select_trimmer<nextera_kit>( mode );
+		init_adapter_kernel<nextera_kit>( tp.ak );
 	} else if ( strcmp(libraryKit, "bgi")==0 || strcmp(libraryKit, "BGI")==0 ) {
-		ai = &bgi_adapter;
+		trim = select_trimmer<bgi_kit>( mode );
+		init_adapter_kernel<bgi_kit>( tp.ak );
 	} else {
 		cerr << "Error: invalid library kit! Currently only supports illumina and nextera!\n";
 		return 103;
 	}
 
-	string *id1   = new string [READS_PER_BATCH];
-	string *id2   = new string [READS_PER_BATCH];
-	string *seq1  = new string [READS_PER_BATCH];
-	string *seq2  = new string [READS_PER_BATCH];
-	string *qual1 = new string [READS_PER_BATCH];
-	string *qual2 = new string [READS_PER_BATCH];
-	string unk;
+	cerr << "Loading files ...\n";
+	// deal with multiple input files
+	fq_input in1, in2;
+	init_fq_input( in1, argv[1], 1 );
+	init_fq_input( in2, argv[2], 1 );
+	
+	if( in1.files.size() != in2.files.size() ) {
+		cerr << "Fatal error: Read1 and Read2 do not contain equal sized files!\n";
+		return 10;
+	}
+	unsigned int totalFiles = in1.files.size();
+	cout << "INFO: " << totalFiles << " paired fastq files will be loaded.\n";
 
-	int *dropped	  = new int [thread];
-	int *real_adapter = new int [thread];
-	int *tail_adapter = new int [thread];
+	if( ! open_next_file( in1 ) || ! open_next_file( in2 ) )
+		return 11;
+
+	// the readers inflate the BGZF blocks at the same time as the trimming threads work, and inflating
+	// a chunk costs several times more than trimming its reads; so for BGZF input (judged by the first
+	// files) each reader uses a third of the threads, and the trimming threads are reduced by the extra
+	// inflating threads to keep the total unchanged
+	if( in1.type==FQ_BGZF || in2.type==FQ_BGZF ) {
+		unsigned int zthread = ( thread >= 3 ) ? thread/3 : 1;
+		in1.thread = zthread;
+		in2.thread = zthread;
+		thread -= 2*(zthread-1);
+	}
 
 	fastqstat * AllR1stat = new fastqstat[ cycle ];
 	memset( AllR1stat, 0, cycle*sizeof(fastqstat) );
 	fastqstat * AllR2stat = new fastqstat[ cycle ];
 	memset( AllR2stat, 0, cycle*sizeof(fastqstat) );
 
-	// buffer for storing the modified reads per thread
-	char ** buffer1 = new char * [thread];
-	char ** buffer2 = new char * [thread];
-	int  * b1stored = new int	[thread];
-	int  * b2stored = new int	[thread];
-	fastqstat **R1stat = new fastqstat * [thread];
-	fastqstat **R2stat = new fastqstat * [thread];
-	for(unsigned int i=0; i!=thread; ++i) {
-		buffer1[i] = new char[ BUFFER_SIZE_PER_BATCH_READ ];
-		buffer2[i] = new char[ BUFFER_SIZE_PER_BATCH_READ ];
-
-		R1stat[i]  = new fastqstat [ cycle ];
-		R2stat[i]  = new fastqstat [ cycle ];
-
-		dropped[i] = 0;
-		real_adapter[i] = 0;
-		tail_adapter[i] = 0;
-	}
+	// working space and statistics per thread
+	trim_space *ts = new trim_space [thread];
+	for(unsigned int i=0; i!=thread; ++i)
+		init_trim_space( ts[i], cycle );
 
-	cerr << "Loading files ...\n";
-	// deal with multiple input files
-	vector<string> R1s, R2s;
-	string fileName="";
-	for(unsigned int i=0; argv[1][i]!='\0'; ++i) {
-		if( argv[1][i] == FILE_SEPARATOR ) {
-			R1s.push_back( fileName );
-			fileName.clear();
-		} else {
-			fileName += argv[1][i];
-		}
-	}
-	R1s.push_back( fileName );
-
-	fileName.clear();
-	for(unsigned int i=0; argv[2][i]!='\0'; ++i) {
-		if( argv[2][i] == FILE_SEPARATOR ) {
-			R2s.push_back( fileName );
-			fileName.clear();
-		} else {
-			fileName += argv[2][i];
-		}
-	}
-	R2s.push_back( fileName );
-	
-	if( R1s.size() != R2s.size() ) {
-		cerr << "Fatal error: Read1 and Read2 do not contain equal sized files!\n";
-		return 10;
-	}
-	unsigned int totalFiles = R1s.size();
-	cout << "INFO: " << totalFiles << " paired fastq files will be loaded.\n";
+	// two batches are used in turn: when the trimming threads are working on one of them,
+	// the reader threads are loading the next batch into the other one, while the writer thread
+	// is writing the output buffers of the previous batch, which are also in the other one
+	pe_batch batch[2];
+	init_batch( batch[0], thread, sidecar );
+	init_batch( batch[1], thread, sidecar );
 
 	string base = argv[4];
 	ofstream fout1( (base+".R1.fq").c_str() ), fout2( (base+".R2.fq").c_str() );
@@ -249,453 +649,123 @@ int main( int argc, const char *argv[] ) {
 		fout2.close();
 		return 3;
 	}
-	// set HEX format number output
-	fout1.setf(ios::hex, ios::basefield);
-	fout2.setf(ios::hex, ios::basefield);
-	
-	ifstream fq1, fq2;
-	gzFile gfp1, gfp2;
-	char * gz_buffer = new char [ MAX_SEQNAME_SIZE ];
-	register unsigned int line = 1;
-	for( unsigned int fileCnt=0; fileCnt!=totalFiles; ++ fileCnt ) {
-		bool file_is_gz = false;
-		register unsigned int i_file = R1s[fileCnt].size() - 3;
-		register const char * p_file = R1s[fileCnt].c_str();
-		if( p_file[i_file]=='.' && p_file[i_file+1]=='g' && p_file[i_file+2]=='z' ) {	// .gz file
-			file_is_gz = true;
-			gfp1 = gzopen( p_file, "r" );
-			gfp2 = gzopen( R2s[fileCnt].c_str(), "r" );
-			if( gfp1==NULL || gfp2==NULL ) {
-				cerr << "Error: open fastq file failed!\n";
-				fout1.close();
-				fout2.close();
-				return 11;
-			}
-		} else {	// plain text
-			file_is_gz = false;
-			fq1.open( R1s[fileCnt] );
-			fq2.open( R2s[fileCnt] );
-			if( fq1.fail() || fq2.fail() ) {
-				cerr << "Error: open fastq file failed!\n";
-				fout1.close();
-				fout2.close();
-				return 11;
-			}
+
+	ofstream fout3, fidx;
+	unsigned long long *sidx = NULL;	// offsets of the sidecar records in one batch
+	unsigned long long sidecarSize = 0;
+	if( sidecar ) {
+		fout3.open( (base+".sidecar").c_str() );
+		fidx.open( (base+".sidecar.idx").c_str() );
+		if( fout3.fail() || fidx.fail() ) {
+			cout << "Error: write sidecar file failed!\n";
+			fout1.close();
+			fout2.close();
+			return 3;
 		}
-		// load and process reads
-		while( true ) {
-			unsigned int loaded = 0;
-			if( file_is_gz ) {
-				while( true ) {
-					if( gzgets( gfp1, gz_buffer, MAX_SEQNAME_SIZE ) == NULL ) break;
-					id1  [ loaded ] = gz_buffer;
-					gzgets( gfp1, gz_buffer, MAX_SEQNAME_SIZE );
-					seq1 [ loaded ] = gz_buffer;
-					gzgets( gfp1, gz_buffer, MAX_SEQNAME_SIZE );	// this line is useless
-					gzgets( gfp1, gz_buffer, MAX_SEQNAME_SIZE );
-					qual1[ loaded ] = gz_buffer;
-
-					id1 [ loaded ].pop_back();	// trim the tail '\n'
-					seq1[ loaded ].pop_back();
-					if( qual1[loaded].size() != seq1[loaded].size() )	//the last read may not contain '\n' for quality line
-						qual1[loaded].pop_back();
-
-					++ loaded;
-					if( loaded == READS_PER_BATCH )
-						break;
-				}
-				if( loaded == 0 )	// reach the end of file
-					break;
-				// read 2
-				for( register unsigned int i=0; i!=loaded; ++i ) {
-					gzgets( gfp2, gz_buffer, MAX_SEQNAME_SIZE );
-					id2  [ i ] = gz_buffer;
-					gzgets( gfp2, gz_buffer, MAX_SEQNAME_SIZE );
-					seq2 [ i ] = gz_buffer;
-					gzgets( gfp2, gz_buffer, MAX_SEQNAME_SIZE );	// this line is useless
-					gzgets( gfp2, gz_buffer, MAX_SEQNAME_SIZE );
-					qual2[ i ] = gz_buffer;
-
-					id2 [ i ].pop_back();
-					seq2[ i ].pop_back();
-					if( qual2[i].size() != seq2[i].size() )
-						qual2[i].pop_back();
-				}
-			} else {
-				while( true ) {
-					getline( fq1, id1  [ loaded ] );
-					if( fq1.eof() )break;
-					getline( fq1, seq1 [ loaded ] );
-					getline( fq1, unk );
-					getline( fq1, qual1[ loaded ] );
-	
-					++ loaded;
-					if( loaded == READS_PER_BATCH )
-						break;
-				}
-				if( loaded == 0 )
-					break;
-				for( register unsigned int i=0; i!=loaded; ++i ) {
-					getline( fq2, id2  [ i ] );
-					getline( fq2, seq2 [ i ] );
-					getline( fq2, unk );
-					getline( fq2, qual2[ i ] );
-				}
-			}
+		sidx = new unsigned long long [ READS_PER_BATCH ];
+		fidx.write( (char *)&sidecarSize, sizeof(unsigned long long) );	// line number starts from 1
+	}
 
-			// check whether read1 and read2 are of the same read length
-			for( register unsigned int i=0; i!=loaded; ++i ) {
-				if( seq2[i].size() != seq1[i].size() ) {
-					if( seq2[i].size() > seq1[i].size() ) {
-						seq2[i].resize(  seq1[i].size()  );
-						qual2[i].resize( qual1[i].size() );
-					} else {
-						seq1[i].resize(  seq2[i].size()  );
-						qual1[i].resize( qual2[i].size() );
+	// start the pipeline; in the k-th round:
+	//   thread 0 and 1 load read1 and read2 of batch k,
+	//   thread 2 writes the output of batch k-2,
+	//   the other threads do the trimming/conversion of batch k-1
+	// each reader also uses a nested team of in.thread threads to decompress the next chunk
+	register unsigned int line = 1;
+	bool unpaired = false;
+	omp_set_dynamic( 0 );
+	omp_set_max_active_levels( 3 );	// the readers use nested threads for decompression
+	#pragma omp parallel num_threads( thread+3 )
+	{
+		unsigned int tid = omp_get_thread_num();
+
+		for( unsigned int k=0; ; ++k ) {
+			pe_batch & curr = batch[ k & 1 ];
+			pe_batch & prev = batch[ (k+1) & 1 ];
+
+			if( tid == 0 ) {	// reader for read 1
+				curr.loaded = load_reads( in1, curr.reads1, READS_PER_BATCH, curr.arena1 );
+				curr.line = line;
+				line += curr.loaded;
+				cerr << '\r' << line-1 << " reads loaded";
+			} else if( tid == 1 ) {	// reader for read 2
+				curr.loaded2 = load_reads( in2, curr.reads2, READS_PER_BATCH, curr.arena2 );
+			} else if( tid == 2 ) {	// writer
+				if( k >= 2 ) {
+					for( unsigned int w=0; w!=thread; ++w )
+						fout1.write( curr.buffer1[w], curr.b1stored[w] );
+					for( unsigned int w=0; w!=thread; ++w )
+						fout2.write( curr.buffer2[w], curr.b2stored[w] );
+					if( sidecar ) {
+						for( unsigned int w=0; w!=thread; ++w )
+							fout3.write( curr.buffer3[w], curr.b3stored[w] );
+						for( unsigned int ii=0; ii!=curr.processed; ++ii ) {
+							sidx[ii] = sidecarSize;
+							sidecarSize += curr.reclen[ii];
+						}
+						fidx.write( (char *)sidx, curr.processed*sizeof(unsigned long long) );
 					}
 				}
-
-				//if the reads are longer than "cycle" paramater, only keep the head "cycle" ones
-				if( seq1[i].size() > cycle ) {
-					seq1[i].resize(  cycle );
-					qual1[i].resize( cycle );
-					seq2[i].resize(  cycle );
-					qual2[i].resize( cycle );
-				}
-			}
-
-			// start parallalization
-			omp_set_num_threads( thread );
-			#pragma omp parallel
-			{
-				unsigned int tn = omp_get_thread_num();
+			} else {	// trimming and conversion
+				unsigned int tn = tid - 3;
+				unsigned int loaded = prev.loaded;
 				unsigned int start = loaded * tn / thread;
 				unsigned int end   = loaded * (tn+1) / thread;
 
 				// normalization
-				b1stored[tn] = 0;
-				b2stored[tn] = 0;
-				memset( R1stat[tn], 0, cycle*sizeof(fastqstat) );
-				memset( R2stat[tn], 0, cycle*sizeof(fastqstat) );
-			
-				string conversionLog;
-				register int i, j;
-				register unsigned int last_seed;
-				vector<unsigned int> seed;
-				vector<unsigned int> :: iterator it;
-				const char *p, *q;
-				char *conversion = new char [MAX_CONVERSION];
-				char numstr[10]; // enough to hold all numbers up to 99,999,999 plus ':'
-
-				for( unsigned int ii=start; ii!=end; ++ii ) {
-					// fqstatistics
-					p = seq1[ii].c_str();
-					q = seq2[ii].c_str();
-
-					j = seq1[ii].size();
-					if( j > cycle )
-						j = cycle;
-					for( i=0; i!=j; ++i ) {
-						switch ( p[i] ) {
-							case 'a':
-							case 'A': R1stat[tn][i].A ++; break;
-							case 'c':
-							case 'C': R1stat[tn][i].C ++; break;
-							case 'g':
-							case 'G': R1stat[tn][i].G ++; break;
-							case 't':
-							case 'T': R1stat[tn][i].T ++; break;
-							default : R1stat[tn][i].N ++; break;
-						}
-					}
-					j = seq2[ii].size();
-					if( j > cycle )
-						j = cycle;
-					for( i=0; i!=j; ++i ) {
-						switch ( q[i] ) {
-							case 'a':
-							case 'A': R2stat[tn][i].A ++; break;
-							case 'c':
-							case 'C': R2stat[tn][i].C ++; break;
-							case 'g':
-							case 'G': R2stat[tn][i].G ++; break;
-							case 't':
-							case 'T': R2stat[tn][i].T ++; break;
-							default : R2stat[tn][i].N ++; break;
-						}
-					}
-
-					// quality control
-					p = qual1[ii].c_str();
-					q = qual2[ii].c_str();
-					for( i=qual1[ii].length()-1; i; --i ) {
-						if( p[i]>=quality && q[i]>=quality ) break;
-					}
-					++ i;
-					if( i < min_length ) { // not long enough
-						++ dropped[ tn ];
-						continue;
-					}
-					seq1[ii].resize(  i );
-					seq2[ii].resize(  i );
-					qual1[ii].resize( i );
-					qual2[ii].resize( i );
-
-					// looking for seed target, 1 mismatch is allowed for these 2 seeds
-					// which means seq1 and seq2 at least should take 1 perfect seed match
-					seed.clear();
-					for( i=0; (i=seq1[ii].find(ai->adapter_index, i)) != string::npos; ++i )
-						seed.push_back( i );
-					for( i=0; (i=seq2[ii].find(ai->adapter_index, i)) != string::npos; ++i )
-						seed.push_back( i );
-
-					sort( seed.begin(), seed.end() );
-
-					last_seed = impossible_seed;	// a position which cannot be in seed
-					for( it=seed.begin(); it!=seed.end(); ++it ) {
-						if( *it != last_seed ) {
-						// as there maybe the same value in seq1_seed and seq2_seed,
-						// use this to avoid re-calculate that pos
-							if( check_mismatch_dynamic_PE( seq1[ii], seq2[ii], *it, ai) )
-								break;
-							last_seed = *it;
-						}
-					}
-					if( it != seed.end() ) {	// adapter found
-						++ real_adapter[tn];
-						if( *it >= min_length )	{
-							seq1[ii].resize(  *it );
-							seq2[ii].resize(  *it );
-							qual1[ii].resize( *it );
-							qual2[ii].resize( *it );
-						} else {	// drop this read as its length is not enough
-							++ dropped[tn];
-							continue;
-						}
-					} else {	// seed not found, now check the tail 2 or 1, if perfect match, drop these 2
-						i = seq1[ii].length() - 2;
-						p = seq1[ii].c_str();
-						q = seq2[ii].c_str();
-						if( p[i]==ai->adapter_r1[0] && p[i+1]==ai->adapter_r1[1] &&
-									q[i]==ai->adapter_r2[0] && q[i+1]==ai->adapter_r2[1] ) {
-							// if it is a real adapter, then Read1 and Read2 should be complimentary
-							// in real data, the heading 5 bp are usually of poor quality, therefore we test the 6th, 7th
-							if( is_revcomp(p[5], q[i-6]) && is_revcomp(q[5], p[i-6]) ) {
-								if( i < min_length ) {
-									++ dropped[tn];
-									continue;
-								}
-								seq1[ii].resize( i );
-								seq2[ii].resize( i );
-								qual1[ii].resize( i );
-								qual2[ii].resize( i );
-
-								++ tail_adapter[tn];
-							}
-						} else {	// tail 2 is not good, check tail 1
-							++ i;
-							if( p[i] == ai->adapter_r1[0] && q[i] == ai->adapter_r2[0] ) {
-								if(is_revcomp(p[5], q[i-6]) && is_revcomp(q[5], p[i-6]) &&
-										is_revcomp(p[6], q[i-7]) && is_revcomp(q[6], p[i-7]) ) {
-									if( i < min_length ) {
-										++ dropped[tn];
-										continue;
-									}
-									seq1[ii].resize(  i );
-									seq2[ii].resize(  i );
-									qual1[ii].resize( i );
-									qual2[ii].resize( i );
-
-									++ tail_adapter[tn];
-								}
-							}
-						}
-					}
-
-					//check if there is any white space in the IDs; if so, remove all the data after the whitespace
-					j = id1[ii].size();
-					p = id1[ii].c_str();
-					for( i=1; i!=j; ++i ) {
-						if( p[i]==' ' || p[i]=='\t' ) {	// white space, then trim ID
-							id1[ii].resize( i );
-							break;
-						}
-					}
-					j = id2[ii].size();
-					q = id2[ii].c_str();
-					for( i=0; i!=j; ++i ) {
-						if( q[i]==' ' || q[i]=='\t' ) {	// white space, then trim ID
-							id2[ii].resize( i );
-							break;
-						}
-					}
-
-					// do C->T and G->A conversion
-					if( mode == 0 ) {	// no need to do conversion
-						/*
-						fout1 << id1 << '\n' << seq1 << "\n+\n" << qual1 << '\n';
-						fout2 << id2 << '\n' << seq2 << "\n+\n" << qual2 << '\n';
-						*/
-						b1stored[tn] += sprintf( buffer1[tn]+b1stored[tn], "%s\n%s\n+\n%s\n",
-									id1[ii].c_str(), seq1[ii].c_str(), qual1[ii].c_str() );
-						b2stored[tn] += sprintf( buffer2[tn]+b2stored[tn], "%s\n%s\n+\n%s\n",
-									id2[ii].c_str(), seq2[ii].c_str(), qual2[ii].c_str() );
-					} else if( mode == 3 ) {	// in this implementation, id1 and id2 are different!!!
-						// modify id1 to add line number (to facilitate removing ambigous step)
-						// in mode 3, there is NO endC and frontG issues
-						id1[ii][0] = CONVERSION_LOG_END;
-						j = seq1[ii].size();	// seq1 and seq2 are of the same size
-						conversionLog = LINE_NUMBER_SEPARATOR;
-						for( i=0; i!=j; ++i ) {
-							if( seq1[ii][i] == 'C' ) {
-								seq1[ii][i] = 'T';
-								sprintf( numstr, "%x%c", i, CONVERSION_LOG_SEPARATOR );
-								conversionLog += numstr;
-							}
-						}
-						if( conversionLog.back() == CONVERSION_LOG_SEPARATOR )
-							conversionLog.pop_back();
-						/*fout1 << NORMAL_SEQNAME_START << line << conversionLog << id1 << '\n'
-								<< seq1 << "\n+\n" << qual1 << '\n';*/
-						b1stored[tn] += sprintf( buffer1[tn]+b1stored[tn], "%c%x%s%s\n%s\n+\n%s\n",
-													NORMAL_SEQNAME_START, line+ii, conversionLog.c_str(),
-													id1[ii].c_str(), seq1[ii].c_str(), qual1[ii].c_str() );
-
-						id2[ii][0] = CONVERSION_LOG_END;
-						conversionLog = NORMAL_SEQNAME_START;	// read2 does not record line number
-						for( i=0; i!=j; ++i ) {
-							if( seq2[ii][i] == 'G' ) {
-								seq2[ii][i] = 'A';
-								sprintf( numstr, "%x%c", i, CONVERSION_LOG_SEPARATOR );
-								conversionLog += numstr;
-							}
-						}
-						if( conversionLog.back() == CONVERSION_LOG_SEPARATOR )
-							conversionLog.pop_back();
-						// do not add line number to read 2
-						/*fout2 << conversionLog << id2 << '\n' << seq2 << "\n+\n" << qual2 << '\n';*/
-						b2stored[tn] += sprintf( buffer2[tn]+b2stored[tn], "%s%s\n%s\n+\n%s\n",
-							conversionLog.c_str(), id2[ii].c_str(), seq2[ii].c_str(), qual2[ii].c_str() );
-					} else if ( mode == 4 ) {	// this is the major task for EMaligner
-						// modify id1 to add line number (to facilitate the removing ambigous step)
-						// check seq1 for C>T conversion
-						id1[ii][0] = CONVERSION_LOG_END;
-						conversionLog = LINE_NUMBER_SEPARATOR;
-						j = seq1[ii].size()-1;
-						if( seq1[ii].back() == 'C' ) { //ther is a 'C' and the end, discard it (but record its Quality score);
-							//otherwise it may introduce a mismatch in alignment
-							conversionLog += qual1[ii].back();
-							conversionLog += KEEP_QUAL_MARKER;
-							seq1[ii].pop_back();
-							qual1[ii].pop_back();
-						}
-						for( i=0; i!=j; ++i ) {
-							if( seq1[ii][i]=='C' && seq1[ii][i+1]=='G' ) {
-								seq1[ii][i] = 'T';
-								sprintf( numstr, "%x%c", i, CONVERSION_LOG_SEPARATOR );
-								conversionLog += numstr;
-							}
-						}
-						if( conversionLog.back() == CONVERSION_LOG_SEPARATOR )
-							conversionLog.pop_back();
-						/*fout1 << NORMAL_SEQNAME_START << line << conversionLog << id1 << '\n'
-								<< seq1 << "\n+\n" << qual1 << '\n';*/
-						b1stored[tn] += sprintf( buffer1[tn]+b1stored[tn], "%c%x%s%s\n%s\n+\n%s\n",
-									NORMAL_SEQNAME_START, line+ii, conversionLog.c_str(),
-									id1[ii].c_str(), seq1[ii].c_str(), qual1[ii].c_str() );
-						// format for ID1:
-						// if there is a C at the end
-						//	@line_number '+' x| C1;C2;C3$ raw_seq_name
-						//	the | is the marker for the existence of tail 'C' and 'x' is its quality score
-						//	if exists, | is ALWAYS two bytes after '+' (use this to test its existence)
-						// if there is No C at the end
-						//	@line_number '+' C1&C2&C3$ raw_seq_name
-						//
-						// All the numbers in line_number and C1,C2,C3... are HEX
-
-						// check seq2 for G>A conversion
-						id2[ii][0] = CONVERSION_LOG_END;
-						conversionLog = NORMAL_SEQNAME_START;
-						if( seq2[ii][0] == 'G' ) { //'G' at the front, discard it (but record its Quality score)
-							conversionLog += qual2[ii][0];
-							conversionLog += KEEP_QUAL_MARKER;
-						}
-						j = seq2[ii].size();
-						for( i=1; i!=j; ++i ) {
-							if( seq2[ii][i]=='G' && seq2[ii][i-1]=='C' ) {
-								seq2[ii][i] = 'A';
-								sprintf( numstr, "%x%c", i, CONVERSION_LOG_SEPARATOR );
-								conversionLog += numstr;
-							}
-						}
-						if( conversionLog.back() == CONVERSION_LOG_SEPARATOR )
-							conversionLog.pop_back();
-						if( seq2[ii][0] != 'G' ) {
-							/*fout2 << conversionLog << id2 << '\n' << seq2 << "\n+\n" << qual2 << '\n';*/
-							b2stored[tn] += sprintf( buffer2[tn]+b2stored[tn], "%s%s\n%s\n+\n%s\n",
-											conversionLog.c_str(), id2[ii].c_str(), seq2[ii].c_str(), qual2[ii].c_str() );
-						} else {
-							p = seq2[ii].c_str();
-							q = qual2[ii].c_str();
-							/*fout2 << conversionLog << id2 << '\n' << p+1 << "\n+\n" << q+1 << '\n';*/
-							b2stored[tn] += sprintf( buffer2[tn]+b2stored[tn], "%s%s\n%s\n+\n%s\n",
-													conversionLog.c_str(), id2[ii].c_str(), p+1, q+1 );
-						}
-						// format for ID2:
-						// if there is a G at the front
-						//	@x| C1&C2&C3$ raw_seq_name
-						//	if exists, | is ALWAYS two bytes after '@' (use this to test its existence)
-						// if there is No G at the front
-						//	@C1&C2&C3$ raw_seq_name
-						//
-						// All the numbers in line_number and C1,C2,C3... are HEX
-					}
+				prev.b1stored[tn] = 0;
+				prev.b2stored[tn] = 0;
+				if( tn == 0 )
+					prev.processed = loaded;
+				if( sidecar ) {
+					prev.b3stored[tn] = 0;
+					memset( prev.reclen+start, 0, (end-start)*sizeof(unsigned int) );
 				}
-			}	// parallel body
-			// write output and update fastq statistics
-			for(register unsigned int i=0; i!=thread; ++i ) {
-				fout1 << buffer1[i];
-			}
-			for(register unsigned int i=0; i!=thread; ++i ) {
-				fout2 << buffer2[i];
-			}
 
-			for(register unsigned int i=0; i!=thread; ++i ) {
-				for( unsigned int j=0; j!=cycle; ++j ) {
-					AllR1stat[j].A += R1stat[i][j].A;
-					AllR1stat[j].C += R1stat[i][j].C;
-					AllR1stat[j].G += R1stat[i][j].G;
-					AllR1stat[j].T += R1stat[i][j].T;
-					AllR1stat[j].N += R1stat[i][j].N;
-
-					AllR2stat[j].A += R2stat[i][j].A;
-					AllR2stat[j].C += R2stat[i][j].C;
-					AllR2stat[j].G += R2stat[i][j].G;
-					AllR2stat[j].T += R2stat[i][j].T;
-					AllR2stat[j].N += R2stat[i][j].N;
-				}
+				trim( prev, tn, start, end, tp, ts[tn] );
 			}
-			line += loaded;
-			cerr << '\r' << line-1 << " reads loaded";
 
-			if( file_is_gz ) {
-				if( gzeof( gfp1 ) ) break;
-			} else {
-				if( fq1.eof() ) break;
+			#pragma omp barrier
+			// stop if all the batches have been written, or read1 and read2 are not paired
+			bool stop = ( curr.loaded==0 && prev.loaded==0 );
+			if( curr.loaded != curr.loaded2 ) {
+				stop = true;
+				if( tid == 0 )
+					unpaired = true;
 			}
-		}	//load and process file loop
-
-		if( file_is_gz ) {
-			gzclose( gfp1 );
-			gzclose( gfp2 );
-		} else {
-			fq1.close();
-			fq2.close();
+			#pragma omp barrier
+			if( stop ) break;
 		}
+	}	// parallel body
+
+	// update fastq statistics
+	for(register unsigned int i=0; i!=thread; ++i ) {
+		reduce_base_stat( ts[i].R1stat, AllR1stat );
+		reduce_base_stat( ts[i].R2stat, AllR2stat );
+	}
+	close_file( in1 );
+	close_file( in2 );
+
+	if( in1.error || in2.error ) {
+		cerr << "\nError: loading fastq files failed!\n";
+		fout1.close();
+		fout2.close();
+		return 11;
+	}
+	if( unpaired ) {
+		cerr << "\nFatal error: Read1 and Read2 do not contain the same number of reads!\n";
+		fout1.close();
+		fout2.close();
+		return 12;
 	}
 
 	fout1.close();
 	fout2.close();
+	if( sidecar ) {
+		fout3.close();
+		fidx.close();
+		delete [] sidx;
+	}
 	cerr << "\rDone: " << line-1 << " lines processed.\n";
 
 	// write trim.log
@@ -706,9 +776,9 @@ int main( int argc, const char *argv[] ) {
 	}
 	int dropped_all=0, real_all=0, tail_all=0;
 	for( unsigned int i=0; i!=thread; ++i ) {
-		dropped_all += dropped[i];
-		real_all += real_adapter[i];
-		tail_all += tail_adapter[i];
+		dropped_all += ts[i].dropped;
+		real_all += ts[i].real_adapter;
+		tail_all += ts[i].tail_adapter;
 	}
 	fout << line << '\n'	// total
 		 << "Dropped : " << dropped_all << '\n'
@@ -742,20 +812,15 @@ int main( int argc, const char *argv[] ) {
 	fout.close();
 
 	//free memory
-	delete [] gz_buffer;
-	for(unsigned int i=0; i!=thread; ++i) {
-		delete buffer1[i];
-		delete buffer2[i];
-		delete R1stat[i];
-		delete R2stat[i];
-	}
-	delete [] buffer1;
-	delete [] buffer2;
-	delete [] R1stat;
-	delete [] R2stat;
+	free_fq_input( in1 );
+	free_fq_input( in2 );
+	free_batch( batch[0], thread );
+	free_batch( batch[1], thread );
+	for(unsigned int i=0; i!=thread; ++i)
+		free_trim_space( ts[i] );
+	delete [] ts;
 	delete [] AllR1stat;
 	delete [] AllR2stat;
 
 	return 0;
-}
-
+}
\ No newline at end of file
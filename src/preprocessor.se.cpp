@@ -9,6 +9,10 @@
 #include <memory.h>
 #include <omp.h>
 #include "common.h"
+#include "fqreader.h"
+#include "trim.kernel.h"
+#include "convert.kernel.h"
+#include "sidecar.h"
 
 using namespace std;
 
@@ -31,36 +35,266 @@ using namespace std;
  *       it to the output files after the multi-thread trimming/conversion
 **/
 
+char inline * append( char *o, const char *s, unsigned int len ) {
+	memcpy( o, s, len );
+	return o + len;
+}
+
+// write '\n' seq "\n+\n" qual '\n' (the ID is written by the caller)
+char inline * write_read( char *o, const char *seq, const char *qual, unsigned int seqLen, unsigned int qualLen ) {
+	*o = '\n';
+	o = append( o+1, seq, seqLen );
+	o[0] = '\n';
+	o[1] = '+';
+	o[2] = '\n';
+	o = append( o+3, qual, qualLen );
+	*o = '\n';
+	return o + 1;
+}
+
+// write '\n' seq '\n' for the FASTA output used with sidecar (the ID is written by the caller)
+char inline * write_fasta_read( char *o, const char *seq, unsigned int seqLen ) {
+	*o = '\n';
+	o = append( o+1, seq, seqLen );
+	*o = '\n';
+	return o + 1;
+}
+
+// write the head of ID in mode 3 and 4: @LINE_NUMBER (or >LINE_NUMBER in FASTA)
+char inline * write_id_head( char *o, char start, unsigned int line ) {
+	*o = start;
+	return write_hex( o+1, line );
+}
+
+// write the rest of ID in mode 3 and 4: conversionLog # raw_seq_name
+char inline * write_id_tail( char *o, const unsigned int *bits, unsigned int len, const char *id, unsigned int idLen ) {
+	o = write_conversion_log( o, bits, len );
+	*o = CONVERSION_LOG_END;
+	return append( o+1, id+1, idLen-1 );
+}
+
+// one batch of reads together with the per-thread output buffers
+typedef struct {
+	fq_record *reads;
+	unsigned int line;		// line number of the first read in this batch
+	char **buffer1;
+	int  *b1stored;
+	// sidecar records (if enabled) and their sizes per read (0 for dropped reads)
+	char **buffer3;
+	int  *b3stored;
+	unsigned int *reclen;
+} se_batch;
+
+// parameters shared by all the trimming threads
+typedef struct {
+	unsigned int min_length;
+	unsigned char quality;
+	bool sidecar;
+	adapter_kernel ak;
+} trim_param;
+
+// working space and counters of one trimming thread
+typedef struct {
+	char *scratch;	// the converted sequence
+	unsigned int *convbits;	// the converted positions
+	char *pad1, *qpad1;	// padded read and quality for the kernels
+	base_stat R1stat;
+	int dropped, real_adapter, tail_adapter;
+} trim_space;
+
+void init_trim_space( trim_space & ts, unsigned int cycle ) {
+	ts.scratch  = new char [ cycle+READ_PADDING ];
+	ts.convbits = new unsigned int [ conversion_words(cycle) ];
+	ts.pad1  = new char [ cycle+READ_PADDING ];
+	ts.qpad1 = new char [ cycle+READ_PADDING ];
+	init_base_stat( ts.R1stat, cycle );
+	ts.dropped = 0;
+	ts.real_adapter = 0;
+	ts.tail_adapter = 0;
+}
+
+void free_trim_space( trim_space & ts ) {
+	delete [] ts.scratch;
+	delete [] ts.convbits;
+	delete [] ts.pad1;
+	delete [] ts.qpad1;
+	free_base_stat( ts.R1stat );
+}
+
 /*
- * use dynamic max_mismatch as the covered size can range from 3 to a large number such as 50,
- * so use static values (e.g., 4) is not good
+ * trimming and conversion of the reads [start, end) in one batch by thread tn
+ * the run mode and the adapter kit are template parameters, so the per-read branches on them
+ * are resolved at compile time (see select_trimmer for the dispatching)
 */
-bool check_mismatch_dynamic_SE( const string & s, unsigned int pos, const adapter_info* ai ) {
-	register unsigned int mis=0;
-	register unsigned int i, len;
-	len = s.length() - pos;
-	if( len > ai->adapter_len )
-	  len = ai->adapter_len;
-	register unsigned int max_mismatch_dynamic = len >> 2;
-	if( (max_mismatch_dynamic<<2) != len )
-	  ++ max_mismatch_dynamic;
-	const char * p = s.c_str();
-	for( i=0; i!=len; ++i ) {
-		if( p[pos+i] != ai->adapter_r1[i] ) {
-			++ mis;
-			if( mis > max_mismatch_dynamic )
-			  return false;
+template <unsigned int MODE, class KIT>
+void trim_batch( se_batch & b, unsigned int tn, unsigned int start, unsigned int end,
+					const trim_param & tp, trim_space & ts ) {
+	fq_record *reads = b.reads;
+	char **buffer1 = b.buffer1;
+	int  *b1stored = b.b1stored;
+	char **buffer3 = b.buffer3;
+	int  *b3stored = b.b3stored;
+	unsigned int *reclen = b.reclen;
+	unsigned int line = b.line;
+	bool sidecar = tp.sidecar;
+
+	register int i, j;
+	const char *p;
+	char *scratch = ts.scratch;
+	unsigned int *convbits = ts.convbits;
+	char *pad1  = ts.pad1;
+	char *qpad1 = ts.qpad1;
+	char *o, *s;
+	unsigned char flags;	// endC
+	char qEnd;
+
+	for( unsigned int ii=start; ii!=end; ++ii ) {
+		fq_record & r1 = reads[ii];
+
+		// fqstatistics and quality control in one pass
+		pad_read( pad1,  r1.seq,  r1.seqLen );
+		pad_read( qpad1, r1.qual, r1.qualLen );
+		i = scan_read_SE( ts.R1stat, pad1, qpad1, r1.seqLen, r1.qualLen, tp.quality );
+		if( i < tp.min_length ) { // not long enough
+			++ ts.dropped;
+			continue;
 		}
+		r1.seqLen  = i;
+		r1.qualLen = i;
+
+		// looking for seed target, 1 mismatch is allowed for these 2 seeds
+		// which means seq1 and seq2 at least should take 1 perfect seed match
+		// the padded read is still valid as it is only shortened
+		i = find_adapter_SE<KIT>( pad1, r1.seqLen, tp.ak );
+		if( i != -1 ) {	// adapter found
+			++ ts.real_adapter;
+			if( i >= tp.min_length )	{
+				r1.seqLen  = i;
+				r1.qualLen = i;
+			} else {	// drop this read as its length is not enough
+				++ ts.dropped;
+				continue;
+			}
+		} else {	// seed not found, now check the tail 2 or 1, if perfect match, drop these 2
+			i = r1.seqLen - 2;
+			p = r1.seq;
+			if( p[i]==KIT::r1_0 && p[i+1]==KIT::r1_1 ) {
+				if( i < tp.min_length ) {
+					++ ts.dropped;
+					continue;
+				}
+				r1.seqLen  = i;
+				r1.qualLen = i;
+
+				++ ts.tail_adapter;
+/*//maybe it is not that good to check tail-1?
+			} else {	// tail 2 is not good, check tail 1
+				++ i;
+				if( p[i] == KIT::r1_0 ) {
+					if( i < tp.min_length ) {
+						++ ts.dropped;
+						continue;
+					}
+					r1.seqLen  = i;
+					r1.qualLen = i;
+
+					++ ts.tail_adapter;
+				}
+*/
+			}
+		}
+
+		//check if there is any white space in the IDs; if so, remove all the data after the whitespace
+		j = r1.idLen;
+		p = r1.id;
+		for( i=1; i!=j; ++i ) {
+			if( p[i]==' ' || p[i]=='\t' ) {	// white space, then trim ID
+				r1.idLen = i;
+				break;
+			}
+		}
+
+		// do C->T and G->A conversion
+		// the converted sequence is written into the output buffer directly
+		o = buffer1[tn] + b1stored[tn];
+		if( MODE == 0 ) {	// no need to do conversion
+			o = append( o, r1.id, r1.idLen );
+			o = write_read( o, r1.seq, r1.qual, r1.seqLen, r1.qualLen );
+		} else {	// mode 3 and 4
+			flags = 0;
+			qEnd  = 0;
+			if( MODE == 3 ) {	// in mode 3, there is NO endC and frontG issues
+				j = r1.seqLen;
+				convert_read<'C', 'T', 0, 0>( scratch, pad1, j, convbits );
+			} else {	// mode 4, this is the major task for EMaligner
+				// check seq1 for C>T conversion in CpG context
+				p = r1.seq;
+				j = r1.seqLen-1;
+				if( p[j] == 'C' ) { //ther is a 'C' and the end, discard it (but record its Quality score);
+					//otherwise it may introduce a mismatch in alignment
+					flags |= SIDECAR_ENDC;
+					qEnd = r1.qual[ r1.qualLen-1 ];
+					-- r1.seqLen;
+					-- r1.qualLen;
+				}
+				convert_read<'C', 'T', 0, conversion_rule<MODE>::next1>( scratch, pad1, j, convbits );
+				scratch[j] = p[j];	// the last base is kept if it is not an endC
+			}
+
+			// modify id1 to add line number (to facilitate the removing ambigous step)
+			if( sidecar ) {
+				o = write_id_head( o, FASTA_SEQNAME_START, line+ii );
+				o = write_fasta_read( o, scratch, r1.seqLen );
+				s = buffer3[tn] + b3stored[tn];
+				reclen[ii] = write_sidecar_read( write_sidecar_head(s, flags, qEnd, 0), convbits, j,
+													r1.id+1, sam_name_length(r1.id+1, r1.idLen-1),
+													r1.qual, r1.qualLen ) - s;
+				b3stored[tn] += reclen[ii];
+			} else {
+				o = write_id_head( o, NORMAL_SEQNAME_START, line+ii );
+				*o++ = LINE_NUMBER_SEPARATOR;
+				if( flags & SIDECAR_ENDC ) {
+					o[0] = qEnd;
+					o[1] = KEEP_QUAL_MARKER;
+					o += 2;
+				}
+				o = write_id_tail( o, convbits, j, r1.id, r1.idLen );
+				o = write_read( o, scratch, r1.qual, r1.seqLen, r1.qualLen );
+			}
+			// format for ID1:
+			// if there is a C at the end
+			//	@line_number '+' x| C1;C2;C3$ raw_seq_name
+			//	the | is the marker for the existence of tail 'C' and 'x' is its quality score
+			//	if exists, | is ALWAYS two bytes after '+' (use this to test its existence)
+			// if there is No C at the end
+			//	@line_number '+' C1&C2&C3$ raw_seq_name
+			// if sidecar is used (FASTA)
+			//	>line_number
+			//
+			// All the numbers in line_number and C1,C2,C3... are HEX
+		}
+		b1stored[tn] = o - buffer1[tn];
 	}
+}
 
-	return true;
+typedef void (*se_trimmer)( se_batch &, unsigned int, unsigned int, unsigned int, const trim_param &, trim_space & );
+
+// dispatch the run mode once per run
+template <class KIT>
+se_trimmer select_trimmer( unsigned int mode ) {
+	if( mode == 0 )
+		return trim_batch<0, KIT>;
+	else if( mode == 3 )
+		return trim_batch<3, KIT>;
+	else
+		return trim_batch<4, KIT>;
 }
 
 
 int main( int argc, char *argv[] ) {
 	if( argc < 5 ) {
 		cerr << "\nUsage: " << argv[0] << " <r1.fq> <r2.fq=placeholder> <cycle> <out.prefix> "
-			 << "[mode=0|3|4] [thread=1] [min.length=36] [min.quality=53] [libraryKit=illumina]\n\n"
+			 << "[mode=0|3|4] [thread=1] [min.length=36] [min.quality=53] [libraryKit=illumina] [sidecar=0]\n\n"
 
 			 << "This program is part of Msuite and is designed to do fastq statistics, quality-trimming,\n"
 			 << "adapter-trimming and C->T/G->A conversions for Paired-End reads generated by illumina sequencers.\n\n"
@@ -73,7 +307,10 @@ int main( int argc, char *argv[] ) {
 			 << "Default parameters:\n"
 			 << "  mode: 0\n"
 			 << "  min.length: 36\n"
-			 << "  min.quality: 53 (33+20 for phred33('!') scoring system)\n\n"
+			 << "  min.quality: 53 (33+20 for phred33('!') scoring system)\n"
+			 << "  sidecar: 0 (set to 1 to write the conversion logs and read names into out.prefix.sidecar\n"
+			 << "           and the quality scores into out.prefix.sidecar, then the reads are written in\n"
+			 << "           FASTA format with only the line numbers as names; mode 3 and 4 only)\n\n"
 
 			 << "Other commonly used Phred scoring systems are 35('#') and 64('@').\n"
 			 << "You may need to set this parameter manually based on your data.\n\n"
@@ -97,8 +334,8 @@ int main( int argc, char *argv[] ) {
 	unsigned int  thread = 1;
 	unsigned int  min_length = 36;
 	unsigned char quality = 53;
-	const char *libraryKit;
-	const adapter_info* ai;
+	const char *libraryKit = "illumina";
+	bool sidecar = false;
 
 	unsigned int  cycle = atoi( argv[3] );
 	if( cycle == 0 ) {
@@ -115,6 +352,8 @@ int main( int argc, char *argv[] ) {
 					quality = (unsigned char) atoi( argv[8] );
 					if( argc > 9 ) {
 						libraryKit = argv[9];
+						if( argc > 10 )
+							sidecar = ( atoi(argv[10]) != 0 );
 					} else {
 						libraryKit = "illumina";
 					}
@@ -126,6 +365,10 @@ int main( int argc, char *argv[] ) {
 		cerr << "Error: invalid run mode! Must be 0, 3, or 4!\n";
 		return 100;
 	}
+	if( sidecar && mode == 0 ) {
+		cerr << "Error: sidecar is only supported in mode 3 and 4!\n";
+		return 104;
+	}
 	if( thread == 0 ) {
 		cerr << "Warning: thread is set to 0! I will use all threads instead.\n";
 		thread = omp_get_max_threads();
@@ -138,43 +381,65 @@ int main( int argc, char *argv[] ) {
 		cerr << "Error: invalid quality! Must be a positive number!\n";
 		return 102;
 	}
+	trim_param tp;
+	tp.min_length = min_length;
+	tp.quality = quality;
+	tp.sidecar = sidecar;
+
+	// the trimming/conversion function specialized for this run
+	se_trimmer trim;
 	if( strcmp(libraryKit, "illumina")==0 || strcmp(libraryKit, "Illumina")==0 ) {
-		ai = &illumina_adapter;
+		trim = select_trimmer<illumina_kit>( mode );
+		init_adapter_kernel<illumina_kit>( tp.ak );
 	} else if ( strcmp(libraryKit, "nextera")==0 || strcmp(libraryKit, "Nextera")==0 ) {
-		ai = &nextera_adapter;
-	} else if ( strcmp(libraryKit, "bgi")==0 || strcmp(libraryKit, "Nextera")==0 ) {
-		ai = &bgi_adapter;
+		trim = select_trimmer<nextera_kit>( mode );
+		init_adapter_kernel<nextera_kit>( tp.ak );
+	} else if ( strcmp(libraryKit, "bgi")==0 || strcmp(libraryKit, "BGI")==0 ) {
+		trim = select_trimmer<bgi_kit>( mode );
+		init_adapter_kernel<bgi_kit>( tp.ak );
 	} else {
 		cerr << "Error: invalid library kit! Currently only supports illumina and nextera!\n";
 		return 103;
 	}
 
-	ifstream fq1( argv[1] );
-	if( fq1.fail() ) {
+	// deal with multiple input files
+	fq_input in1;
+	init_fq_input( in1, argv[1], thread );
+	cout << "INFO: " << in1.files.size() << " fastq files will be loaded.\n";
+	omp_set_max_active_levels( 2 );	// the loader uses nested threads for decompression
+	if( ! open_next_file( in1 ) ) {
 		cerr << "Error: open fastq file failed!\n";
-		fq1.close();
 		return 2;
 	}
 	string base = argv[4];
-	base += ".R1.fq";
-	ofstream fout1( base.c_str() );
+	ofstream fout1( (base+".R1.fq").c_str() );
 	if( fout1.fail() ) {
 		cerr << "Error: write file failed!\n";
-		fq1.close();
+		free_fq_input( in1 );
 		return 3;
 	}
+	ofstream fout3, fidx;
+	unsigned long long *sidx = NULL;	// offsets of the sidecar records in one batch
+	unsigned long long sidecarSize = 0;
+	if( sidecar ) {
+		fout3.open( (base+".sidecar").c_str() );
+		fidx.open( (base+".sidecar.idx").c_str() );
+		if( fout3.fail() || fidx.fail() ) {
+			cerr << "Error: write sidecar file failed!\n";
+			free_fq_input( in1 );
+			return 3;
+		}
+		sidx = new unsigned long long [ READS_PER_BATCH ];
+		fidx.write( (char *)&sidecarSize, sizeof(unsigned long long) );	// line number starts from 1
+	}
 	// set HEX format number output
 	fout1.setf(ios::hex, ios::basefield);
 
-	string *id1   = new string [READS_PER_BATCH];
-	string *seq1  = new string [READS_PER_BATCH];
-	string *qual1 = new string [READS_PER_BATCH];
-	string unk;
+	fq_record *reads = new fq_record [READS_PER_BATCH];
+	fq_arena arena;	// only used for compressed input
+	init_arena( arena );
 
 	register unsigned int line = 1;
-	int *dropped	  = new int [thread];
-	int *real_adapter = new int [thread];
-	int *tail_adapter = new int [thread];
 
 	fastqstat * AllR1stat = new fastqstat[ cycle ];
 	memset( AllR1stat, 0, cycle*sizeof(fastqstat) );
@@ -182,40 +447,50 @@ int main( int argc, char *argv[] ) {
 	// buffer for storing the modified reads per thread
 	char ** buffer1 = new char * [thread];
 	int  * b1stored = new int	 [thread];
-	fastqstat **R1stat = new fastqstat * [thread];
+	// working space and statistics per thread
+	trim_space *ts = new trim_space [thread];
+	// sidecar records (if enabled) and their sizes per read (0 for dropped reads)
+	char ** buffer3 = NULL;
+	int  * b3stored = NULL;
+	unsigned int *reclen = NULL;
+	if( sidecar ) {
+		buffer3 = new char * [thread];
+		b3stored = new int [thread];
+		reclen = new unsigned int [READS_PER_BATCH];
+		for(unsigned int i=0; i!=thread; ++i)
+			buffer3[i] = new char[ BUFFER_SIZE_PER_BATCH_READ ];
+	}
 	for(unsigned int i=0; i!=thread; ++i) {
 		buffer1[i] = new char[ BUFFER_SIZE_PER_BATCH_READ ];
-		R1stat[i]  = new fastqstat [ cycle ];
-		dropped[i] = 0;
-		real_adapter[i] = 0;
-		tail_adapter[i] = 0;
+		init_trim_space( ts[i], cycle );
 	}
+	se_batch sb;
+	sb.reads	= reads;
+	sb.buffer1  = buffer1;
+	sb.b1stored = b1stored;
+	sb.buffer3  = buffer3;
+	sb.b3stored = b3stored;
+	sb.reclen   = reclen;
 
 	cerr << "Loading files ...\n";
 	while( true ) {
 		// get fastq reads
-		unsigned int loaded = 0;
-		while( true ) {
-			getline( fq1, id1  [ loaded ] );
-			if( fq1.eof() )break;
-			getline( fq1, seq1 [ loaded ] );
-			getline( fq1, unk );
-			getline( fq1, qual1[ loaded ] );
-
-			if( id1[loaded].size() > cycle ) {
-				id1[loaded].resize( cycle );
-				qual1[loaded].resize( cycle );
+		unsigned int loaded = load_reads( in1, reads, READS_PER_BATCH, arena );
+		//if the reads are longer than "cycle" paramater, only keep the head "cycle" ones
+		for( unsigned int i=0; i!=loaded; ++i ) {
+			if( reads[i].seqLen > cycle ) {
+				reads[i].seqLen  = cycle;
+				reads[i].qualLen = cycle;
 			}
-
-			++ loaded;
-			if( loaded == READS_PER_BATCH )
-				break;
+			if( reads[i].qualLen > cycle )	// malformed records only
+				reads[i].qualLen = cycle;
 		}
 		//cerr << "loaded: " << loaded << '\n';
 		if( loaded == 0 )
 			break;
 
 		// start parallalization
+		sb.line = line;
 		omp_set_num_threads( thread );
 		#pragma omp parallel
 		{
@@ -225,191 +500,42 @@ int main( int argc, char *argv[] ) {
 
 			// normalization
 			b1stored[tn] = 0;
-			memset( R1stat[tn], 0, cycle*sizeof(fastqstat) );
-		
-			string conversionLog;
-			register int i, j;
-			register unsigned int last_seed;
-			vector<unsigned int> seed;
-			vector<unsigned int> :: iterator it;
-			const char *p, *q;
-			char *conversion = new char [MAX_CONVERSION];
-			char numstr[10]; // enough to hold all numbers up to 99,999,999 plus ':'
-
-			for( unsigned int ii=start; ii!=end; ++ii ) {
-				// fqstatistics
-				p = seq1[ii].c_str();
-				j = seq1[ii].size();
-				if( j > cycle )
-					j = cycle;
-				for( i=0; i!=j; ++i ) {
-					switch ( p[i] ) {
-						case 'a':
-						case 'A': R1stat[tn][i].A ++; break;
-						case 'c':
-						case 'C': R1stat[tn][i].C ++; break;
-						case 'g':
-						case 'G': R1stat[tn][i].G ++; break;
-						case 't':
-						case 'T': R1stat[tn][i].T ++; break;
-						default : R1stat[tn][i].N ++; break;
-					}
-				}
-
-				// quality control
-				p = qual1[ii].c_str();
-				for( i=qual1[ii].length()-1; i; --i ) {
-					if( p[i] >= quality ) break;
-				}
-				++ i;
-				if( i < min_length ) { // not long enough
-					++ dropped[ tn ];
-					continue;
-				}
-				seq1[ii].resize(  i );
-				qual1[ii].resize( i );
-
-				// looking for seed target, 1 mismatch is allowed for these 2 seeds
-				// which means seq1 and seq2 at least should take 1 perfect seed match
-				seed.clear();
-				for( i=0; (i=seq1[ii].find(ai->adapter_index, i)) != string::npos; ++i )
-					seed.push_back( i );
-
-				last_seed = impossible_seed;	// a position which cannot be in seed
-				for( it=seed.begin(); it!=seed.end(); ++it ) {
-					if( check_mismatch_dynamic_SE(seq1[ii], *it, ai) )
-						break;
-				}
-				if( it != seed.end() ) {	// adapter found
-					++ real_adapter[tn];
-					if( *it >= min_length )	{
-						seq1[ii].resize(  *it );
-						qual1[ii].resize( *it );
-					} else {	// drop this read as its length is not enough
-						++ dropped[tn];
-						continue;
-					}
-				} else {	// seed not found, now check the tail 2 or 1, if perfect match, drop these 2
-					i = seq1[ii].length() - 2;
-					p = seq1[ii].c_str();
-					if( p[i]==ai->adapter_r1[0] && p[i+1]==ai->adapter_r1[1] ) {
-						if( i < min_length ) {
-							++ dropped[tn];
-							continue;
-						}
-						seq1[ii].resize(  i );
-						qual1[ii].resize( i );
-
-						++ tail_adapter[tn];
-/*//maybe it is not that good to check tail-1?
-					} else {	// tail 2 is not good, check tail 1
-						++ i;
-						if( p[i] == ai->adapter_r1[0] ) {
-							if( i < min_length ) {
-								++ dropped[tn];
-								continue;
-							}
-							seq1[ii].resize(  i );
-							qual1[ii].resize( i );
-
-							++ tail_adapter[tn];
-						}
-*/
-					}
-				}
-
-				//check if there is any white space in the IDs; if so, remove all the data after the whitespace
-				j = id1[ii].size();
-				p = id1[ii].c_str();
-				for( i=1; i!=j; ++i ) {
-					if( p[i]==' ' || p[i]=='\t' ) {	// white space, then trim ID
-						id1[ii].resize( i );
-						break;
-					}
-				}
-
-				// do C->T and G->A conversion
-				if( mode == 0 ) {	// no need to do conversion
-					b1stored[tn] += sprintf( buffer1[tn]+b1stored[tn], "%s\n%s\n+\n%s\n",
-								id1[ii].c_str(), seq1[ii].c_str(), qual1[ii].c_str() );
-				} else if( mode == 3 ) {	// in this implementation, id1 and id2 are different!!!
-					// modify id1 to add line number (to facilitate removing ambigous step)
-					// in mode 3, there is NO endC and frontG issues
-					id1[ii][0] = CONVERSION_LOG_END;
-					j = seq1[ii].size();	// seq1 and seq2 are of the same size
-					conversionLog = LINE_NUMBER_SEPARATOR;
-					for( i=0; i!=j; ++i ) {
-						if( seq1[ii][i] == 'C' ) {
-							seq1[ii][i] = 'T';
-							sprintf( numstr, "%x%c", i, CONVERSION_LOG_SEPARATOR );
-							conversionLog += numstr;
-						}
-					}
-					if( conversionLog.back() == CONVERSION_LOG_SEPARATOR )
-						conversionLog.pop_back();
-					/*fout1 << NORMAL_SEQNAME_START << line << conversionLog << id1 << '\n'
-							<< seq1 << "\n+\n" << qual1 << '\n';*/
-					b1stored[tn] += sprintf( buffer1[tn]+b1stored[tn], "%c%x%s%s\n%s\n+\n%s\n",
-												NORMAL_SEQNAME_START, line+ii, conversionLog.c_str(),
-												id1[ii].c_str(), seq1[ii].c_str(), qual1[ii].c_str() );
-				} else if ( mode == 4 ) {	// this is the major task for EMaligner
-					// modify id1 to add line number (to facilitate the removing ambigous step)
-					// check seq1 for C>T conversion
-					id1[ii][0] = CONVERSION_LOG_END;
-					conversionLog = LINE_NUMBER_SEPARATOR;
-					j = seq1[ii].size()-1;
-					if( seq1[ii].back() == 'C' ) { //ther is a 'C' and the end, discard it (but record its Quality score);
-						//otherwise it may introduce a mismatch in alignment
-						conversionLog += qual1[ii].back();
-						conversionLog += KEEP_QUAL_MARKER;
-						seq1[ii].pop_back();
-						qual1[ii].pop_back();
-					}
-					for( i=0; i!=j; ++i ) {
-						if( seq1[ii][i]=='C' && seq1[ii][i+1]=='G' ) {
-							seq1[ii][i] = 'T';
-							sprintf( numstr, "%x%c", i, CONVERSION_LOG_SEPARATOR );
-							conversionLog += numstr;
-						}
-					}
-					if( conversionLog.back() == CONVERSION_LOG_SEPARATOR )
-						conversionLog.pop_back();
-					/*fout1 << NORMAL_SEQNAME_START << line << conversionLog << id1 << '\n'
-							<< seq1 << "\n+\n" << qual1 << '\n';*/
-					b1stored[tn] += sprintf( buffer1[tn]+b1stored[tn], "%c%x%s%s\n%s\n+\n%s\n",
-								NORMAL_SEQNAME_START, line+ii, conversionLog.c_str(),
-								id1[ii].c_str(), seq1[ii].c_str(), qual1[ii].c_str() );
-					// format for ID1:
-					// if there is a C at the end
-					//	@line_number '+' x| C1;C2;C3$ raw_seq_name
-					//	the | is the marker for the existence of tail 'C' and 'x' is its quality score
-					//	if exists, | is ALWAYS two bytes after '+' (use this to test its existence)
-					// if there is No C at the end
-					//	@line_number '+' C1&C2&C3$ raw_seq_name
-					//
-					// All the numbers in line_number and C1,C2,C3... are HEX
-				}
+			if( sidecar ) {
+				b3stored[tn] = 0;
+				memset( reclen+start, 0, (end-start)*sizeof(unsigned int) );
 			}
+
+			trim( sb, tn, start, end, tp, ts[tn] );
 		}	// parallel body
 		// write output and update fastq statistics
 		for( unsigned int i=0; i!=thread; ++i ) {
-			fout1 << buffer1[i];
-
-			for( unsigned int j=0; j!=cycle; ++j ) {
-				AllR1stat[j].A += R1stat[i][j].A;
-				AllR1stat[j].C += R1stat[i][j].C;
-				AllR1stat[j].G += R1stat[i][j].G;
-				AllR1stat[j].T += R1stat[i][j].T;
-				AllR1stat[j].N += R1stat[i][j].N;
+			fout1.write( buffer1[i], b1stored[i] );
+			reduce_base_stat( ts[i].R1stat, AllR1stat );
+		}
+		if( sidecar ) {
+			for( unsigned int i=0; i!=thread; ++i )
+				fout3.write( buffer3[i], b3stored[i] );
+			for( unsigned int i=0; i!=loaded; ++i ) {
+				sidx[i] = sidecarSize;
+				sidecarSize += reclen[i];
 			}
+			fidx.write( (char *)sidx, loaded*sizeof(unsigned long long) );
 		}
 		line += loaded;
 		cerr << '\r' << line-1 << " reads loaded";
 
-		if( fq1.eof() )break;
+		if( ! in1.is_open )break;
 	}
-	fq1.close();
+	free_fq_input( in1 );
 	fout1.close();
+	if( sidecar ) {
+		fout3.close();
+		fidx.close();
+	}
+	if( in1.error ) {
+		cerr << "\nError: loading fastq files failed!\n";
+		return 11;
+	}
 
 	cerr << "\rDone: " << line-1 << " lines processed.\n";
 
@@ -421,9 +547,9 @@ int main( int argc, char *argv[] ) {
 	}
 	int dropped_all=0, real_all=0, tail_all=0;
 	for( unsigned int i=0; i!=thread; ++i ) {
-		dropped_all += dropped[i];
-		real_all += real_adapter[i];
-		tail_all += tail_adapter[i];
+		dropped_all += ts[i].dropped;
+		real_all += ts[i].real_adapter;
+		tail_all += ts[i].tail_adapter;
 	}
 	fout << line << '\n'	// total
 		 << "Dropped : " << dropped_all << '\n'
@@ -445,12 +571,22 @@ int main( int argc, char *argv[] ) {
 	fout.close();
 
 	//free memory
+	delete [] reads;
+	free_arena( arena );
 	for(unsigned int i=0; i!=thread; ++i) {
 		delete buffer1[i];
-		delete R1stat[i];
+		free_trim_space( ts[i] );
 	}
 	delete [] buffer1;
-	delete [] R1stat;
+	delete [] ts;
+	if( sidecar ) {
+		for(unsigned int i=0; i!=thread; ++i)
+			delete [] buffer3[i];
+		delete [] buffer3;
+		delete [] b3stored;
+		delete [] reclen;
+		delete [] sidx;
+	}
 	delete [] AllR1stat;
 
 	return 0;
@@ -0,0 +1,146 @@
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <omp.h>
+#include "common.h"
+#include "util.h"
+#include "bam.h"
+
+using namespace std;
+
+/*
+ * Author: Kun Sun (sunkun@szbl.ac.cn)
+ * This program is part of the Msuite package
+ * Date: Oct 2026
+ *
+ * Functions shared by rmdup.pe and rmdup.se for the 2-pass mode. The fragments are loaded in
+ * batches of keys (frag_key, either parsed from the SAM records or loaded from the keys written by
+ * bowtie2.processer); the keys of a batch are routed to their chromosomes and the chromosomes are
+ * processed by multiple threads. As each chromosome has its own table and its keys are processed
+ * in the original order, the results are the same as processing the keys one by one.
+ * The kept records are then copied from the SAM file by their offsets without being parsed again.
+**/
+
+#ifndef _MSUITE_RMDUP_
+#define _MSUITE_RMDUP_
+
+// per-chromosome index of a batch of keys
+typedef struct {
+	vector<unsigned int> start;	// keys of chromosome i are order[start[i], start[i+1])
+	vector<unsigned int> order;
+} rmdup_router;
+
+// key of the fragment in the hash table
+uint64_t inline rmdup_key( const frag_key & f, bool paired ) {
+	register uint64_t key = f.pos;
+	if( paired ) {
+		key <<= 32;
+		if( f.strand == FRAG_WATSON )
+			key |= f.fragSize;
+		else
+			key |= - f.fragSize;	// use negative values to mark the strand
+	} else {
+		key |= ( f.strand == FRAG_WATSON ) ? READS_CT : READS_GA;
+	}
+	return key;
+}
+
+/*
+ * mark the duplicates in keys[0, n), whose line numbers are firstLine, firstLine+1, ...
+ * the keys on unknown chromosomes are discarded; size (PE only) records the fragment sizes
+*/
+void inline dedup_batch( const frag_key *keys, unsigned int n, unsigned int firstLine, bool paired,
+						vector<frag_table> & tables, uint64_t *dup, uint64_t *discard, frag_size_t *size,
+						rmdup_router & rt, unsigned int thread ) {
+	register int chrNum = tables.size();
+
+	// count the keys of each chromosome then put their indices in order
+	rt.start.assign( chrNum+1, 0 );
+	rt.order.resize( n );
+	for( register unsigned int i=0; i!=n; ++i ) {
+		register int chr = keys[i].chr;
+		if( chr<0 || chr>=chrNum ) {
+			set_line_bit( discard, firstLine+i );
+			continue;
+		}
+		++ rt.start[ chr+1 ];
+		if( paired )
+			size[ firstLine+i ] = ( keys[i].fragSize < MAX_FRAG_SIZE ) ? keys[i].fragSize : MAX_FRAG_SIZE;
+	}
+	for( register int c=0; c!=chrNum; ++c )
+		rt.start[ c+1 ] += rt.start[ c ];
+	vector<unsigned int> fill( rt.start.begin(), rt.start.end()-1 );
+	for( register unsigned int i=0; i!=n; ++i ) {
+		register int chr = keys[i].chr;
+		if( chr>=0 && chr<chrNum )
+			rt.order[ fill[chr] ++ ] = i;
+	}
+
+	#pragma omp parallel for num_threads( thread ) schedule( dynamic, 1 )
+	for( int c=0; c<chrNum; ++c ) {
+		frag_table & t = tables[c];
+		for( register unsigned int j=rt.start[c]; j!=rt.start[c+1]; ++j ) {
+			register unsigned int i = rt.order[j];
+			register unsigned int d = mark_duplicate( t, rmdup_key(keys[i], paired), firstLine+i, keys[i].qual );
+			if( d != 0 ) {
+				if( thread > 1 )
+					set_line_bit_atomic( dup, d );
+				else
+					set_line_bit( dup, d );
+			}
+		}
+	}
+}
+
+// kept records that are not copied yet; adjacent ones are copied together
+typedef struct {
+	int fd;
+	const char *file;
+	uint64_t start, end;
+	string buf;
+} kept_run;
+
+bool inline open_kept_run( kept_run & run, const char *file ) {
+	run.fd = open( file, O_RDONLY );
+	if( run.fd < 0 ) {
+		cerr << "Error: could not open file '" << file << "'!\n";
+		return false;
+	}
+	run.file  = file;
+	run.start = run.end = 0;
+	return true;
+}
+
+// copy the records of the run to the output
+void inline flush_kept_run( kept_run & run, ofstream & fout, bam_writer *bw ) {
+	if( run.start == run.end )
+		return;
+	if( ! copy_sam_range(run.fd, run.start, run.end-run.start, fout, run.buf) ) {
+		cerr << "Error: could not read the records from '" << run.file << "'!\n";
+		exit( 1 );
+	}
+	if( bw != NULL )
+		bam_write_text( *bw, run.buf.data(), run.buf.size() );
+	run.start = run.end;
+}
+
+// add the kept record(s) at [offset, offset+length) of the SAM file
+void inline keep_record( kept_run & run, uint64_t offset, uint64_t length, ofstream & fout, bam_writer *bw ) {
+	if( offset!=run.end || run.end-run.start>=FRAG_COPY_BUFFER ) {
+		flush_kept_run( run, fout, bw );
+		run.start = run.end = offset;
+	}
+	run.end += length;
+}
+
+void inline close_kept_run( kept_run & run, ofstream & fout, bam_writer *bw ) {
+	flush_kept_run( run, fout, bw );
+	close( run.fd );
+	string().swap( run.buf );
+}
+
+#endif
@@ -2,14 +2,22 @@
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <vector>
 //#include <map>
 //#include <set>
 #include <tr1/unordered_map>
 #include <tr1/unordered_set>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <memory.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "common.h"
 #include "util.h"
+#include "bam.h"
+#include "rmdup.h"
+#include "rmdup.stream.h"
 
 using namespace std;
 using namespace std::tr1;
@@ -20,38 +28,96 @@ using namespace std::tr1;
  * Date: Dec 2019
 */
 
+// load a batch of read pairs and parse them into fragment keys by multiple threads
+// offset is the position of the next record in the SAM file
+static unsigned int load_sam_batch( ifstream & fin, vector<string> & lines, frag_key *keys,
+									const chr_dict & chrs, unsigned int thread, uint64_t & offset ) {
+	register unsigned int n = 0;
+	while( n != FRAG_KEYS_PER_BATCH ) {
+		getline( fin, lines[n*2] );
+		if( fin.eof() )break;
+		getline( fin, lines[n*2+1] );
+		keys[n].offset = offset;
+		keys[n].length = lines[n*2].size() + lines[n*2+1].size() + ( fin.eof() ? 1 : 2 );	// the last line may not end with '\n'
+		offset += keys[n].length;
+		++ n;
+	}
+
+	#pragma omp parallel num_threads( thread )
+	{
+		sam_view v1, v2;
+		string buf;
+		unsigned int pos1, pos2;
+		#pragma omp for schedule( static )
+		for( int i=0; i<(int)n; ++i ) {
+			//499780R1	83	chrX	14710827	42	67M	*	0	0	TCCCAATTCTAAATAGTT	HHHHHHHHHHHHHHHHH XG:Z:GA
+			//499780R2	163	chrX	14710378	42	67M	*	0	0	TAACATTTCTTTAATCAC	HHHHHHHH:;:987665 XG:Z:GA
+			const string & line = lines[i*2];
+			frag_key & f = keys[i];
+			sam_view_split( v1, line, SAM_TAGS );
+			sam_view_split( v2, lines[i*2+1], SAM_TAGS );
+			f.chr = find_chr( chrs, v1.start[SAM_RNAME], sam_view_length(v1, SAM_RNAME), buf );
+			if( f.chr < 0 )
+				continue;
+			pos1 = sam_view_int( v1, SAM_POS );
+			pos2 = sam_view_int( v2, SAM_POS );
+
+			if( line.back() == 'T' ) {	// XG:Z:CT, then pos1 < pos2, then locate the end using pos2 and cigar2
+				f.strand = FRAG_WATSON;
+				f.pos = pos1;
+				f.fragSize = pos2 + get_readLen_from_cigar( v2.start[SAM_CIGAR], sam_view_length(v2, SAM_CIGAR) ) - pos1;
+			} else {	//XG:Z:GA, then pos1 > pos2, then locate the end using pos1 and cigar1
+				f.strand = FRAG_CRICK;
+				f.pos = pos2;
+				f.fragSize = pos1 + get_readLen_from_cigar( v1.start[SAM_CIGAR], sam_view_length(v1, SAM_CIGAR) ) - pos2;
+			}
+			f.qual = sam_view_sum( v1, SAM_QUAL ) + sam_view_sum( v2, SAM_QUAL );
+		}
+	}
+	return n;
+}
+
+// add the size of a kept fragment to the distribution
+static void count_size( unsigned int *sizeCnt, unsigned int max_size, const frag_size_t *size, unsigned int line ) {
+	if( size[line] < max_size ) {
+		sizeCnt[ size[line] ] ++;
+	} else {	// the CIGAR makes the fragment longer than MAX_INSERT_SIZE !!!
+		cerr << "WARNING: Line " << line << " has an unacceptable size (" << size[line]
+				<< ") and will be ignored!\n";
+	}
+}
+
+static void too_many_records( const char *trimlog ) {
+	cerr << "Error: there are more records than the reads in '" << trimlog << "'!\n";
+	exit( 1 );
+}
 
 int main( int argc, char *argv[] ) {
-	if( argc != 6 ) {
-		cerr << "\nUsage: " << argv[0] << " <chr.info> <trim.log> <max.insert.size> <in.sam> <out.prefix>\n";
+	if( argc < 6 ) {
+		cerr << "\nUsage: " << argv[0] << " <chr.info> <trim.log> <max.insert.size> <in.sam> <out.prefix> [header.sam|null] [thread=1] [in.frag|null|sorted]\n";
 		cerr << "This program is designed to remove the duplicate reads that have the same start and end/strand.\n\n";
-		cerr << "Note that in v2, map is replaced by unordered_map.\n\n";
+		cerr << "If header.sam is given, out.prefix.bam is also written (with the given header, or the one\n"
+			 << "built from chr.info if it is null); thread is used to compress the BAM file, and to\n"
+			 << "parse the records and mark the duplicates of different chromosomes in parallel.\n"
+			 << "If in.frag (the fragment keys written by bowtie2.processer with chr.info) is given, the\n"
+			 << "duplicates are marked using it and in.sam is not parsed at all.\n"
+			 << "If it is 'sorted', in.sam must be a SAM (text) file sorted by coordinate (BAM is not supported),\n"
+			 << "and the duplicates are removed in one pass with a sliding window (trim.log is not used);\n"
+			 << "the reads whose mates are not within max.insert.size are discarded.\n\n";
 		return 1;
 	}
 
+	// coordinate-sorted input: remove the duplicates in one pass
+	if( argc>8 && strcmp(argv[8], "sorted")==0 )
+		return stream_rmdup( true, argv[1], atoi(argv[3]), argv[4], argv[5], argv[6], atoi(argv[7]) );
+
 	// loading info file
 //	cerr << "Loading genome.info ...\n";
-	unordered_map<string, unordered_map<uint64_t, fraghit> *> samRecord;
-	string line, chr;
-	stringstream ss;
-	ifstream fin( argv[1] );
-	if( fin.fail() ) {
-		cerr << "Error: could not open file '" << argv[1] << "'!\n";
+	chr_dict chrs;
+	if( ! load_chr_dict(argv[1], chrs) )
 		exit( 1 );
-	}
-	while( true ) {
-		getline( fin, line );
-		if( fin.eof() )break;
-
-		if( line[0] == '#' )continue;
-
-		ss.str( line );
-		ss.clear();
-		ss >> chr;
-//		cerr << "Adding " << chr << " ...\n";
-		samRecord.insert( pair<string, unordered_map<uint64_t, fraghit>*>(chr, new unordered_map<uint64_t, fraghit>()) );
-	}
-	fin.close();
+	string line;
+	ifstream fin;
 
 	// load trim.log
 //	cerr << "Preparing memory ...\n";
@@ -65,115 +131,66 @@ int main( int argc, char *argv[] ) {
 	fin.close();
 	readNum = atoi( line.c_str() );
 //	cerr << "Read number: " << line << " => " << readNum << '\n';
-	unsigned int * size = new unsigned int [ readNum ];	// this should be obtained from trim.log!!!
-	memset( size, 0, readNum*sizeof(unsigned int) );
-
-	// load sam file
-	unordered_map<string, unordered_map<uint64_t, fraghit> *> :: iterator sam_it;
-	unordered_map<string, unordered_map<uint64_t, fraghit> *> :: iterator no_such_chr = samRecord.end();
-	unordered_set<unsigned int> dup;
-	unordered_set<unsigned int> discard;
-	unordered_map<uint64_t, fraghit> :: iterator hit_it;
-	fraghit hit;
-
-	fin.open( argv[4] );
-	if( fin.fail() ) {
-		cerr << "Error: could not open file '" << argv[4] << "'!\n";
+	unsigned int max_size = atoi( argv[3] );
+	if( max_size == 0 ) {
+		cerr << "Error: Invalid maximum insert size!\n";
 		exit( 1 );
 	}
+	max_size ++;
+//	cerr << "Max insert: " << max_size << '\n';
+	frag_size_t * size = new frag_size_t [ readNum+1 ];	// line numbers start from 1
+	memset( size, 0, (readNum+1)*sizeof(frag_size_t) );
 
-	string line2, cigar1, cigar2, qual1, qual2, unk;
-	unsigned int pos1, pos2, fragSize;
-	uint64_t key;
-
-	unsigned int lineNum = 0;
-//	cerr << "Loading sam file ...\n";
-	while( true ) {
-		getline( fin, line );
-		if( fin.eof() )break;
-		getline( fin, line2 );
-		++ lineNum;
-//		if( ! (lineNum & 0x3fffff) ) {
-//			cerr << '\r' << lineNum << " lines loaded.";
-//		}
-
-		//499780R1	83	chrX	14710827	42	67M	*	0	0	TCCCAATTCTAAATAGTT	HHHHHHHHHHHHHHHHH XG:Z:GA
-		//499780R2	163	chrX	14710378	42	67M	*	0	0	TAACATTTCTTTAATCAC	HHHHHHHH:;:987665 XG:Z:GA
-
-		ss.str( line );
-		ss.clear();
-		ss >> unk >> unk >> chr >> pos1 >> unk >> cigar1 >> unk >> unk >> unk >> unk >> qual1;
-		ss.str( line2 );
-		ss.clear();
-		ss >> unk >> unk >> chr >> pos2 >> unk >> cigar2 >> unk >> unk >> unk >> unk >> qual2;
-
-//		fprintf( stderr, "Line %d, chr=%s, pos1=%u (0x%x), cigar1=%s, pos2=%u (0x%x), cigar2=%s\n",
-//					lineNum, chr.c_str(), pos1, pos1, cigar1.c_str(), pos2, pos2, cigar2.c_str() );
-
-		sam_it = samRecord.find( chr );
-		if( sam_it == no_such_chr ) {
-			discard.insert( lineNum );
-			continue;
-		}
-
-		if( line.back() == 'T' ) {	// XG:Z:CT, then pos1 < pos2, then locate the end using pos2 and cigar2
-			key = pos1;
-			key <<= 32;
-			int readLen = get_readLen_from_cigar( cigar2 );
-			fragSize = pos2 + readLen - pos1;
-			key |= fragSize;
-			size[ lineNum ] = fragSize;
-
-//			fprintf( stderr, "=>left=%d, right=%d, readLen=%d, fragSize=%u, key=0x%llx\n",
-//							pos1, pos2, readLen, fragSize, key );
-		} else {	//XG:Z:GA, then pos1 > pos2, then locate the end using pos1 and cigar1
-			key = pos2;
-			key <<= 32;
-			int readLen = get_readLen_from_cigar( cigar1 );
-			fragSize = pos1 + readLen - pos2;
-			key |= - fragSize;	// use negative values to mark the strand
-			size[ lineNum ] = fragSize;
+	// records of each chromosome, indexed by the chromosome ID
+	vector<frag_table> chrRecord;
+	init_frag_tables( chrRecord, chrs, readNum );
 
-//			fprintf( stderr, "=>left=%d, right=%d, readLen=%d, fragSize=%u, key=0x%llx\n",
-//							pos2, pos1, readLen, fragSize, key );
-		}
+	// load sam file
+	uint64_t *dup     = new_line_bits( readNum );
+	uint64_t *discard = new_line_bits( readNum );
 
-		register unsigned int score = 0;
-		const char * p = qual1.c_str();
-		register unsigned int i = 0;
-		register unsigned int readLen = qual1.size();
-		for( i=0; i != readLen; ++i ) {
-			score += p[i];
+	// fragment keys written by bowtie2.processer, the chromosomes are indexed as in chr.info
+	bool fragMode = ( argc>8 && strcmp(argv[8], "null")!=0 );
+	unsigned int thread = ( argc>7 && atoi(argv[7])>0 ) ? atoi(argv[7]) : 1;
+	FILE *fk = NULL;
+	frag_key *keys = new frag_key [ FRAG_KEYS_PER_BATCH ];
+	vector<string> lines;	// read pairs of a batch (text mode)
+	unsigned int *recLen = NULL;	// size of each read pair in the SAM file (text mode), indexed by line number
+	uint64_t samOffset = 0;
+	if( fragMode ) {
+		fk = fopen( argv[8], "rb" );
+		if( fk == NULL ) {
+			cerr << "Error: could not open file '" << argv[8] << "'!\n";
+			exit( 1 );
 		}
-		p = qual2.c_str();
-		readLen = qual2.size();
-		for( i=0; i != readLen; ++i ) {
-			score += p[i];
+	} else {
+		fin.open( argv[4] );
+		if( fin.fail() ) {
+			cerr << "Error: could not open file '" << argv[4] << "'!\n";
+			exit( 1 );
 		}
+		lines.resize( FRAG_KEYS_PER_BATCH*2 );
+		recLen = new unsigned int [ readNum+1 ];
+	}
 
-		hit_it = sam_it->second->find( key );
-		if( hit_it != sam_it->second->end() ) {	// there must be a duplicate
-			if( hit_it->second.score >= score ) {	// the previous one is better, mark this one as duplicate
-				dup.insert( lineNum );
-//				cerr << "Line " << lineNum << " meet a duplicate at line " << hit_it->second.lineNum
-//					 << " and the other one is better.\n";
-			} else {	// this one is better, then mark the previous one as duplicate and update the record
-//				cerr << "Line " << lineNum << " meet a duplicate at line " << hit_it->second.lineNum
-//					 << " but this one is better.\n";
-				dup.insert( hit_it->second.lineNum );
-				hit_it->second.lineNum = lineNum;
-				hit_it->second.score = score;
-			}
-		} else {	// no such record, add this one
-			hit.lineNum = lineNum;
-			hit.score = score;
-			sam_it->second->insert( pair<uint64_t, fraghit>( key, hit ) );
-//			cerr << "Line " << lineNum << " is new.\n";
+	rmdup_router rt;
+	unsigned int lineNum = 0;
+//	cerr << "Loading sam file ...\n";
+	while( true ) {
+		unsigned int loaded = fragMode ? fread( keys, sizeof(frag_key), FRAG_KEYS_PER_BATCH, fk )
+									   : load_sam_batch( fin, lines, keys, chrs, thread, samOffset );
+		if( loaded == 0 ) break;
+		if( lineNum+loaded > readNum )
+			too_many_records( argv[2] );
+		if( ! fragMode ) {
+			for( register unsigned int i=0; i!=loaded; ++i )
+				recLen[ lineNum+1+i ] = keys[i].length;
 		}
+		dedup_batch( keys, loaded, lineNum+1, true, chrRecord, dup, discard, size, rt, thread );
+		lineNum += loaded;
+//		cerr << '\r' << lineNum << " lines loaded.";
 	}
-//	cerr << "\rDone: " << lineNum << " lines loaded, dup=" << dup.size() << ", discard=" << discard.size() << ".\n";
 
-//	cerr << "Writing output ...\n";
 	// prepare output file
 	char * outfile = new char [ MAX_FILE_NAME ];
 	sprintf( outfile, "%s.sam", argv[5] );
@@ -182,31 +199,57 @@ int main( int argc, char *argv[] ) {
 		cerr << "Error: could not write output SAM file!\n";
 		exit( 1 );
 	}
-	// rewind sam file
-	fin.clear();
-	fin.seekg( ios_base::beg );
-	lineNum = 0;
-	unordered_set<unsigned int> :: iterator non_dup = dup.end();
-	unordered_set<unsigned int> :: iterator non_discard = discard.end();
-	unsigned int unique=0;
-	while( true ) {
-		getline( fin, line );
-		if( fin.eof() )break;
-		getline( fin, line2 );
-		++ lineNum;
-//		if( ! (lineNum & 0x3fffff) ) {
-//			cerr << '\r' << lineNum << " lines loaded.";
-//		}
+	bam_writer bw;
+	bool bam = ( argc > 6 );
+	if( bam ) {
+		sprintf( outfile, "%s.bam", argv[5] );
+		if( ! open_bam_writer(bw, outfile, argv[1], argv[6], thread) )
+			exit( 1 );
+	}
+	if( ! fragMode ) {
+		vector<string>().swap( lines );
+		fin.close();
+	}
 
-		if( discard.find(lineNum)==non_discard && dup.find(lineNum)==non_dup ) {
-			fout << line << '\n' << line2 << '\n';
+	// the kept records are copied by their offsets in the SAM file and their sizes are counted
+	unsigned int unique=0;
+	unsigned int * sizeCnt = new unsigned int [ max_size ];
+	for( register unsigned int i=0; i!=max_size; ++i )
+		sizeCnt[i] = 0;
+	kept_run run;
+	if( ! open_kept_run(run, argv[4]) )
+		exit( 1 );
+	if( fragMode ) {
+		rewind( fk );
+		lineNum = 0;
+		while( true ) {
+			size_t loaded = fread( keys, sizeof(frag_key), FRAG_KEYS_PER_BATCH, fk );
+			if( loaded == 0 ) break;
+			for( size_t i=0; i!=loaded; ++i ) {
+				++ lineNum;
+				if( test_line_bit(discard, lineNum) || test_line_bit(dup, lineNum) )
+					continue;
+				++ unique;
+				count_size( sizeCnt, max_size, size, lineNum );
+				keep_record( run, keys[i].offset, keys[i].length, fout, bam ? &bw : NULL );
+			}
+		}
+		fclose( fk );
+	} else {
+		samOffset = 0;	// the records are in the order of the line numbers
+		for( register unsigned int i=1; i<=lineNum; samOffset+=recLen[i], ++i ) {
+			if( test_line_bit(discard, i) || test_line_bit(dup, i) )
+				continue;
 			++ unique;
-		} else {
-//			cerr << "Line " << lineNum << " is marked as duplicate.\n";
+			count_size( sizeCnt, max_size, size, i );
+			keep_record( run, samOffset, recLen[i], fout, bam ? &bw : NULL );
 		}
+		delete [] recLen;
 	}
-	fin.close();
+	close_kept_run( run, fout, bam ? &bw : NULL );
 	fout.close();
+	if( bam && ! close_bam_writer(bw) )
+		exit( 1 );
 //	cerr << "\rDone: " << unique << " lines written.\n";
 
 //	cerr << "Writing log ...\n";
@@ -217,35 +260,16 @@ int main( int argc, char *argv[] ) {
 		cerr << "Error: could not write output log file!\n";
 		exit( 1 );
 	}
+	unsigned int dupNum     = count_line_bits( dup, lineNum );
+	unsigned int discardNum = count_line_bits( discard, lineNum );
 	fout << "All\t"       << lineNum        << '\n'
 		 << "Unique\t"    << unique         << '\n'
-		 << "Duplicate\t" << dup.size()     << '\n'
-		 << "Discard\t"   << discard.size() << '\n';
+		 << "Duplicate\t" << dupNum         << '\n'
+		 << "Discard\t"   << discardNum     << '\n';
 	fout.close();
 
 //	cerr << "Writing size distribution ...\n";
 	// write size distribution
-	unsigned int max_size = atoi( argv[3] );
-	if( max_size == 0 ) {
-		cerr << "Error: Invalid maximum insert size!\n";
-		exit( 1 );
-	}
-	max_size ++;
-//	cerr << "Max insert: " << max_size << '\n';
-	unsigned int * sizeCnt = new unsigned int [ max_size ];
-	for( register unsigned int i=0; i!=max_size; ++i )
-		sizeCnt[i] = 0;
-	for( register unsigned int i=1; i<=lineNum; ++i ) {
-		if( discard.find(i)==non_discard && dup.find(i)==non_dup ) {
-//			cerr << "Add size " << size[i] << '\n';
-			if( size[i] < max_size ) {
-				sizeCnt[ size[i] ] ++;
-			} else {	// the CIGAR makes the fragment longer than MAX_INSERT_SIZE !!!
-				cerr << "WARNING: Line " << i << " has an unacceptable size (" << size[i]
-						<< ") and will be ignored!\n";
-			}
-		}
-	}
 	sprintf( outfile, "%s.size.dist", argv[5] );
 	fout.open( outfile );
 	if( fout.fail() ) {
@@ -262,10 +286,13 @@ int main( int argc, char *argv[] ) {
 
 //	cerr << "Freeing memory ...\n";
 	delete [] size;
+	delete [] keys;
+	delete [] dup;
+	delete [] discard;
 	delete [] sizeCnt;
 	delete [] outfile;
-	for( sam_it=samRecord.begin(); sam_it!=no_such_chr; ++sam_it ) {
-		delete sam_it->second;
+	for( unsigned int i=0; i!=chrRecord.size(); ++i ) {
+		free_frag_table( chrRecord[i] );
 	}
 
 	return 0;
@@ -2,14 +2,22 @@
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <vector>
 //#include <map>
 //#include <set>
 #include <tr1/unordered_map>
 #include <tr1/unordered_set>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <memory.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "common.h"
 #include "util.h"
+#include "bam.h"
+#include "rmdup.h"
+#include "rmdup.stream.h"
 
 using namespace std;
 using namespace std::tr1;
@@ -20,35 +28,70 @@ using namespace std::tr1;
  * Date: Dec 2019
 */
 
+// load a batch of reads and parse them into fragment keys by multiple threads
+// offset is the position of the next record in the SAM file
+static unsigned int load_sam_batch( ifstream & fin, vector<string> & lines, frag_key *keys,
+									const chr_dict & chrs, unsigned int thread, uint64_t & offset ) {
+	register unsigned int n = 0;
+	while( n != FRAG_KEYS_PER_BATCH ) {
+		getline( fin, lines[n] );
+		if( fin.fail() )break;
+		keys[n].offset = offset;
+		keys[n].length = lines[n].size() + ( fin.eof() ? 0 : 1 );	// the last line may not end with '\n'
+		offset += keys[n].length;
+		++ n;
+	}
+
+	#pragma omp parallel num_threads( thread )
+	{
+		sam_view v;
+		string buf;
+		#pragma omp for schedule( static )
+		for( int i=0; i<(int)n; ++i ) {
+			//499780R1	83	chrX	14710827	42	67M	*	0	0	TCCCAATTCTAAATAGTT	HHHHHHHHHHHHHHHHH XG:Z:GA
+			const string & line = lines[i];
+			frag_key & f = keys[i];
+			sam_view_split( v, line, SAM_TAGS );
+			f.chr = find_chr( chrs, v.start[SAM_RNAME], sam_view_length(v, SAM_RNAME), buf );
+			if( f.chr < 0 )
+				continue;
+			f.pos = sam_view_int( v, SAM_POS );
+			f.strand = ( line.back() == 'T' ) ? FRAG_WATSON : FRAG_CRICK;	// XG:Z:CT or XG:Z:GA
+			f.qual = sam_view_sum( v, SAM_QUAL );
+		}
+	}
+	return n;
+}
+
+static void too_many_records( const char *trimlog ) {
+	cerr << "Error: there are more records than the reads in '" << trimlog << "'!\n";
+	exit( 1 );
+}
+
 int main( int argc, char *argv[] ) {
-	if( argc != 5 ) {
-		cerr << "\nUsage: " << argv[0] << " <chr.info> <trim.log> <in.sam> <out.prefix>\n";
+	if( argc < 5 ) {
+		cerr << "\nUsage: " << argv[0] << " <chr.info> <trim.log> <in.sam> <out.prefix> [header.sam|null] [thread=1] [in.frag|null|sorted]\n";
 		cerr << "This program is designed to remove the duplicate reads that have the same start and end/strand.\n\n";
+		cerr << "If header.sam is given, out.prefix.bam is also written (with the given header, or the one\n"
+			 << "built from chr.info if it is null); thread is used to compress the BAM file, and to\n"
+			 << "parse the records and mark the duplicates of different chromosomes in parallel.\n"
+			 << "If in.frag (the fragment keys written by bowtie2.processer with chr.info) is given, the\n"
+			 << "duplicates are marked using it and in.sam is not parsed at all.\n"
+			 << "If it is 'sorted', in.sam must be a SAM (text) file sorted by coordinate (BAM is not supported),\n"
+			 << "and the duplicates are removed in one pass with a sliding window (trim.log is not used).\n\n";
 		return 1;
 	}
 
+	// coordinate-sorted input: remove the duplicates in one pass
+	if( argc>7 && strcmp(argv[7], "sorted")==0 )
+		return stream_rmdup( false, argv[1], 0, argv[3], argv[4], argv[5], atoi(argv[6]) );
+
 	// loading info file
-	unordered_map<string, unordered_map<uint64_t, fraghit> *> samRecord;
-	string line, chr;
-	stringstream ss;
-	ifstream fin( argv[1] );
-	if( fin.fail() ) {
-		cerr << "Error: could not open file '" << argv[1] << "'!\n";
+	chr_dict chrs;
+	if( ! load_chr_dict(argv[1], chrs) )
 		exit( 1 );
-	}
-	while( true ) {
-		getline( fin, line );
-		if( fin.eof() )break;
-
-		if( line[0] == '#' )continue;
-
-		ss.str( line );
-		ss.clear();
-		ss >> chr;
-//		cerr << "Adding " << chr << " ...\n";
-		samRecord.insert( pair<string, unordered_map<uint64_t, fraghit>*>(chr, new unordered_map<uint64_t, fraghit>()) );
-	}
-	fin.close();
+	string line;
+	ifstream fin;
 
 	// load trim.log
 	unsigned int readNum;
@@ -62,82 +105,52 @@ int main( int argc, char *argv[] ) {
 	readNum = atoi( line.c_str() );
 //	cerr << "Read number: " << line << " => " << readNum << '\n';
 
+	// records of each chromosome, indexed by the chromosome ID
+	vector<frag_table> chrRecord;
+	init_frag_tables( chrRecord, chrs, readNum );
+
 	// load sam file
-	unordered_map<string, unordered_map<uint64_t, fraghit> *> :: iterator sam_it;
-	unordered_map<string, unordered_map<uint64_t, fraghit> *> :: iterator no_such_chr = samRecord.end();
-	unordered_set<unsigned int> dup;
-	unordered_set<unsigned int> discard;
-	unordered_map<uint64_t, fraghit> :: iterator hit_it;
-	fraghit hit;
-
-	fin.open( argv[3] );
-	if( fin.fail() ) {
-		cerr << "Error: could not open file '" << argv[3] << "'!\n";
-		exit( 1 );
+	uint64_t *dup     = new_line_bits( readNum );
+	uint64_t *discard = new_line_bits( readNum );
+
+	// fragment keys written by bowtie2.processer, the chromosomes are indexed as in chr.info
+	bool fragMode = ( argc>7 && strcmp(argv[7], "null")!=0 );
+	unsigned int thread = ( argc>6 && atoi(argv[6])>0 ) ? atoi(argv[6]) : 1;
+	FILE *fk = NULL;
+	frag_key *keys = new frag_key [ FRAG_KEYS_PER_BATCH ];
+	vector<string> lines;	// reads of a batch (text mode)
+	unsigned int *recLen = NULL;	// size of each read in the SAM file (text mode), indexed by line number
+	uint64_t samOffset = 0;
+	if( fragMode ) {
+		fk = fopen( argv[7], "rb" );
+		if( fk == NULL ) {
+			cerr << "Error: could not open file '" << argv[7] << "'!\n";
+			exit( 1 );
+		}
+	} else {
+		fin.open( argv[3] );
+		if( fin.fail() ) {
+			cerr << "Error: could not open file '" << argv[3] << "'!\n";
+			exit( 1 );
+		}
+		lines.resize( FRAG_KEYS_PER_BATCH );
+		recLen = new unsigned int [ readNum+1 ];
 	}
 
-	string cigar, qual, unk;
-	unsigned int pos;
-	uint64_t key;
-
+	rmdup_router rt;
 	unsigned int lineNum = 0;
 	while( true ) {
-		getline( fin, line );
-		if( fin.eof() ) break;
-		++ lineNum;
-
-		//499780R1	83	chrX	14710827	42	67M	*	0	0	TCCCAATTCTAAATAGTT	HHHHHHHHHHHHHHHHH XG:Z:GA
-		//499780R2	163	chrX	14710378	42	67M	*	0	0	TAACATTTCTTTAATCAC	HHHHHHHH:;:987665 XG:Z:GA
-
-		ss.str( line );
-		ss.clear();
-		ss >> unk >> unk >> chr >> pos >> unk >> cigar >> unk >> unk >> unk >> unk >> qual;
-
-//		fprintf( stderr, "Line %d, chr=%s, pos1=%u (0x%x), cigar1=%s, pos2=%u (0x%x), cigar2=%s\n",
-//					lineNum, chr.c_str(), pos1, pos1, cigar1.c_str(), pos2, pos2, cigar2.c_str() );
-
-		sam_it = samRecord.find( chr );
-		if( sam_it == no_such_chr ) {
-			discard.insert( lineNum );
-			continue;
-		}
-
-		key = pos;
-		if( line.back() == 'T' ) {	// XG:Z:CT
-			key |= READS_CT;
-		} else {	//XG:Z:GA
-			key |= READS_GA;
-		}
-
-		register unsigned int score = 0;
-		const char * p = qual.c_str();
-		register unsigned int i = 0;
-		register unsigned int readLen = qual.size();
-		for( i=0; i != readLen; ++i ) {
-			score += p[i];
-		}
-//		fprintf( stderr, "line %d => key=0x%llx, score=%u\n",
-//					lineNum, key, score );
-
-		hit_it = sam_it->second->find( key );
-		if( hit_it != sam_it->second->end() ) {	// there must be a duplicate
-			if( hit_it->second.score >= score ) {	// the previous one is better, mark this one as duplicate
-				dup.insert( lineNum );
-//				cerr << "Line " << lineNum << " meet a duplicate at line " << hit_it->second.lineNum
-//					 << " and the other one is better.\n";
-			} else {	// this one is better, then mark the previous one as duplicate and update the record
-//				cerr << "Line " << lineNum << " meet a duplicate at line " << hit_it->second.lineNum
-//					 << " but this one is better.\n";
-				dup.insert( hit_it->second.lineNum );
-				hit_it->second.lineNum = lineNum;
-				hit_it->second.score = score;
-			}
-		} else {	// no such record, add this one
-			hit.lineNum = lineNum;
-			hit.score = score;
-			sam_it->second->insert( pair<uint64_t, fraghit>( key, hit ) );
-//			cerr << "Line " << lineNum << " is new.\n";
+		unsigned int loaded = fragMode ? fread( keys, sizeof(frag_key), FRAG_KEYS_PER_BATCH, fk )
+									   : load_sam_batch( fin, lines, keys, chrs, thread, samOffset );
+		if( loaded == 0 ) break;
+		if( lineNum+loaded > readNum )
+			too_many_records( argv[2] );
+		if( ! fragMode ) {
+			for( register unsigned int i=0; i!=loaded; ++i )
+				recLen[ lineNum+1+i ] = keys[i].length;
 		}
+		dedup_batch( keys, loaded, lineNum+1, false, chrRecord, dup, discard, NULL, rt, thread );
+		lineNum += loaded;
 	}
 
 	// prepare output file
@@ -148,40 +161,67 @@ int main( int argc, char *argv[] ) {
 		cerr << "Error: could not write output SAM ile!\n";
 		exit( 1 );
 	}
-	// rewind sam file
-	fin.clear();
-	fin.seekg( ios_base::beg );
-	lineNum = 0;
-	unordered_set<unsigned int> :: iterator non_dup = dup.end();
-	unordered_set<unsigned int> :: iterator non_discard = discard.end();
+	bam_writer bw;
+	bool bam = ( argc > 5 );
+	if( bam ) {
+		outpre = argv[4];
+		outpre += ".bam";
+		if( ! open_bam_writer(bw, outpre.c_str(), argv[1], argv[5], thread) )
+			exit( 1 );
+	}
+	if( ! fragMode ) {
+		vector<string>().swap( lines );
+		fin.close();
+	}
+
+	// the kept records are copied by their offsets in the SAM file
 	unsigned int unique=0;
-	while( true ) {
-		getline( fin, line );
-		if( fin.eof() )break;
-		++ lineNum;
-		//499780R1	83	chrX	14710827	42	67M	*	0	0	TCCCAATTCTAAATAGTT	HHHHHHHHHHHHHHHHH XG:Z:GA
-		//499780R2	163	chrX	14710378	42	67M	*	0	0	TAACATTTCTTTAATCAC	HHHHHHHH:;:987665 XG:Z:GA
-
-		if( discard.find(lineNum)==non_discard && dup.find(lineNum)==non_dup ) {
-			fout << line << '\n';
+	kept_run run;
+	if( ! open_kept_run(run, argv[3]) )
+		exit( 1 );
+	if( fragMode ) {
+		rewind( fk );
+		lineNum = 0;
+		while( true ) {
+			size_t loaded = fread( keys, sizeof(frag_key), FRAG_KEYS_PER_BATCH, fk );
+			if( loaded == 0 ) break;
+			for( size_t i=0; i!=loaded; ++i ) {
+				++ lineNum;
+				if( test_line_bit(discard, lineNum) || test_line_bit(dup, lineNum) )
+					continue;
+				++ unique;
+				keep_record( run, keys[i].offset, keys[i].length, fout, bam ? &bw : NULL );
+			}
+		}
+		fclose( fk );
+	} else {
+		samOffset = 0;	// the records are in the order of the line numbers
+		for( register unsigned int i=1; i<=lineNum; samOffset+=recLen[i], ++i ) {
+			if( test_line_bit(discard, i) || test_line_bit(dup, i) )
+				continue;
 			++ unique;
-		} else {
-//			cerr << "Line " << lineNum << " is marked as duplicate.\n";
+			keep_record( run, samOffset, recLen[i], fout, bam ? &bw : NULL );
 		}
+		delete [] recLen;
 	}
-	fin.close();
+	close_kept_run( run, fout, bam ? &bw : NULL );
 	fout.close();
+	if( bam && ! close_bam_writer(bw) )
+		exit( 1 );
 
 	// write log
 	outpre = argv[4];
 	outpre += ".log";
 	fout.open( outpre.c_str() );
+	unsigned int dupNum     = count_line_bits( dup, lineNum );
+	unsigned int discardNum = count_line_bits( discard, lineNum );
 	fout << "All\t"       << lineNum         << '\n'
 		 << "Unique\t"    << unique          << '\n'
-		 << "Duplicate\t" << dup.size()      << '\n'
-		 << "Discard\t"   << discard.size()  << '\n';
+		 << "Duplicate\t" << dupNum          << '\n'
+		 << "Discard\t"   << discardNum      << '\n';
 	fout.close();
 
+	delete [] keys;
 	return 0;
 }
 
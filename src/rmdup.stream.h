@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <tr1/unordered_map>
+#include "common.h"
+#include "util.h"
+#include "bam.h"
+
+using namespace std;
+using namespace std::tr1;
+
+/*
+ * Author: Kun Sun (sunkun@szbl.ac.cn)
+ * This program is part of the Msuite package
+ * Date: Oct 2026
+ *
+ * Streaming rmdup for a coordinate-sorted SAM file (text only, BAM input is not supported), shared
+ * by rmdup.pe and rmdup.se. The keys are the same as in the 2-pass mode (start/size/strand of the
+ * fragment), and the fragments with the same key start at the same position and end within
+ * max.insert.size, so a key is closed once the input passes that window. The records are kept in
+ * a queue and written (or dropped) when their fragments are decided, hence only the fragments
+ * around the current position are in memory and the input is read only once.
+ *
+ * In PE mode, the mates are paired by their names; a fragment is compared with the others once
+ * both mates are loaded (the score is the sum of the qualities of both mates). Records whose mates
+ * are not found within max.insert.size (or on the same chromosome) are discarded, so that they do
+ * not hold the queue; a mate found later is then discarded on its own.
+ * The fragments longer than max.insert.size are only compared within the window.
+**/
+
+#ifndef _MSUITE_RMDUP_STREAM_
+#define _MSUITE_RMDUP_STREAM_
+
+// status of a fragment
+const unsigned char STREAM_PENDING	= 0;	// waiting for the mate
+const unsigned char STREAM_BEST		= 1;	// the best one for its key so far
+const unsigned char STREAM_KEPT		= 2;
+const unsigned char STREAM_DUP		= 3;
+const unsigned char STREAM_DISCARD	= 4;	// no mate within the window
+
+const size_t STREAM_TEXT_COMPACT = 1 << 24;	// the written text is released in blocks of 16 MB
+
+typedef struct {
+	uint64_t key;
+	unsigned int score;
+	unsigned int size;		// fragment size
+	unsigned int deadline;	// no more fragments with the same key once the input reaches here
+	unsigned int mpos;		// position and reference length of the first record (PE)
+	unsigned int mlen;
+	bool watson;			// XG:Z:CT in read 1
+	unsigned char state;
+	unsigned char queued;	// records in the queue
+} stream_frag;
+
+typedef struct {
+	uint64_t offset;	// the line (with '\n') in the text buffer
+	unsigned int len;
+	uint64_t frag;		// ID of the fragment
+} stream_rec;
+
+typedef struct {
+	bool paired;
+	unsigned int window;	// max.insert.size
+	ofstream *fout;
+	bam_writer *bw;
+
+	string text;		// lines in the queue, text[0] is at textBase of the input
+	uint64_t textBase;
+	deque<stream_rec> queue;
+	deque<stream_frag> frags;	// frags[0] has ID fragBase
+	uint64_t fragBase;
+	unordered_map<uint64_t, uint64_t> best;		// key -> best fragment, for the open keys
+	unordered_map<string, uint64_t> mates;		// name -> fragment waiting for the mate
+	string name;
+
+	unsigned int all, unique, dup, discard;
+	unsigned int *sizeCnt;	// PE only
+	unsigned int maxSize;
+} stream_state;
+
+stream_frag inline & stream_get_frag( stream_state & s, uint64_t id ) {
+	return s.frags[ id - s.fragBase ];
+}
+
+// compare a complete fragment with the best one of the same key
+void inline stream_compare( stream_state & s, uint64_t id ) {
+	stream_frag & f = stream_get_frag( s, id );
+	unordered_map<uint64_t, uint64_t> :: iterator it = s.best.find( f.key );
+	if( it == s.best.end() ) {
+		s.best.insert( pair<uint64_t, uint64_t>(f.key, id) );
+		f.state = STREAM_BEST;
+		return;
+	}
+	stream_frag & b = stream_get_frag( s, it->second );
+	if( b.score >= f.score ) {	// the previous one is better, mark this one as duplicate
+		f.state = STREAM_DUP;
+	} else {	// this one is better
+		b.state = STREAM_DUP;
+		f.state = STREAM_BEST;
+		it->second = id;
+	}
+	++ s.dup;
+}
+
+// write/drop the records at the head of the queue whose fragments are decided; the input has
+// reached pos (or the end of the chromosome if final is set)
+void inline stream_flush( stream_state & s, unsigned int pos, bool final ) {
+	while( ! s.queue.empty() ) {
+		stream_rec & r = s.queue.front();
+		stream_frag & f = stream_get_frag( s, r.frag );
+		if( f.state == STREAM_PENDING ) {
+			// the mate could not come after the window; r is the only record of this fragment
+			if( ! final && pos <= f.mpos + s.window )
+				break;
+			f.state = STREAM_DISCARD;
+			++ s.discard;
+			if( ! final ) {
+				const char *line = s.text.data() + ( r.offset - s.textBase );
+				s.name.assign( line, (const char *)memchr(line, '\t', r.len) - line );
+				s.mates.erase( s.name );
+			}
+		} else if( f.state == STREAM_BEST ) {
+			if( ! final && f.deadline > pos )
+				break;
+			f.state = STREAM_KEPT;
+			s.best.erase( f.key );
+			++ s.unique;
+			if( s.paired ) {
+				if( f.size < s.maxSize ) {
+					s.sizeCnt[ f.size ] ++;
+				} else {	// the CIGAR makes the fragment longer than MAX_INSERT_SIZE !!!
+					cerr << "WARNING: Line " << r.frag+1 << " has an unacceptable size (" << f.size
+						 << ") and will be ignored!\n";
+				}
+			}
+		}
+
+		if( f.state == STREAM_KEPT ) {
+			const char *line = s.text.data() + ( r.offset - s.textBase );
+			s.fout->write( line, r.len );
+			if( s.bw != NULL )
+				bam_write_text( *s.bw, line, r.len );
+		}
+		-- f.queued;
+		s.queue.pop_front();
+	}
+
+	// release the fragments and the text that are no longer needed
+	while( ! s.frags.empty() && s.frags.front().queued==0 && s.frags.front().state>=STREAM_KEPT ) {
+		s.frags.pop_front();
+		++ s.fragBase;
+	}
+	uint64_t done = s.queue.empty() ? s.textBase + s.text.size() : s.queue.front().offset;
+	if( done - s.textBase >= STREAM_TEXT_COMPACT || s.queue.empty() ) {
+		s.text.erase( 0, done - s.textBase );
+		s.textBase = done;
+	}
+	if( final ) {
+		s.best.clear();
+		s.mates.clear();
+	}
+}
+
+// load a record and return the ID of its fragment
+uint64_t inline stream_load( stream_state & s, const string & line, const sam_view & v, unsigned int pos ) {
+	register unsigned int len = get_readLen_from_cigar( v.start[SAM_CIGAR], sam_view_length(v, SAM_CIGAR) );
+	register unsigned int qual = sam_view_sum( v, SAM_QUAL );
+	register bool watson = ( line.back() == 'T' );	// XG:Z:CT
+
+	if( ! s.paired ) {
+		stream_frag f;
+		f.key = pos;
+		f.key |= watson ? READS_CT : READS_GA;
+		f.score = qual;
+		f.size = len;
+		f.deadline = pos + 1;
+		f.queued = 0;
+		s.frags.push_back( f );
+		++ s.all;
+		stream_compare( s, s.fragBase + s.frags.size() - 1 );
+		return s.fragBase + s.frags.size() - 1;
+	}
+
+	register bool R1 = ( sam_view_int(v, SAM_FLAG) & 0x40 );
+	s.name.assign( v.start[SAM_QNAME], sam_view_length(v, SAM_QNAME) );
+	unordered_map<string, uint64_t> :: iterator it = s.mates.find( s.name );
+	if( it == s.mates.end() ) {	// the first mate
+		stream_frag f;
+		f.score = qual;
+		f.mpos = pos;
+		f.mlen = len;
+		f.watson = watson;
+		f.state = STREAM_PENDING;
+		f.queued = 0;
+		s.frags.push_back( f );
+		++ s.all;
+		uint64_t id = s.fragBase + s.frags.size() - 1;
+		s.mates.insert( pair<string, uint64_t>(s.name, id) );
+		return id;
+	}
+
+	uint64_t id = it->second;
+	s.mates.erase( it );
+	stream_frag & f = stream_get_frag( s, id );
+	register unsigned int pos1, len1, pos2, len2;
+	if( R1 ) {
+		pos1 = pos;    len1 = len;
+		pos2 = f.mpos; len2 = f.mlen;
+		f.watson = watson;	// the strand is determined by read 1
+	} else {
+		pos1 = f.mpos; len1 = f.mlen;
+		pos2 = pos;    len2 = len;
+	}
+	if( f.watson ) {	// XG:Z:CT, then pos1 < pos2, then locate the end using pos2 and cigar2
+		f.key = pos1;
+		f.size = pos2 + len2 - pos1;
+		f.key <<= 32;
+		f.key |= f.size;
+	} else {	//XG:Z:GA, then pos1 > pos2, then locate the end using pos1 and cigar1
+		f.key = pos2;
+		f.size = pos1 + len1 - pos2;
+		f.key <<= 32;
+		f.key |= - f.size;	// use negative values to mark the strand
+	}
+	// the records of the fragments with this key are all before the end of the fragment; the
+	// "negative" sizes (i.e., read 2 is before read 1) are closed within the window as well
+	f.deadline = ( f.key >> 32 ) + ( (f.size < s.window) ? f.size : s.window );
+	f.score += qual;
+	stream_compare( s, id );
+	return id;
+}
+
+/*
+ * rmdup in one pass over the coordinate-sorted SAM file; writes out.prefix.sam/log (and .bam if
+ * header is given, and .size.dist for PE data) as in the 2-pass mode
+*/
+int inline stream_rmdup( bool paired, const char *chrinfo, unsigned int window, const char *samfile,
+						const char *outpre, const char *header, unsigned int thread ) {
+	chr_dict chrs;
+	if( ! load_chr_dict(chrinfo, chrs) )
+		return 1;
+	if( paired && window == 0 ) {
+		cerr << "Error: Invalid maximum insert size!\n";
+		return 1;
+	}
+
+	ifstream fin( samfile );
+	if( fin.fail() ) {
+		cerr << "Error: could not open file '" << samfile << "'!\n";
+		return 1;
+	}
+	string outfile = outpre;
+	outfile += ".sam";
+	ofstream fout( outfile.c_str() );
+	if( fout.fail() ) {
+		cerr << "Error: could not write output SAM file!\n";
+		return 1;
+	}
+	bam_writer bw;
+	if( header != NULL ) {
+		outfile = outpre;
+		outfile += ".bam";
+		if( ! open_bam_writer(bw, outfile.c_str(), chrinfo, header, thread) )
+			return 1;
+	}
+
+	stream_state s;
+	s.paired = paired;
+	s.window = window;
+	s.fout = &fout;
+	s.bw = ( header != NULL ) ? &bw : NULL;
+	s.textBase = 0;
+	s.fragBase = 0;
+	s.all = s.unique = s.dup = s.discard = 0;
+	s.maxSize = window + 1;
+	s.sizeCnt = new unsigned int [ s.maxSize ];
+	memset( s.sizeCnt, 0, s.maxSize*sizeof(unsigned int) );
+
+	vector<bool> visited( chrs.name.size(), false );
+	string line;
+	sam_view v;
+	int chrID, lastChr = -1;
+	unsigned int pos, lastPos = 0;
+	while( getline(fin, line) ) {
+		if( line.empty() || line[0] == '@' )	// header
+			continue;
+
+		sam_view_split( v, line, SAM_TAGS );
+		chrID = find_chr( chrs, v );
+		pos = sam_view_int( v, SAM_POS );
+		if( chrID != lastChr ) {
+			stream_flush( s, 0, true );
+			if( chrID >= 0 ) {
+				if( visited[chrID] ) {
+					cerr << "Error: '" << samfile << "' is not sorted by coordinate!\n";
+					return 1;
+				}
+				visited[chrID] = true;
+			}
+			lastChr = chrID;
+		} else if( pos < lastPos ) {
+			cerr << "Error: '" << samfile << "' is not sorted by coordinate!\n";
+			return 1;
+		}
+		lastPos = pos;
+
+		if( chrID < 0 ) {	// there is NO such chromosome; count each fragment once
+			if( ! paired || (sam_view_int(v, SAM_FLAG) & 0x40) ) {
+				++ s.all;
+				++ s.discard;
+			}
+			continue;
+		}
+
+		uint64_t id = stream_load( s, line, v, pos );
+		stream_rec r;
+		r.offset = s.textBase + s.text.size();
+		r.len = line.size() + 1;
+		r.frag = id;
+		s.text += line;
+		s.text += '\n';
+		s.queue.push_back( r );
+		++ stream_get_frag( s, id ).queued;
+
+		stream_flush( s, pos, false );
+	}
+	stream_flush( s, 0, true );
+	fin.close();
+	fout.close();
+	if( header!=NULL && ! close_bam_writer(bw) )
+		return 1;
+
+	// write log
+	outfile = outpre;
+	outfile += ".log";
+	fout.open( outfile.c_str() );
+	if( fout.fail() ) {
+		cerr << "Error: could not write output log file!\n";
+		return 1;
+	}
+	fout << "All\t"       << s.all     << '\n'
+		 << "Unique\t"    << s.unique  << '\n'
+		 << "Duplicate\t" << s.dup     << '\n'
+		 << "Discard\t"   << s.discard << '\n';
+	fout.close();
+
+	// write size distribution
+	if( paired ) {
+		outfile = outpre;
+		outfile += ".size.dist";
+		fout.open( outfile.c_str() );
+		if( fout.fail() ) {
+			cerr << "Error: could not write output size.dist file!\n";
+			return 1;
+		}
+		fout << "Size\tCount\tProportion\n";
+		for( register unsigned int i=1; i!=s.maxSize; ++i ) {
+			if( s.sizeCnt[i] != 0 ) {
+				fout << i << '\t' << s.sizeCnt[i] << '\t' << s.sizeCnt[i]*100.0/s.unique << '\n';
+			}
+		}
+		fout.close();
+	}
+	delete [] s.sizeCnt;
+
+	return 0;
+}
+
+#endif
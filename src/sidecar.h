@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <iostream>
+#include "common.h"
+
+using namespace std;
+
+/*
+ * Author: Kun Sun (sunkun@szbl.ac.cn)
+ * This program is part of the Msuite package
+ * Date: Oct 2026
+ *
+ * Binary sidecar for the conversion logs (optional, used in mode 3 and 4).
+ * Instead of packing the conversion log and the raw read name into the fastq header, the
+ * preprocessor writes them into PREFIX.sidecar and gives bowtie2 only the line number
+ * (in HEX) of each read, then the bowtie2.processer mmaps the sidecar to restore the reads.
+ * The quality scores are also kept in the sidecar as bowtie2 is called with --ignore-quals,
+ * so the reads are given to bowtie2 in FASTA format (bowtie2 uses constant dummy qualities
+ * for them) and the bowtie2.processer splices the real qualities back.
+ *
+ * PREFIX.sidecar.idx: uint64 offset of the record of each line in PREFIX.sidecar, the first
+ *   entry is unused as the line number starts from 1; dropped reads have no records
+ * PREFIX.sidecar: one record per read (pair)
+ *   uint8  flags (SIDECAR_ENDC, SIDECAR_FRONTG, SIDECAR_SAME_NAME)
+ *   char   quality score of endC (read 1) and frontG (read 2), 0 if not exist
+ *   read 1: uint16 size of bitmask (in bp), uint16 name length, uint16 quality length,
+ *           bitmask of the converted positions (bit i%8 of byte i/8 for position i),
+ *           read name (without "@" and "/1"), quality scores of the read given to bowtie2
+ *   read 2: the same as read 1 (Paired-End only), the name is empty if SIDECAR_SAME_NAME is set
+ * Numbers are in native (little-endian) byte order.
+**/
+
+#ifndef _MSUITE_SIDECAR_
+#define _MSUITE_SIDECAR_
+
+const unsigned char SIDECAR_ENDC	  = 1;
+const unsigned char SIDECAR_FRONTG	  = 2;
+const unsigned char SIDECAR_SAME_NAME = 4;
+
+// a read restored from the sidecar
+typedef struct {
+	unsigned int len;			// bp covered by the bitmask
+	const unsigned char *bits;
+	const char *name;
+	unsigned int nameLen;
+	const char *qual;
+	unsigned int qualLen;
+} sidecar_read;
+
+typedef struct {
+	unsigned char flags;
+	char qual1, qual2;
+	sidecar_read r1, r2;
+} sidecar_record;
+
+typedef struct {
+	const char *data;
+	size_t dataSize;
+	const unsigned long long *idx;
+	size_t idxSize;			// number of entries in idx
+} sidecar;
+
+char inline * write_u16( char *o, unsigned int v ) {
+	unsigned short s = v;
+	memcpy( o, &s, 2 );
+	return o + 2;
+}
+
+unsigned int inline read_u16( const char *p ) {
+	unsigned short s;
+	memcpy( &s, p, 2 );
+	return s;
+}
+
+char inline * write_sidecar_head( char *o, unsigned char flags, char qual1, char qual2 ) {
+	o[0] = flags;
+	o[1] = qual1;
+	o[2] = qual2;
+	return o + 3;
+}
+
+// bowtie2 removes the /1, /2 and /3 suffixes of the read names in the SAM output,
+// so they are removed before the names are recorded to get the same output
+unsigned int inline sam_name_length( const char *name, unsigned int len ) {
+	if( len>=2 && name[len-2]=='/' && (name[len-1]=='1' || name[len-1]=='2' || name[len-1]=='3') )
+		return len - 2;
+	return len;
+}
+
+// bits are the uint32 words generated by convert_read (see convert.kernel.h)
+char inline * write_sidecar_read( char *o, const unsigned int *bits, unsigned int len,
+									const char *name, unsigned int nameLen,
+									const char *qual, unsigned int qualLen ) {
+	o = write_u16( o, len );
+	o = write_u16( o, nameLen );
+	o = write_u16( o, qualLen );
+	memcpy( o, bits, (len+7)>>3 );
+	o += (len+7) >> 3;
+	memcpy( o, name, nameLen );
+	o += nameLen;
+	memcpy( o, qual, qualLen );
+	return o + qualLen;
+}
+
+// the record must lie in the sidecar (end is the end of the data); returns NULL otherwise
+const char inline * parse_sidecar_read( const char *p, const char *end, sidecar_read & r ) {
+	if( p+6 > end )
+		return NULL;
+	r.len	  = read_u16( p );
+	r.nameLen = read_u16( p+2 );
+	r.qualLen = read_u16( p+4 );
+	r.bits	  = (const unsigned char *)(p + 6);
+	r.name	  = p + 6 + ((r.len+7) >> 3);
+	r.qual	  = r.name + r.nameLen;
+	if( r.qual+r.qualLen > end || r.nameLen >= MAX_SEQNAME_SIZE )
+		return NULL;
+	return r.qual + r.qualLen;
+}
+
+// a sidecar of another run (or a damaged one) must not be used to restore the reads
+void inline sidecar_mismatch() {
+	cerr << "Error: the sidecar does not match the input!\n";
+	exit(14);
+}
+
+void inline get_sidecar_record( const sidecar & sc, unsigned int line, sidecar_record & rec, bool paired ) {
+	if( line==0 || line>=sc.idxSize || sc.idx[line]+3>sc.dataSize )
+		sidecar_mismatch();
+	const char *end = sc.data + sc.dataSize;
+	const char *p = sc.data + sc.idx[ line ];
+	rec.flags = p[0];
+	rec.qual1 = p[1];
+	rec.qual2 = p[2];
+	p = parse_sidecar_read( p+3, end, rec.r1 );
+	if( p == NULL )
+		sidecar_mismatch();
+	if( paired ) {
+		if( parse_sidecar_read(p, end, rec.r2) == NULL )
+			sidecar_mismatch();
+		if( rec.flags & SIDECAR_SAME_NAME ) {
+			rec.r2.name	   = rec.r1.name;
+			rec.r2.nameLen = rec.r1.nameLen;
+		}
+	}
+}
+
+// the read given to bowtie2 has the recorded qualities, and the conversions are within the read;
+// extra is 1 for read 2 with frontG, as its bitmask covers the discarded G
+void inline check_sidecar_read( const sidecar_read & r, unsigned int seqLen, unsigned int extra ) {
+	if( r.qualLen!=seqLen || r.len>seqLen+extra )
+		sidecar_mismatch();
+}
+
+// set seq[ offset + step*i ] to base for each converted position i
+void inline restore_conversion( char *seq, const sidecar_read & r, int offset, int step, char base ) {
+	register unsigned int n = (r.len+7) >> 3;
+	register unsigned int b;
+	for( register unsigned int k=0; k!=n; ++k ) {
+		b = r.bits[k];
+		while( b ) {
+			seq[ offset + step*(int)((k<<3) + __builtin_ctz(b)) ] = base;
+			b &= b - 1;
+		}
+	}
+}
+
+// replace the dummy qualities reported by bowtie2 with the real ones; reverse is set for the
+// reads aligned to the reverse strand as their qualities are reported in reversed order
+void inline restore_quality( char *qual, unsigned int len, const sidecar_read & r, bool reverse ) {
+	if( len > r.qualLen )	// should never happen
+		len = r.qualLen;
+	if( reverse ) {
+		for( register unsigned int k=0; k!=len; ++k )
+			qual[k] = r.qual[ len-1-k ];
+	} else {
+		memcpy( qual, r.qual, len );
+	}
+}
+
+// copy the raw read name into dst as a C-string
+void inline copy_sidecar_name( char *dst, const sidecar_read & r ) {
+	memcpy( dst, r.name, r.nameLen );
+	dst[ r.nameLen ] = 0;
+}
+
+// map the whole file; an empty file (e.g., all reads are dropped) is mapped to an empty string
+const char inline * map_file( const string & file, size_t & size ) {
+	int fd = open( file.c_str(), O_RDONLY );
+	if( fd < 0 )
+		return NULL;
+	struct stat st;
+	if( fstat(fd, &st) != 0 ) {
+		close( fd );
+		return NULL;
+	}
+	size = st.st_size;
+	if( size == 0 ) {
+		close( fd );
+		return "";
+	}
+	void *m = mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( m == MAP_FAILED )
+		return NULL;
+	return (const char *)m;
+}
+
+bool inline open_sidecar( sidecar & sc, const char *prefix ) {
+	string base = prefix;
+	size_t size;
+	sc.idx = (const unsigned long long *) map_file( base+".sidecar.idx", size );
+	if( sc.idx == NULL ) {
+		cerr << "Error: cannot open file " << base << ".sidecar.idx!\n";
+		return false;
+	}
+	sc.idxSize = size / sizeof(unsigned long long);
+	sc.data = map_file( base+".sidecar", sc.dataSize );
+	if( sc.data == NULL ) {
+		cerr << "Error: cannot open file " << base << ".sidecar!\n";
+		if( size )
+			munmap( (void *)sc.idx, size );
+		return false;
+	}
+	return true;
+}
+
+void inline close_sidecar( sidecar & sc ) {
+	if( sc.dataSize )
+		munmap( (void *)sc.data, sc.dataSize );
+	if( sc.idxSize )
+		munmap( (void *)sc.idx, sc.idxSize*sizeof(unsigned long long) );
+}
+
+#endif
+
@@ -0,0 +1,340 @@
+#include <string.h>
+#include "common.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Author: Kun Sun (sunkun@szbl.ac.cn)
+ * This program is part of the Msuite package
+ * Date: Oct 2026
+ *
+ * Kernels used by the preprocessors for base composition, quality trimming and adapter searching.
+ * The reads are copied into zero-padded buffers (at least READ_PADDING bytes after the read)
+ * so the kernels could always load 16 bytes without checking the boundary.
+ * SSE2 is used if available (it is always there on x86-64), otherwise the scalar version is used.
+ * The adapter kernels are templates over the adapter kit (see adapter_kit), so the adapter
+ * length and index seed are compile-time constants; the kit is dispatched once per run.
+**/
+
+#ifndef _MSUITE_TRIM_KERNEL_
+#define _MSUITE_TRIM_KERNEL_
+
+const unsigned int READ_PADDING = 32;
+const unsigned int ADAPTER_PAD  = 32;	// adapter_len MUST be no more than this
+
+// compile-time constants of an adapter kit (see common.h)
+template <const char *R1, const char *R2, unsigned int LEN, const char *INDEX>
+struct adapter_kit {
+	static constexpr unsigned int len = ( LEN > ADAPTER_PAD ) ? ADAPTER_PAD : LEN;
+	static constexpr char index0 = INDEX[0];
+	static constexpr char index1 = INDEX[1];
+	static constexpr char index2 = INDEX[2];
+	// the heading 2 bases are used to check the adapters in the tail
+	static constexpr char r1_0 = R1[0];
+	static constexpr char r1_1 = R1[1];
+	static constexpr char r2_0 = R2[0];
+	static constexpr char r2_1 = R2[1];
+	static const char *r1() { return R1; }
+	static const char *r2() { return R2; }
+};
+
+typedef adapter_kit< illumina_adapter_sequence, illumina_adapter_sequence,
+					 illumina_adapter_len, illumina_adapter_index > illumina_kit;
+typedef adapter_kit< nextera_adapter_sequence, nextera_adapter_sequence,
+					 nextera_adapter_len, nextera_adapter_index > nextera_kit;
+typedef adapter_kit< bgi_adapter1_sequence, bgi_adapter2_sequence,
+					 bgi_adapter_len, bgi_adapter_index > bgi_kit;
+
+// the adapters padded to ADAPTER_PAD bytes, so they could be compared 16 bytes at a time
+typedef struct {
+	char r1[ ADAPTER_PAD ];
+	char r2[ ADAPTER_PAD ];
+} adapter_kernel;
+
+template <class KIT>
+void init_adapter_kernel( adapter_kernel & ak ) {
+	memset( ak.r1, 0, ADAPTER_PAD );
+	memset( ak.r2, 0, ADAPTER_PAD );
+	memcpy( ak.r1, KIT::r1(), KIT::len );
+	memcpy( ak.r2, KIT::r2(), KIT::len );
+}
+
+// copy the read into a padded buffer
+void inline pad_read( char *dst, const char *src, unsigned int len ) {
+	memcpy( dst, src, len );
+	memset( dst+len, 0, READ_PADDING );
+}
+
+// bitmask of the positions [base, base+16) where the adapter index (3 bp) starts
+template <class KIT>
+unsigned int inline seed_mask( const char *s, unsigned int base ) {
+#ifdef __SSE2__
+	__m128i m = _mm_and_si128(
+					_mm_and_si128( _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s+base)),   _mm_set1_epi8(KIT::index0)),
+								   _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s+base+1)), _mm_set1_epi8(KIT::index1)) ),
+					_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s+base+2)), _mm_set1_epi8(KIT::index2)) );
+	return _mm_movemask_epi8( m );
+#else
+	register unsigned int mask = 0;
+	for( register unsigned int i=0; i!=16; ++i ) {
+		if( s[base+i]==KIT::index0 && s[base+i+1]==KIT::index1 && s[base+i+2]==KIT::index2 )
+			mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+// number of mismatches in the first len (<=32) bytes
+unsigned int inline count_mismatch( const char *s, const char *a, unsigned int len ) {
+	register unsigned int lenmask = ( len==32 ) ? 0xffffffffU : ((1U<<len) - 1);
+#ifdef __SSE2__
+	register unsigned int eq = _mm_movemask_epi8( _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)s),
+																_mm_loadu_si128((const __m128i *)a)) );
+	eq |= ((unsigned int)_mm_movemask_epi8( _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s+16)),
+															 _mm_loadu_si128((const __m128i *)(a+16))) )) << 16;
+	return __builtin_popcount( ~eq & lenmask );
+#else
+	register unsigned int mis = 0;
+	for( register unsigned int i=0; i!=len; ++i )
+		if( s[i] != a[i] )
+			++ mis;
+	return mis;
+#endif
+}
+
+/*
+ * use dynamic max_mismatch as the covered size can range from 3 to a large number such as 50,
+ * so use static values (e.g., 4) is not good
+ * for each read, at most roof(len/4) mismatches are allowed; for PE, the total mismatches
+ * of the 2 reads MUST be no more than (len+1)/2
+*/
+template <class KIT>
+bool inline check_mismatch_dynamic_PE( const char *s1, const char *s2, unsigned int readLen,
+										unsigned int pos, const adapter_kernel & ak ) {
+	register unsigned int len = readLen - pos;
+	if( len > KIT::len )
+		len = KIT::len;
+	register unsigned int max_mismatch_dynamic = (len+3) >> 2;
+
+	register unsigned int mis1 = count_mismatch( s1+pos, ak.r1, len );
+	if( mis1 > max_mismatch_dynamic )
+		return false;
+	register unsigned int mis2 = count_mismatch( s2+pos, ak.r2, len );
+	if( mis2 > max_mismatch_dynamic )
+		return false;
+
+	return mis1 + mis2 <= ((len+1) >> 1);
+}
+
+template <class KIT>
+bool inline check_mismatch_dynamic_SE( const char *s, unsigned int readLen, unsigned int pos, const adapter_kernel & ak ) {
+	register unsigned int len = readLen - pos;
+	if( len > KIT::len )
+		len = KIT::len;
+	return count_mismatch( s+pos, ak.r1, len ) <= ((len+3) >> 2);
+}
+
+/*
+ * find the adapter in the padded reads: the seeds (perfect match of the adapter index) in both
+ * reads are visited in ascending order, and the first one passing the mismatch check is returned
+ * returns -1 if no adapter is found
+*/
+template <class KIT>
+int inline find_adapter_PE( const char *s1, const char *s2, unsigned int readLen, const adapter_kernel & ak ) {
+	if( readLen < 3 )
+		return -1;
+	register unsigned int last = readLen - 2;	// seeds are in [0, last)
+	register unsigned int mask, pos;
+	for( register unsigned int base=0; base<last; base+=16 ) {
+		mask = seed_mask<KIT>( s1, base ) | seed_mask<KIT>( s2, base );
+		if( last-base < 16 )
+			mask &= (1U << (last-base)) - 1;
+		while( mask ) {
+			pos = base + __builtin_ctz( mask );
+			if( check_mismatch_dynamic_PE<KIT>( s1, s2, readLen, pos, ak ) )
+				return pos;
+			mask &= mask - 1;
+		}
+	}
+	return -1;
+}
+
+template <class KIT>
+int inline find_adapter_SE( const char *s, unsigned int readLen, const adapter_kernel & ak ) {
+	if( readLen < 3 )
+		return -1;
+	register unsigned int last = readLen - 2;
+	register unsigned int mask, pos;
+	for( register unsigned int base=0; base<last; base+=16 ) {
+		mask = seed_mask<KIT>( s, base );
+		if( last-base < 16 )
+			mask &= (1U << (last-base)) - 1;
+		while( mask ) {
+			pos = base + __builtin_ctz( mask );
+			if( check_mismatch_dynamic_SE<KIT>( s, readLen, pos, ak ) )
+				return pos;
+			mask &= mask - 1;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Per-thread base composition per cycle.
+ * There are 5 planes (A, C, G, T, N) and each plane holds the counters of all cycles, so one
+ * 16-byte block of a read updates 16 adjacent counters with one instruction.
+ * The uint8 counters are flushed into the uint32 ones every 255 reads to avoid overflow.
+*/
+const unsigned int BASE_STAT_FLUSH = 255;
+
+typedef struct {
+	unsigned int cycle;
+	unsigned int stride;	// size of one plane, cycle rounded up to 16 plus padding
+	unsigned char *cnt8;
+	unsigned int  *cnt32;
+	unsigned int pending;	// reads counted in cnt8
+} base_stat;
+
+void inline init_base_stat( base_stat & st, unsigned int cycle ) {
+	st.cycle  = cycle;
+	st.stride = ((cycle+15) & ~15U) + 16;
+	st.cnt8   = new unsigned char [ st.stride*5 ];
+	st.cnt32  = new unsigned int  [ st.stride*5 ];
+	memset( st.cnt8,  0, st.stride*5 );
+	memset( st.cnt32, 0, st.stride*5*sizeof(unsigned int) );
+	st.pending = 0;
+}
+
+void inline free_base_stat( base_stat & st ) {
+	delete [] st.cnt8;
+	delete [] st.cnt32;
+}
+
+void inline flush_base_stat( base_stat & st ) {
+	register unsigned int n = st.stride * 5;
+	for( register unsigned int i=0; i!=n; ++i )
+		st.cnt32[i] += st.cnt8[i];
+	memset( st.cnt8, 0, n );
+	st.pending = 0;
+}
+
+// add the counts into the statistics of all threads and reset them (so it could be called per batch)
+void inline reduce_base_stat( base_stat & st, fastqstat *all ) {
+	flush_base_stat( st );
+	register unsigned int *p = st.cnt32;
+	for( register unsigned int j=0; j!=st.cycle; ++j ) {
+		all[j].A += p[j];
+		all[j].C += p[j + st.stride];
+		all[j].G += p[j + st.stride*2];
+		all[j].T += p[j + st.stride*3];
+		all[j].N += p[j + st.stride*4];
+	}
+	memset( p, 0, st.stride*5*sizeof(unsigned int) );
+}
+
+// count the bases in [base, base+remain) (at most 16) of a padded read
+void inline count_bases( base_stat & st, const char *s, unsigned int base, unsigned int remain ) {
+	unsigned char *c = st.cnt8 + base;
+#ifdef __SSE2__
+	const __m128i iota = _mm_setr_epi8( 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15 );
+	__m128i inread = ( remain >= 16 ) ? _mm_set1_epi8( -1 ) : _mm_cmplt_epi8( iota, _mm_set1_epi8(remain) );
+	__m128i v = _mm_and_si128( _mm_loadu_si128((const __m128i *)(s+base)), _mm_set1_epi8(0xdf) );	// to upper case
+	__m128i a = _mm_and_si128( _mm_cmpeq_epi8(v, _mm_set1_epi8('A')), inread );
+	__m128i g = _mm_and_si128( _mm_cmpeq_epi8(v, _mm_set1_epi8('C')), inread );
+	__m128i t = _mm_and_si128( _mm_cmpeq_epi8(v, _mm_set1_epi8('G')), inread );
+	__m128i u = _mm_and_si128( _mm_cmpeq_epi8(v, _mm_set1_epi8('T')), inread );
+	__m128i n = _mm_andnot_si128( _mm_or_si128(_mm_or_si128(a, g), _mm_or_si128(t, u)), inread );
+	// a matched byte is 0xff, i.e., -1
+	register unsigned int k = st.stride;
+	_mm_storeu_si128( (__m128i *)(c),     _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(c)),     a) );
+	_mm_storeu_si128( (__m128i *)(c+k),   _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(c+k)),   g) );
+	_mm_storeu_si128( (__m128i *)(c+k*2), _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(c+k*2)), t) );
+	_mm_storeu_si128( (__m128i *)(c+k*3), _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(c+k*3)), u) );
+	_mm_storeu_si128( (__m128i *)(c+k*4), _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(c+k*4)), n) );
+#else
+	if( remain > 16 )
+		remain = 16;
+	for( register unsigned int i=0; i!=remain; ++i ) {
+		switch ( s[base+i] ) {
+			case 'a':
+			case 'A': ++ c[i]; break;
+			case 'c':
+			case 'C': ++ c[i+st.stride]; break;
+			case 'g':
+			case 'G': ++ c[i+st.stride*2]; break;
+			case 't':
+			case 'T': ++ c[i+st.stride*3]; break;
+			default : ++ c[i+st.stride*4]; break;
+		}
+	}
+#endif
+}
+
+// bitmask of the positions in [base, base+16) whose quality scores are no less than quality
+unsigned int inline good_quality_mask( const char *q, unsigned int base, char quality ) {
+#ifdef __SSE2__
+	return _mm_movemask_epi8( _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)(q+base)), _mm_set1_epi8(quality-1)) );
+#else
+	register unsigned int mask = 0;
+	for( register unsigned int i=0; i!=16; ++i )
+		if( q[base+i] >= quality )
+			mask |= 1 << i;
+	return mask;
+#endif
+}
+
+/*
+ * fused scan of a read pair: count the bases of both reads and find the quality-trimming position,
+ * i.e., 1 + the last position (except the first one) where the qualities of both reads are no less
+ * than quality; returns 1 if there is no such position
+ * the reads and qualities MUST be padded
+*/
+unsigned int inline scan_read_PE( base_stat & st1, base_stat & st2, const char *s1, const char *s2,
+									const char *q1, const char *q2, unsigned int seqLen, unsigned int qualLen, char quality ) {
+	register int last = 0;
+	register unsigned int mask;
+	for( register unsigned int base=0; base<seqLen || base<qualLen; base+=16 ) {
+		if( base < seqLen ) {
+			count_bases( st1, s1, base, seqLen-base );
+			count_bases( st2, s2, base, seqLen-base );
+		}
+		if( base < qualLen ) {
+			mask = good_quality_mask( q1, base, quality ) & good_quality_mask( q2, base, quality );
+			if( qualLen-base < 16 )
+				mask &= (1U << (qualLen-base)) - 1;
+			if( mask )
+				last = base + 31 - __builtin_clz( mask );
+		}
+	}
+	if( ++ st1.pending == BASE_STAT_FLUSH )
+		flush_base_stat( st1 );
+	if( ++ st2.pending == BASE_STAT_FLUSH )
+		flush_base_stat( st2 );
+
+	return ( qualLen==0 ) ? 0 : last+1;
+}
+
+unsigned int inline scan_read_SE( base_stat & st, const char *s, const char *q,
+									unsigned int seqLen, unsigned int qualLen, char quality ) {
+	register int last = 0;
+	register unsigned int mask;
+	for( register unsigned int base=0; base<seqLen || base<qualLen; base+=16 ) {
+		if( base < seqLen )
+			count_bases( st, s, base, seqLen-base );
+		if( base < qualLen ) {
+			mask = good_quality_mask( q, base, quality );
+			if( qualLen-base < 16 )
+				mask &= (1U << (qualLen-base)) - 1;
+			if( mask )
+				last = base + 31 - __builtin_clz( mask );
+		}
+	}
+	if( ++ st.pending == BASE_STAT_FLUSH )
+		flush_base_stat( st );
+
+	return ( qualLen==0 ) ? 0 : last+1;
+}
+
+#endif
+
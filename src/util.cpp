@@ -1,5 +1,6 @@
 #include <string>
 #include <iostream>
+#include <unistd.h>
 #include "util.h"
 
 using namespace std;
@@ -38,12 +39,56 @@ void loadgenome( const char * file, unordered_map<string, string> & genome ) {
 	fin.close();
 }
 
+void index_genome( unordered_map<string, string> & genome, chr_dict & dict, vector<const string *> & seq ) {
+	vector<string> names;
+	for( unordered_map<string, string> :: iterator it=genome.begin(); it!=genome.end(); ++it )
+		names.push_back( it->first );
+	sort( names.begin(), names.end() );
+
+	seq.clear();
+	for( unsigned int i=0; i!=names.size(); ++i ) {
+		add_chr( dict, names[i], genome.find(names[i])->second.size() - 1 );	// there is a leading X
+		seq.push_back( & genome.find(names[i])->second );
+	}
+}
+
+int add_chr( chr_dict & dict, const string & chr, unsigned int len ) {
+	unordered_map<string, int> :: iterator it = dict.id.find( chr );
+	if( it != dict.id.end() )
+		return it->second;
+
+	register int id = dict.name.size();
+	dict.id.insert( pair<string, int>(chr, id) );
+	dict.name.push_back( chr );
+	dict.len.push_back( len );
+	return id;
+}
+
+bool load_chr_dict( const char *chrinfo, chr_dict & dict ) {
+	ifstream fin( chrinfo );
+	if( fin.fail() ) {
+		cerr << "Error: could not open file '" << chrinfo << "'!\n";
+		return false;
+	}
+	string line;
+	while( getline(fin, line) ) {
+		if( line.empty() || line[0] == '#' )continue;
+		register size_t sep = line.find_first_of( " \t" );
+		add_chr( dict, line.substr(0, sep), (sep==string::npos) ? 0 : atoi(line.c_str()+sep+1) );
+	}
+	fin.close();
+	return true;
+}
+
 // fix cigar
 int get_readLen_from_cigar( const string &cigar ) {
+	return get_readLen_from_cigar( cigar.c_str(), cigar.size() );
+}
+
+int get_readLen_from_cigar( const char *p, unsigned int len ) {
 	register int i, j;
 	register int size = 0;
-	register int cs = cigar.size();
-	register const char * p = cigar.c_str();
+	register int cs = len;
 
 	for(i=0, j=0; i!=cs; ++i) {
 		if( p[i] <= '9' ) {   // digital
@@ -101,6 +146,99 @@ bool fix_cigar( string &cigar, string &realSEQ, string &realQUAL, string &seq, s
 	return true;
 }
 
+// Fibonacci hashing: the high bits of key*2^64/phi are well mixed even for the fragment keys
+// that only differ in the fragment size
+static inline uint64_t frag_slot_index( uint64_t key, unsigned int bits ) {
+	return ( key * 0x9E3779B97F4A7C15ULL ) >> ( 64 - bits );
+}
+
+void init_frag_table( frag_table & t, uint64_t expected ) {
+	t.bits = FRAG_TABLE_MIN_BITS;
+	while( (1ULL << t.bits) * FRAG_TABLE_LOAD < expected * 100 )
+		++ t.bits;
+	t.size = 0;
+	t.slot = new frag_slot [ 1ULL << t.bits ];
+	memset( t.slot, 0, (1ULL << t.bits) * sizeof(frag_slot) );
+}
+
+void init_frag_tables( vector<frag_table> & tables, const chr_dict & chrs, unsigned int readNum ) {
+	uint64_t total = 0;
+	for( unsigned int i=0; i!=chrs.len.size(); ++i )
+		total += chrs.len[i];
+
+	tables.resize( chrs.name.size() );
+	for( unsigned int i=0; i!=tables.size(); ++i ) {
+		uint64_t expected = total ? (uint64_t)readNum * chrs.len[i] / total : readNum / tables.size();
+		init_frag_table( tables[i], expected );
+	}
+}
+
+void free_frag_table( frag_table & t ) {
+	delete [] t.slot;
+	t.slot = NULL;
+}
+
+// double the table and re-insert the keys
+static void grow_frag_table( frag_table & t ) {
+	frag_slot *old = t.slot;
+	uint64_t oldSize = 1ULL << t.bits;
+	++ t.bits;
+	register uint64_t mask = ( 1ULL << t.bits ) - 1;
+	t.slot = new frag_slot [ mask + 1 ];
+	memset( t.slot, 0, (mask+1) * sizeof(frag_slot) );
+	for( register uint64_t i=0; i!=oldSize; ++i ) {
+		if( old[i].hit.lineNum == 0 )
+			continue;
+		register uint64_t j = frag_slot_index( old[i].key, t.bits );
+		while( t.slot[j].hit.lineNum != 0 )
+			j = ( j + 1 ) & mask;
+		t.slot[j] = old[i];
+	}
+	delete [] old;
+}
+
+unsigned int mark_duplicate( frag_table & t, uint64_t key, unsigned int lineNum, unsigned int score ) {
+	register uint64_t mask = ( 1ULL << t.bits ) - 1;
+	register uint64_t i = frag_slot_index( key, t.bits );
+	while( true ) {
+		frag_slot & s = t.slot[i];
+		if( s.hit.lineNum == 0 ) {	// no such record, add this one
+			s.key = key;
+			s.hit.lineNum = lineNum;
+			s.hit.score = score;
+			if( ++t.size * 100 > (mask+1) * FRAG_TABLE_LOAD )
+				grow_frag_table( t );
+			return 0;
+		}
+		if( s.key == key ) {	// there must be a duplicate
+			if( s.hit.score >= score ) {	// the previous one is better, mark this one as duplicate
+				return lineNum;
+			} else {	// this one is better, then mark the previous one as duplicate and update the record
+				register unsigned int prev = s.hit.lineNum;
+				s.hit.lineNum = lineNum;
+				s.hit.score = score;
+				return prev;
+			}
+		}
+		i = ( i + 1 ) & mask;
+	}
+}
+
+bool copy_sam_range( int fd, uint64_t offset, size_t len, ofstream & fout, string & buf ) {
+	buf.resize( len );
+	size_t done = 0;
+	while( done != len ) {
+		ssize_t n = pread( fd, &buf[done], len-done, offset+done );
+		if( n <= 0 )
+			return false;
+		done += n;
+	}
+	if( len!=0 && buf[len-1]!='\n' )
+		buf += '\n';
+	fout.write( buf.data(), buf.size() );
+	return true;
+}
+
 void call_meth_usage( const char * prg ) {
 	cerr << "\nUsage: " << prg << " <mode=SE|PE> <genome.fa> <Msuite.sam> <TAPS|BS> <cycle> <min.score> <output.prefix>\n"
 		 << "\nThis program is a component of TAPSuite, designed to call CpG methylation status from SAM file.\n"
@@ -3,8 +3,16 @@
 #include <string>
 #include <sstream>
 #include <map>
+#include <vector>
+#include <algorithm>
 #include <tr1/unordered_map>
+#include <tr1/unordered_set>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 using namespace std::tr1;
@@ -35,6 +43,69 @@ typedef struct {
 	unsigned int score;
 }fraghit;
 
+/*
+ * rmdup: open-addressing hash table of the fragment keys (one table per chromosome); the hits are
+ * stored inline in the slots and the collisions are resolved by linear probing, so that there is
+ * no allocation per fragment and a probe usually touches a single cache line
+ * line numbers start from 1, so lineNum==0 marks an empty slot
+*/
+typedef struct {
+	uint64_t key;
+	fraghit hit;
+} frag_slot;
+
+typedef struct {
+	frag_slot *slot;
+	unsigned int bits;	// the table has 2^bits slots
+	uint64_t size;		// number of keys
+} frag_table;
+
+const unsigned int FRAG_TABLE_MIN_BITS = 10;
+const unsigned int FRAG_TABLE_LOAD = 70;	// the table is doubled when it is more than 70% full
+
+// prepare a table for about expected keys
+void init_frag_table( frag_table & t, uint64_t expected );
+void free_frag_table( frag_table & t );
+
+const unsigned int FRAG_KEYS_PER_BATCH = 1 << 16;	// fragment keys loaded at a time by rmdup
+const size_t FRAG_COPY_BUFFER = 1 << 22;			// kept records are copied in blocks of at most 4 MB
+
+/*
+ * rmdup: the duplicate/discard status of the records is kept in bit arrays indexed by the line
+ * number (which starts from 1 and is at most the read number in trim.log), i.e., 1 bit per record
+ * instead of a hash set entry; the fragment sizes are kept as 16-bit values
+*/
+typedef unsigned short frag_size_t;
+const unsigned int MAX_FRAG_SIZE = 0xffff;	// larger fragments are recorded as this size
+
+uint64_t inline * new_line_bits( unsigned int lines ) {
+	register unsigned int words = ( lines >> 6 ) + 1;
+	uint64_t *bits = new uint64_t [ words ];
+	memset( bits, 0, words * sizeof(uint64_t) );
+	return bits;
+}
+
+void inline set_line_bit( uint64_t *bits, unsigned int line ) {
+	bits[ line >> 6 ] |= 1ULL << ( line & 63 );
+}
+
+// for multiple threads setting the bits in the same array
+void inline set_line_bit_atomic( uint64_t *bits, unsigned int line ) {
+	__sync_fetch_and_or( bits + (line >> 6), 1ULL << (line & 63) );
+}
+
+bool inline test_line_bit( const uint64_t *bits, unsigned int line ) {
+	return ( bits[ line >> 6 ] >> ( line & 63 ) ) & 1;
+}
+
+// number of bits set in the array for lines
+unsigned int inline count_line_bits( const uint64_t *bits, unsigned int lines ) {
+	register unsigned int n = 0;
+	for( register unsigned int i=0, words=(lines>>6)+1; i!=words; ++i )
+		n += __builtin_popcountll( bits[i] );
+	return n;
+}
+
 // methylation call
 typedef struct {
 	unsigned short wC;	// 'C' on watson chain
@@ -55,12 +126,159 @@ typedef struct {
 	unsigned int cZ;
 }mbias;
 
+/*
+ * SAM record view: the line is split into fields in place (the fields are NOT copied), so the tools
+ * could parse the records without stringstream and heap allocations
+ * the TABs are searched 16 bytes at a time with SSE2 (if available)
+ * field i is [start[i], start[i+1]-1), i.e., start[n] is one byte after the end of the last field
+*/
+enum { SAM_QNAME=0, SAM_FLAG, SAM_RNAME, SAM_POS, SAM_MAPQ, SAM_CIGAR,
+	   SAM_RNEXT, SAM_PNEXT, SAM_TLEN, SAM_SEQ, SAM_QUAL, SAM_TAGS };
+const unsigned int SAM_VIEW_MAX_FIELDS = 32;
+
+typedef struct {
+	const char *start[ SAM_VIEW_MAX_FIELDS+1 ];
+	unsigned int n;	// number of fields
+} sam_view;
+
+// split the line (without '\n') into at most maxField fields, returns the number of fields
+unsigned int inline sam_view_split( sam_view & v, const char *line, size_t len, unsigned int maxField=SAM_VIEW_MAX_FIELDS ) {
+	register const char *p = line;
+	register const char *end = line + len;
+	register unsigned int n = 0;
+	v.start[0] = line;
+#ifdef __SSE2__
+	const __m128i tab = _mm_set1_epi8( '\t' );
+	for( ; p+16 <= end; p += 16 ) {
+		register unsigned int mask = _mm_movemask_epi8( _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), tab) );
+		while( mask ) {
+			v.start[ ++n ] = p + __builtin_ctz( mask ) + 1;
+			if( n == maxField )
+				return v.n = n;
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for( ; p != end; ++p ) {
+		if( *p == '\t' ) {
+			v.start[ ++n ] = p + 1;
+			if( n == maxField )
+				return v.n = n;
+		}
+	}
+	v.start[ ++n ] = end + 1;
+	return v.n = n;
+}
+
+unsigned int inline sam_view_split( sam_view & v, const string & line, unsigned int maxField=SAM_VIEW_MAX_FIELDS ) {
+	return sam_view_split( v, line.data(), line.size(), maxField );
+}
+
+unsigned int inline sam_view_length( const sam_view & v, unsigned int k ) {
+	return v.start[k+1] - v.start[k] - 1;
+}
+
+// parse an integer (could be negative) without locale, stops at the first non-digital
+int inline sam_atoi( register const char *p ) {
+	register bool negative = ( *p == '-' );
+	if( negative )
+		++ p;
+	register int value = 0;
+	for( ; *p>='0' && *p<='9'; ++p ) {
+		value *= 10;
+		value += *p - '0';
+	}
+	return negative ? -value : value;
+}
+
+int inline sam_view_int( const sam_view & v, unsigned int k ) {
+	return sam_atoi( v.start[k] );
+}
+
+void inline sam_view_copy( const sam_view & v, unsigned int k, string & s ) {
+	s.assign( v.start[k], sam_view_length(v, k) );
+}
+
+// copy the field into a buffer of size bytes (truncated if needed) and terminate it
+void inline sam_view_copy( const sam_view & v, unsigned int k, char *dst, unsigned int size ) {
+	register unsigned int len = sam_view_length( v, k );
+	if( len >= size )
+		len = size - 1;
+	memcpy( dst, v.start[k], len );
+	dst[len] = 0;
+}
+
+// sum of the bytes in the field, e.g., the quality scores
+unsigned int inline sam_view_sum( const sam_view & v, unsigned int k ) {
+	register unsigned int sum = 0;
+	register const char *p = v.start[k];
+	register const char *end = v.start[k+1] - 1;
+	for( ; p != end; ++p )
+		sum += *p;
+	return sum;
+}
+
+// value of the tag (e.g., "AS" for AS:i:-6) in the split fields, NULL if not found
+const char inline * sam_view_tag( const sam_view & v, const char *tag ) {
+	for( register unsigned int i=SAM_TAGS; i<v.n; ++i ) {
+		register const char *p = v.start[i];
+		if( p[0]==tag[0] && p[1]==tag[1] && p[2]==':' )
+			return p + 5;
+	}
+	return NULL;
+}
+
+/*
+ * chromosome dictionary: the chromosome names are mapped to dense IDs (0, 1, ...) once, then
+ * the per-read structures are indexed by the ID and the RNAME of each record is hashed only once
+*/
+typedef struct {
+	vector<string> name;		// name of each ID
+	vector<unsigned int> len;	// length of each ID (0 if unknown)
+	unordered_map<string, int> id;
+	string key;		// lookup buffer, so that no string is allocated for each record
+} chr_dict;
+
+// returns the ID of the chromosome (a new one if it is not in the dictionary yet)
+int add_chr( chr_dict & dict, const string & chr, unsigned int len=0 );
+// load the chromosomes in chr.info (the IDs are the same as the references in the BAM files)
+bool load_chr_dict( const char *chrinfo, chr_dict & dict );
+
+// ID of the chromosome, -1 if it is not in the dictionary
+// (key is the lookup buffer; each thread needs its own one)
+int inline find_chr( const chr_dict & dict, const char *chr, unsigned int len, string & key ) {
+	key.assign( chr, len );
+	unordered_map<string, int> :: const_iterator it = dict.id.find( key );
+	return ( it == dict.id.end() ) ? -1 : it->second;
+}
+
+int inline find_chr( chr_dict & dict, const char *chr, unsigned int len ) {
+	return find_chr( dict, chr, len, dict.key );
+}
+
+int inline find_chr( chr_dict & dict, const sam_view & v ) {
+	return find_chr( dict, v.start[SAM_RNAME], sam_view_length(v, SAM_RNAME) );
+}
+
 // load genome from multi-fasta
 void loadgenome( const char * file, unordered_map<string, string> & genome );
+// index the loaded genome by chromosome ID; the IDs follow the order of the names,
+// so the results could be written chromosome by chromosome in that order
+void index_genome( unordered_map<string, string> & genome, chr_dict & dict, vector<const string *> & seq );
 // fix cigar
 int get_readLen_from_cigar( const string &cigar );
+int get_readLen_from_cigar( const char *cigar, unsigned int len );
 bool fix_cigar(string &cigar, string &realSEQ, string &realQUAL, string &seq, string &qual);
 
+// rmdup: keep the one with the highest score among the fragments with the same key
+// one table per chromosome; the reads are expected to be distributed by the chromosome lengths
+void init_frag_tables( vector<frag_table> & tables, const chr_dict & chrs, unsigned int readNum );
+// returns the line to be marked as duplicate (0 if there is none)
+unsigned int mark_duplicate( frag_table & t, uint64_t key, unsigned int lineNum, unsigned int score );
+// rmdup: copy [offset, offset+len) of the SAM file to fout; the copied text is left in buf
+// ('\n' is added if the range is the last line of the file that does not end with it)
+bool copy_sam_range( int fd, uint64_t offset, size_t len, ofstream & fout, string & buf );
+
 // usage information for meth.call
 void call_meth_usage( const char * prg );
 